@@ -29,25 +29,68 @@ layout(std430, binding = 2) buffer SphereData2Buffer {
     vec4 sphereData2[];
 };
 
+// A node corner and an offset, the offset is a real int so it stays exact past 2^24
+struct OctreeNodeCorner {
+    vec3 corner;
+    int offset;
+};
+
 layout(std430, binding = 3) buffer OctreeNodeBuffer {
-    vec4 octreeNodes[];
+    OctreeNodeCorner octreeNodes[]; // min, childrenOffset
 };
 
 layout(std430, binding = 4) buffer OctreeNode2Buffer {
-    vec4 octreeNodes2[];
+    OctreeNodeCorner octreeNodes2[]; // max, objectsOffset
 };
 
 layout(std430, binding = 5) buffer OctreeCountsBuffer {
-    int octreeObjectCounts[];
+    uint octreeObjectCounts[]; // objectCount | childMask << 24, only the children in childMask are stored
 };
 
 layout(std430, binding = 6) buffer ObjectIndicesBuffer {
-    int objectIndices[];
+    uint objectIndices[]; // two 16 bit indices per word (low half first) when objectIndexBits is 16
+};
+
+// Compact node (GPUCompactNode on the CPU): the child boxes are 4 bit fractions of the node box
+struct CompactNode {
+    uint offset;        // childrenOffset for internal nodes, objectsOffset for leaves
+    uint info;          // bits 0-7: non-empty children mask (0 for leaves), bits 8-31: objectCount
+    uint childBoxes[6]; // min.xyz, max.xyz - 1; child i at bits 4i
+};
+
+layout(std430, binding = 7) buffer OctreeCompactBuffer {
+    CompactNode compactNodes[];
+};
+
+layout(std430, binding = 8) buffer OctreeSplitBuffer {
+    vec4 octreeSplits[]; // split.xyz, the corner shared by the children (not the box center with SAH splits)
+};
+
+// Cell and face neighbours of a node (GPURopeNode on the CPU): face f is on axis f / 2 (x, y, z), its min side if f is even.
+// The rope is the deepest node whose cell holds the whole face from the other side, -1 on the root cell's faces
+struct RopeNode {
+    vec4 cellMin;
+    vec4 cellMax;
+    int ropes[6];
+};
+
+layout(std430, binding = 9) buffer OctreeRopeBuffer {
+    RopeNode ropeNodes[]; // only with useRopes, same indices as octreeNodes
 };
 
 uniform int useOctree;
 uniform int octreeNodeCount;
+uniform int useCompactNodes;
+uniform int useRopes; // stackless traversal along ropeNodes, not for loose octrees
+uniform int mailboxSize; // spheres each ray remembers having tested, 0 to MAX_MAILBOX
+uniform int looseOctree;
+uniform vec3 octreeRootMin;
+uniform vec3 octreeRootMax;
+uniform vec3 octreeCellMin; // Root cell the splits divide, octreeRoot shrunk by tightBounds is inside it
+uniform vec3 octreeCellMax;
+uniform int tightNodeBoxes; // Octree::hasTightBounds, node boxes are smaller than their cells
 uniform int sphereCount;
+uniform int objectIndexBits; // 16 or 32, Octree::indexBits
 
 uniform int numSamples;
 uniform int maxDepth;
@@ -287,192 +330,398 @@ bool rayBoxIntersection(Ray ray, vec3 boxMin, vec3 boxMax, out float tmin, out f
     return tmax >= tmin;
 }
 
+// Index of the child in `octant`, only the octants in childMask have a node and they are stored in order
+int childIndex(int childrenOffset, uint childMask, int octant) {
+    return childrenOffset + bitCount(childMask & ((1u << octant) - 1u));
+}
+
+// Sphere index i of the object index buffer, unpacked from its 16 bit half of a word if the indices are packed
+int objectIndex(int i) {
+    if (objectIndexBits == 16) return int((objectIndices[i >> 1] >> ((i & 1) << 4)) & 0xffffu);
+    return int(objectIndices[i]);
+}
+
+// Mailbox of the current ray: the last mailboxSize spheres it tested, in a ring. Unless the octree is loose a sphere is in
+// every leaf it overlaps, and one tested already either missed over a longer interval or is the closest hit
+const int MAX_MAILBOX = 16;
+int mailboxIds[MAX_MAILBOX];
+int mailboxNext;
+
+void mailboxClear() {
+    for (int i = 0; i < mailboxSize; i++) mailboxIds[i] = -1;
+    mailboxNext = 0;
+}
+
+// True if the ray tested sphereIdx already, otherwise it is remembered
+bool mailboxSkip(int sphereIdx) {
+    for (int i = 0; i < mailboxSize; i++) {
+        if (mailboxIds[i] == sphereIdx) return true;
+    }
+    if (mailboxSize > 0) {
+        mailboxIds[mailboxNext] = sphereIdx;
+        mailboxNext = mailboxNext + 1 == mailboxSize ? 0 : mailboxNext + 1;
+    }
+    return false;
+}
+
+// 1 / direction, with zero components made tiny instead so plane crossings stay finite. -0 counts as positive, as in firstOctant
+vec3 safeInverse(vec3 direction) {
+    vec3 tiny = mix(vec3(1e-20), vec3(-1e-20), lessThan(direction, vec3(0.0)));
+    return 1.0 / mix(direction, tiny, lessThan(abs(direction), vec3(1e-20)));
+}
+
+// Octant the ray enters a cell through, the children are then visited in the order i ^ firstOctant, i = 0 to 7: along each
+// axis the ray crosses the split plane at most once, from the side of firstOctant. Bits are z << 2 | x << 1 | y like octants
+int firstOctant(vec3 direction) {
+    return (direction.z < 0.0 ? 4 : 0) | (direction.x < 0.0 ? 2 : 0) | (direction.y < 0.0 ? 1 : 0);
+}
+
+// Loose octrees have objects sticking out of their cells, so their boxes are what the ray is tested against. Sibling boxes
+// overlap and the order is only roughly front to back: a node is skipped when the ray enters it past the closest hit
+bool traverseLooseOctree(Ray ray, float t_min, float t_max, inout IntersectInfo rec) {
+    const int MAX_STACK = 200;
+    int nodeStack[MAX_STACK];
+    float tminStack[MAX_STACK];
+
+    float childTMin, childTMax;
+    if (!rayBoxIntersection(ray, octreeNodes[0].corner, octreeNodes2[0].corner, childTMin, childTMax) ||
+        childTMax < t_min || childTMin > t_max) {
+        return false;
+    }
+
+    int stackPtr = 0;
+    nodeStack[0] = 0;
+    tminStack[0] = max(childTMin, t_min);
+
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+    int first = firstOctant(ray.direction);
+
+    while (stackPtr >= 0) {
+        int nodeIdx = nodeStack[stackPtr];
+        float node_tmin = tminStack[stackPtr--];
+        if (node_tmin > closest_so_far) continue; // a closer hit was found since it was pushed
+
+        int childrenOffset = octreeNodes[nodeIdx].offset;
+        int objectsOffset = octreeNodes2[nodeIdx].offset;
+        uint countAndMask = octreeObjectCounts[nodeIdx];
+        int objectCount = int(countAndMask & 0xffffffu);
+        uint childMask = countAndMask >> 24;
+
+        // Internal nodes hold objects too
+        for (int i = 0; i < objectCount; i++) {
+            IntersectInfo temp_rec;
+            if (Sphere_hit(objectIndex(objectsOffset + i), ray, t_min, closest_so_far, temp_rec)) {
+                hit_anything = true;
+                closest_so_far = temp_rec.t;
+                rec = temp_rec;
+            }
+        }
+
+        if (childrenOffset != -1) {
+            // Furthest to closest on the stack
+            for (int i = 7; i >= 0; i--) {
+                int octant = i ^ first;
+                if ((childMask & (1u << octant)) == 0u) continue; // empty octant, it has no node
+
+                int childIdx = childIndex(childrenOffset, childMask, octant);
+                if (childIdx >= octreeNodeCount) continue;
+
+                if (!rayBoxIntersection(ray, octreeNodes[childIdx].corner, octreeNodes2[childIdx].corner, childTMin, childTMax) ||
+                    childTMax < node_tmin || childTMin > closest_so_far) {
+                    continue; // Skip non-intersecting children
+                }
+
+                if (stackPtr < MAX_STACK - 1) {
+                    stackPtr++;
+                    nodeStack[stackPtr] = childIdx;
+                    tminStack[stackPtr] = max(childTMin, node_tmin);
+                }
+            }
+        }
+    }
+    return hit_anything;
+}
+
+// Front to back traversal of the cells: a child's t interval is cut from its parent's by the ray's crossings of the split
+// planes, so no child box is read or tested, and children go on the stack furthest first. Cells are then popped in ray
+// order, and the traversal stops at the first one entered past the closest hit. Spheres are tested over the whole ray,
+// a sphere may stick out of the leaf it is in
 bool traverseOctree(Ray ray, float t_min, float t_max, inout IntersectInfo rec) {
+    if (looseOctree == 1) return traverseLooseOctree(ray, t_min, t_max, rec);
+
     const int MAX_STACK = 200;
     int nodeStack[MAX_STACK];
     float tminStack[MAX_STACK];
     float tmaxStack[MAX_STACK];
-    
+
+    vec3 invDir = safeInverse(ray.direction);
+    int first = firstOctant(ray.direction);
+
+    // Root cell interval, clipped to the ray
+    vec3 tbot = (octreeCellMin - ray.origin) * invDir;
+    vec3 ttop = (octreeCellMax - ray.origin) * invDir;
+    vec3 tmin3 = min(tbot, ttop);
+    vec3 tmax3 = max(tbot, ttop);
+    float rootTMin = max(max(max(tmin3.x, tmin3.y), tmin3.z), t_min);
+    float rootTMax = min(min(min(tmax3.x, tmax3.y), tmax3.z), t_max);
+    if (rootTMin > rootTMax) return false;
+
     int stackPtr = 0;
     nodeStack[0] = 0;
-    tminStack[0] = t_min;
-    tmaxStack[0] = t_max;
-    
+    tminStack[0] = rootTMin;
+    tmaxStack[0] = rootTMax;
+
     bool hit_anything = false;
     float closest_so_far = t_max;
 
-    vec4 node1 = octreeNodes[0];
-    vec4 node2 = octreeNodes2[0];
-    vec3 nodeMin = node1.xyz;
-    vec3 nodeMax = node2.xyz;
-    float childTMin, childTMax;
-    if (!rayBoxIntersection(ray, nodeMin, nodeMax, childTMin, childTMax)){
-        return false;
-    }
     while (stackPtr >= 0) {
         int nodeIdx = nodeStack[stackPtr];
         float node_tmin = tminStack[stackPtr];
         float node_tmax = tmaxStack[stackPtr--];
-        
-        // Get node
-        node1 = octreeNodes[nodeIdx];
-        node2 = octreeNodes2[nodeIdx];
-        nodeMin = node1.xyz;
-        nodeMax = node2.xyz;
-        int childrenOffset = int(node1.w);
-        int objectsOffset = int(node2.w);
-        int objectCount = octreeObjectCounts[nodeIdx];
-        
-        // Test objects in leaf nodes
-        if (childrenOffset == -1) {
+        if (node_tmin > closest_so_far) break; // every cell left on the stack is further along the ray
+
+        uint countAndMask = octreeObjectCounts[nodeIdx];
+        uint childMask = countAndMask >> 24;
+        int objectCount = int(countAndMask & 0xffffffu);
+        if (childMask == 0u && objectCount == 0) continue;
+
+        // A tight box is smaller than the cell and holds the boxes of the children, the ray may miss it and all below it
+        float boxTMin, boxTMax;
+        if (tightNodeBoxes == 1 &&
+            (!rayBoxIntersection(ray, octreeNodes[nodeIdx].corner, octreeNodes2[nodeIdx].corner, boxTMin, boxTMax) ||
+             boxTMax < t_min || boxTMin > closest_so_far)) {
+            continue;
+        }
+
+        if (childMask == 0u) {
+            int objectsOffset = octreeNodes2[nodeIdx].offset;
             for (int i = 0; i < objectCount; i++) {
-                //int sphereIdx = objectIndices[objectsOffset + i];
-                
+                int sphereIdx = objectIndex(objectsOffset + i);
+                if (mailboxSkip(sphereIdx)) continue;
                 IntersectInfo temp_rec;
-                if (Sphere_hit(objectIndices[objectsOffset + i], ray, node_tmin, closest_so_far, temp_rec)) {
+                if (Sphere_hit(sphereIdx, ray, t_min, closest_so_far, temp_rec)) {
                     hit_anything = true;
                     closest_so_far = temp_rec.t;
                     rec = temp_rec;
-                    stackPtr = -1; // Exit the loop early if we hit something
                 }
             }
-        } 
-        else {
-            int traversalOrder[8];
-            vec3 comparitor = vec3(0.0, 0.0, 0.0);
-
-            // Determine traversal order based on ray direction
-            if (ray.direction.x < 0.0) comparitor.x = -1.0;
-            else if (ray.direction.x > 0.0) comparitor.x = 1.0;
-            if (ray.direction.y < 0.0) comparitor.y = -1.0;
-            else if (ray.direction.y > 0.0) comparitor.y = 1.0;
-            if (ray.direction.z < 0.0) comparitor.z = -1.0;
-            else if (ray.direction.z > 0.0) comparitor.z = 1.0;
-            // Determine traversal order based on ray direction
-            if (comparitor == vec3(1.0, 1.0, 1.0)) {
-                //cyan
-                traversalOrder[0] = 0; 
-                traversalOrder[1] = 1; 
-                traversalOrder[2] = 2; 
-                traversalOrder[3] = 3; 
-                traversalOrder[4] = 4; 
-                traversalOrder[5] = 5; 
-                traversalOrder[6] = 6; 
-                traversalOrder[7] = 7; 
-            } 
-            else if (comparitor == vec3(-1.0, 1.0, 1.0) || comparitor == vec3(-1.0, 1.0, 0.0) || 
-                     comparitor == vec3(0.0, 1.0, 0.0) || comparitor == vec3(0.0, 1.0, 1.0)) {
-                //yellow
-                traversalOrder[0] = 2; 
-                traversalOrder[1] = 0; 
-                traversalOrder[2] = 3; 
-                traversalOrder[3] = 1; 
-                traversalOrder[4] = 6; 
-                traversalOrder[5] = 4; 
-                traversalOrder[6] = 7; 
-                traversalOrder[7] = 5; 
-            } 
-            else if (comparitor == vec3(-1.0, -1.0, 1.0) || comparitor == vec3(-1.0, 0.0, 1.0) || 
-                     comparitor == vec3(0.0, 0.0, 1.0) || comparitor == vec3(0.0, -1.0, 1.0) ||
-                     comparitor == vec3(-1.0, -1.0, 0.0) || comparitor == vec3(0.0, -1.0, 0.0) ||
-                     comparitor == vec3(-1.0, 0.0, 0.0)) {
-                //red
-                traversalOrder[0] = 3; 
-                traversalOrder[1] = 1; 
-                traversalOrder[2] = 2; 
-                traversalOrder[3] = 0; 
-                traversalOrder[4] = 7; 
-                traversalOrder[5] = 5; 
-                traversalOrder[6] = 6; 
-                traversalOrder[7] = 4; 
-            } 
-            else if (comparitor == vec3(1.0, -1.0, 1.0) || comparitor == vec3(1.0, 0.0, 1.0) ||
-                     comparitor == vec3(1.0, -1.0, 0.0) || comparitor == vec3(1.0, 0.0, 0.0)) {
-                //dark purple
-                traversalOrder[0] = 1;
-                traversalOrder[1] = 0;
-                traversalOrder[2] = 3;
-                traversalOrder[3] = 2;
-                traversalOrder[4] = 5;
-                traversalOrder[5] = 4;
-                traversalOrder[6] = 7;
-                traversalOrder[7] = 6;
+            continue;
+        }
+
+        // Where the ray crosses the three split planes, each child is before or after the crossing along each axis
+        int childrenOffset = octreeNodes[nodeIdx].offset;
+        vec3 tSplit = (octreeSplits[nodeIdx].xyz - ray.origin) * invDir;
+        for (int i = 7; i >= 0; i--) {
+            int octant = i ^ first;
+            if ((childMask & (1u << octant)) == 0u) continue; // empty octant, it has no node
+
+            float childTMin = node_tmin;
+            float childTMax = node_tmax;
+            if ((i & 4) != 0) childTMin = max(childTMin, tSplit.z); else childTMax = min(childTMax, tSplit.z);
+            if ((i & 2) != 0) childTMin = max(childTMin, tSplit.x); else childTMax = min(childTMax, tSplit.x);
+            if ((i & 1) != 0) childTMin = max(childTMin, tSplit.y); else childTMax = min(childTMax, tSplit.y);
+            if (childTMin > childTMax || childTMin > closest_so_far) continue; // the ray misses the child, or gets there too late
+
+            if (stackPtr < MAX_STACK - 1) {
+                stackPtr++;
+                nodeStack[stackPtr] = childIndex(childrenOffset, childMask, octant);
+                tminStack[stackPtr] = childTMin;
+                tmaxStack[stackPtr] = childTMax;
             }
-            else if (comparitor == vec3(1.0, 1.0, -1.0) || comparitor == vec3(1.0, 0.0, -1.0) ||
-                     comparitor == vec3(0.0, 1.0, -1.0) || comparitor == vec3(1.0, 1.0, 0.0)) {
-                //blue
-                traversalOrder[0] = 4; 
-                traversalOrder[1] = 5; 
-                traversalOrder[2] = 6; 
-                traversalOrder[3] = 7; 
-                traversalOrder[4] = 0; 
-                traversalOrder[5] = 1; 
-                traversalOrder[6] = 2; 
-                traversalOrder[7] = 3; 
-            } 
-            else if (comparitor == vec3(-1.0, 1.0, -1.0)) {
-                //purple
-                traversalOrder[0] = 6; 
-                traversalOrder[1] = 4; 
-                traversalOrder[2] = 7; 
-                traversalOrder[3] = 5; 
-                traversalOrder[4] = 2; 
-                traversalOrder[5] = 0; 
-                traversalOrder[6] = 3; 
-                traversalOrder[7] = 1;
-            } 
-            else if (comparitor == vec3(-1.0, -1.0, -1.0) || comparitor == vec3(-1.0, 0.0, -1.0) ||
-                     comparitor == vec3(0.0, -1.0, -1.0) || comparitor == vec3(0.0, 0.0, -1.0)) {
-                //green
-                traversalOrder[0] = 7; 
-                traversalOrder[1] = 5; 
-                traversalOrder[2] = 6; 
-                traversalOrder[3] = 4; 
-                traversalOrder[4] = 3; 
-                traversalOrder[5] = 1; 
-                traversalOrder[6] = 2; 
-                traversalOrder[7] = 0;
-            } else if (comparitor == vec3(1.0, -1.0, -1.0)) {
-                //black
-                traversalOrder[0] = 5;
-                traversalOrder[1] = 4;
-                traversalOrder[2] = 7;
-                traversalOrder[3] = 6;
-                traversalOrder[4] = 1;
-                traversalOrder[5] = 0;
-                traversalOrder[6] = 3;
-                traversalOrder[7] = 2;
-            } else {
-                // Default case, should not happen
+        }
+    }
+    return hit_anything;
+}
+
+// Parameter where the ray leaves the cell [cellMin, cellMax], and the face it leaves through (see RopeNode)
+float cellExit(Ray ray, vec3 invDir, vec3 cellMin, vec3 cellMax, out int face) {
+    float tExit = 3.402823e38;
+    face = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        bool positive = !(ray.direction[axis] < 0.0);
+        float t = ((positive ? cellMax[axis] : cellMin[axis]) - ray.origin[axis]) * invDir[axis];
+        if (t < tExit) {
+            tExit = t;
+            face = 2 * axis + (positive ? 1 : 0);
+        }
+    }
+    return tExit;
+}
+
+// Stackless traversal along the ropes: from the node it enters, the ray goes down to the cell it is in just after t and on
+// to the cell's exit, through a leaf's rope, through the parent again for an empty octant left through a split, or through
+// the parent's rope for one left through the parent's face. It stops at the first exit past the closest hit or the root cell
+bool traverseRopes(Ray ray, float t_min, float t_max, inout IntersectInfo rec) {
+    vec3 invDir = safeInverse(ray.direction);
+    int first = firstOctant(ray.direction);
+
+    // Root cell interval, clipped to the ray
+    vec3 tbot = (octreeCellMin - ray.origin) * invDir;
+    vec3 ttop = (octreeCellMax - ray.origin) * invDir;
+    vec3 tmin3 = min(tbot, ttop);
+    vec3 tmax3 = max(tbot, ttop);
+    float t = max(max(max(tmin3.x, tmin3.y), tmin3.z), t_min);
+    float rootTMax = min(min(min(tmax3.x, tmax3.y), tmax3.z), t_max);
+    if (t > rootTMax) return false;
+
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+    int nodeIdx = 0;
+
+    while (nodeIdx != -1) {
+        vec3 cellMin = ropeNodes[nodeIdx].cellMin.xyz;
+        vec3 cellMax = ropeNodes[nodeIdx].cellMax.xyz;
+        vec3 parentMin = cellMin;
+        vec3 parentMax = cellMax;
+        int parent = -1;
+
+        // Down to the leaf, or the empty octant, holding the ray just after t
+        uint countAndMask = octreeObjectCounts[nodeIdx];
+        while ((countAndMask >> 24) != 0u) {
+            uint childMask = countAndMask >> 24;
+            vec3 split = octreeSplits[nodeIdx].xyz;
+            vec3 tSplit = (split - ray.origin) * invDir;
+            int octant = ((t >= tSplit.z ? 4 : 0) | (t >= tSplit.x ? 2 : 0) | (t >= tSplit.y ? 1 : 0)) ^ first;
+
+            parent = nodeIdx;
+            parentMin = cellMin;
+            parentMax = cellMax;
+            bvec3 high = bvec3((octant & 2) != 0, (octant & 1) != 0, (octant & 4) != 0);
+            cellMin = mix(parentMin, split, high);
+            cellMax = mix(split, parentMax, high);
+            if ((childMask & (1u << octant)) == 0u) {
+                nodeIdx = -1;
+                break;
             }
+            nodeIdx = childIndex(octreeNodes[nodeIdx].offset, childMask, octant);
+            countAndMask = octreeObjectCounts[nodeIdx];
+        }
 
-            
-            // Process children in the optimal order (furthest to closest on stack)
-            // This ensures we process closest nodes first when popping
+        int face;
+        float tExit = cellExit(ray, invDir, cellMin, cellMax, face);
+
+        if (nodeIdx != -1) {
+            int objectCount = int(countAndMask & 0xffffffu);
+            // A tight box is smaller than the cell, the ray may miss it
+            float boxTMin, boxTMax;
+            bool missed = objectCount == 0 ||
+                (tightNodeBoxes == 1 &&
+                 (!rayBoxIntersection(ray, octreeNodes[nodeIdx].corner, octreeNodes2[nodeIdx].corner, boxTMin, boxTMax) ||
+                  boxTMax < t_min || boxTMin > closest_so_far));
+            if (!missed) {
+                int objectsOffset = octreeNodes2[nodeIdx].offset;
+                for (int i = 0; i < objectCount; i++) {
+                    int sphereIdx = objectIndex(objectsOffset + i);
+                    if (mailboxSkip(sphereIdx)) continue;
+                    IntersectInfo temp_rec;
+                    if (Sphere_hit(sphereIdx, ray, t_min, closest_so_far, temp_rec)) {
+                        hit_anything = true;
+                        closest_so_far = temp_rec.t;
+                        rec = temp_rec;
+                    }
+                }
+            }
+        }
+
+        // Every cell after this one starts at tExit
+        if (tExit >= closest_so_far || tExit >= rootTMax) break;
+
+        if (nodeIdx != -1) {
+            nodeIdx = ropeNodes[nodeIdx].ropes[face];
+        } else {
+            int parentFace;
+            float parentExit = cellExit(ray, invDir, parentMin, parentMax, parentFace);
+            nodeIdx = tExit < parentExit ? parent : ropeNodes[parent].ropes[parentFace];
+        }
+        t = tExit;
+    }
+    return hit_anything;
+}
+
+
+void decodeCompactChildBox(CompactNode node, int index, vec3 parentMin, vec3 parentMax, out vec3 childMin, out vec3 childMax) {
+    vec3 cell = (parentMax - parentMin) * 0.0625;
+    int shift = 4 * index;
+    vec3 lo = vec3((uvec3(node.childBoxes[0], node.childBoxes[1], node.childBoxes[2]) >> shift) & 15u);
+    vec3 hi = vec3((uvec3(node.childBoxes[3], node.childBoxes[4], node.childBoxes[5]) >> shift) & 15u);
+    childMin = parentMin + lo * cell;
+    childMax = parentMin + (hi + 1.0) * cell;
+}
+
+// Traversal of the compact nodes. A node only knows its children's boxes, decoded on the way down, so the stack also carries
+// the node boxes; the quantized boxes may overlap a little, so like the loose traversal it skips the nodes entered past the
+// closest hit instead of stopping
+bool traverseCompactOctree(Ray ray, float t_min, float t_max, inout IntersectInfo rec) {
+    const int MAX_STACK = 200;
+    int nodeStack[MAX_STACK];
+    float tminStack[MAX_STACK];
+    vec3 minStack[MAX_STACK];
+    vec3 maxStack[MAX_STACK];
+
+    float childTMin, childTMax;
+    if (!rayBoxIntersection(ray, octreeRootMin, octreeRootMax, childTMin, childTMax) ||
+        childTMax < t_min || childTMin > t_max) {
+        return false;
+    }
+
+    int stackPtr = 0;
+    nodeStack[0] = 0;
+    tminStack[0] = max(childTMin, t_min);
+    minStack[0] = octreeRootMin;
+    maxStack[0] = octreeRootMax;
+
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+    int first = firstOctant(ray.direction);
+
+    while (stackPtr >= 0) {
+        float node_tmin = tminStack[stackPtr];
+        if (node_tmin > closest_so_far) { // a closer hit was found since it was pushed
+            stackPtr--;
+            continue;
+        }
+        CompactNode node = compactNodes[nodeStack[stackPtr]];
+        vec3 nodeMin = minStack[stackPtr];
+        vec3 nodeMax = maxStack[stackPtr--];
+
+        uint childMask = node.info & 0xffu;
+
+        // Test objects in leaf nodes
+        if (childMask == 0u) {
+            int objectCount = int(node.info >> 8);
+            int objectsOffset = int(node.offset);
+            for (int i = 0; i < objectCount; i++) {
+                int sphereIdx = objectIndex(objectsOffset + i);
+                if (mailboxSkip(sphereIdx)) continue;
+                IntersectInfo temp_rec;
+                if (Sphere_hit(sphereIdx, ray, t_min, closest_so_far, temp_rec)) {
+                    hit_anything = true;
+                    closest_so_far = temp_rec.t;
+                    rec = temp_rec;
+                }
+            }
+        }
+        else {
+            // Furthest to closest on the stack
             for (int i = 7; i >= 0; i--) {
-                int octant = traversalOrder[i];
-                int childIdx = childrenOffset + octant;
-                
-                if (childIdx >= octreeNodeCount) continue;
-                
-                // Get child bounds
-                vec4 childNode1 = octreeNodes[childIdx];
-                vec4 childNode2 = octreeNodes2[childIdx];
-                vec3 childMin = childNode1.xyz;
-                vec3 childMax = childNode2.xyz;
-                
-                // Check if child intersects ray before adding to stack
-                if (!rayBoxIntersection(ray, childMin, childMax, childTMin, childTMax) || 
-                    childTMax < node_tmin || childTMin > closest_so_far ||
-                    (childNode1.w == -1 &&  childNode2.w == -1)) {
+                int octant = i ^ first;
+                if ((childMask & (1u << octant)) == 0u) continue; // empty octant, it has no node
+
+                vec3 childMin, childMax;
+                decodeCompactChildBox(node, octant, nodeMin, nodeMax, childMin, childMax);
+
+                if (!rayBoxIntersection(ray, childMin, childMax, childTMin, childTMax) ||
+                    childTMax < node_tmin || childTMin > closest_so_far) {
                     continue; // Skip non-intersecting children
                 }
-                
+
                 if (stackPtr < MAX_STACK - 1) {
                     stackPtr++;
-                    nodeStack[stackPtr] = childIdx;
+                    nodeStack[stackPtr] = childIndex(int(node.offset), childMask, octant);
                     tminStack[stackPtr] = max(childTMin, node_tmin);
-                    tmaxStack[stackPtr] = min(childTMax, closest_so_far);
+                    minStack[stackPtr] = childMin;
+                    maxStack[stackPtr] = childMax;
                 }
             }
         }
@@ -480,7 +729,6 @@ bool traverseOctree(Ray ray, float t_min, float t_max, inout IntersectInfo rec)
     return hit_anything;
 }
 
-
 bool bruteForceIntersect(Ray ray, float t_min, float t_max, inout IntersectInfo rec) {
     IntersectInfo temp_rec;
     bool hit_anything = false;
@@ -499,6 +747,9 @@ bool bruteForceIntersect(Ray ray, float t_min, float t_max, inout IntersectInfo
 
 bool intersectScene(Ray ray, float t_min, float t_max, inout IntersectInfo rec) {
     if (useOctree == 1) {
+        mailboxClear(); // a new ray
+        if (useRopes == 1) return traverseRopes(ray, t_min, t_max, rec);
+        if (useCompactNodes == 1) return traverseCompactOctree(ray, t_min, t_max, rec);
         return traverseOctree(ray, t_min, t_max, rec);
     } else {
         return bruteForceIntersect(ray, t_min, t_max, rec);
@@ -0,0 +1,106 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Bump allocator handing out contiguous runs of T from a few big blocks.
+ * Nothing is freed one by one: reset() drops every allocation at once but keeps the memory,
+ * so the next build reuses it without going back to the heap.
+ * Only for types that need no destructor, since none is ever called.
+ */
+template <typename T>
+class Arena {
+    static_assert(std::is_trivially_destructible<T>::value, "Arena never runs destructors");
+
+    public:
+        explicit Arena(size_t blockSize = 1 << 16) : blockSize(blockSize), currentBlock(0), used(0) {}
+
+        Arena(Arena&& other) noexcept
+            : blockSize(other.blockSize), blocks(std::move(other.blocks)), currentBlock(other.currentBlock), used(other.used) {
+            other.currentBlock = 0;
+            other.used = 0;
+        }
+
+        Arena& operator=(Arena&& other) noexcept {
+            blockSize = other.blockSize;
+            blocks = std::move(other.blocks);
+            currentBlock = other.currentBlock;
+            used = other.used;
+            other.currentBlock = 0;
+            other.used = 0;
+            return *this;
+        }
+
+        /**
+         * @brief Get uninitialized room for count contiguous objects. Safe to call from several threads.
+         */
+        T* allocate(size_t count) {
+            if (count == 0) return nullptr;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            while (currentBlock < blocks.size() && used + count > blocks[currentBlock].size) {
+                currentBlock++;
+                used = 0;
+            }
+            if (currentBlock == blocks.size()) {
+                blocks.push_back(Block(std::max(blockSize, count)));
+            }
+
+            T* result = reinterpret_cast<T*>(blocks[currentBlock].data.get() + used);
+            used += count;
+            return result;
+        }
+
+        /**
+         * @brief Drop every allocation but keep the memory. If it took more than one block,
+         * it is merged into a single block big enough for all of it, so a build of the same size fits without any new block.
+         */
+        void reset() {
+            if (blocks.size() > 1) {
+                size_t total = 0;
+                for (const Block& block : blocks) total += block.size;
+                blocks.clear();
+                blocks.push_back(Block(total));
+            }
+            currentBlock = 0;
+            used = 0;
+        }
+
+        // Give all the memory back
+        void release() {
+            blocks.clear();
+            currentBlock = 0;
+            used = 0;
+        }
+
+        size_t capacity() const {
+            size_t total = 0;
+            for (const Block& block : blocks) total += block.size;
+            return total;
+        }
+    private:
+        struct alignas(T) Slot {
+            unsigned char bytes[sizeof(T)];
+        };
+
+        struct Block {
+            std::unique_ptr<Slot[]> data;
+            size_t size;
+
+            explicit Block(size_t size) : data(new Slot[size]), size(size) {}
+        };
+
+        size_t blockSize;
+        std::vector<Block> blocks;
+        size_t currentBlock;
+        size_t used; // Objects handed out from the current block
+        std::mutex mutex;
+};
+
+#endif // ARENA_H
@@ -17,6 +17,47 @@ const int DEBUGDEPTH = 3;
 const int MAXSPHERESPERNODE = 0;
 const int DEBUGSPHERESPERNODE = 2;
 
+// Threads used to build the octree, 0 = one per hardware thread
+const int BUILDTHREADS = 0;
+
+// How the octree is built: 0 = top-down subdivision, 1 = sorted Morton codes, 2 = loose octree,
+// 3 = top-down with SAH placed splits (see OctreeBuildMode)
+const int BUILDMODE = 0;
+
+// Shrink every node box to the spheres it holds (clipped to its octant), so rays skip more empty space
+const int TIGHTBOUNDS = 0;
+
+// Order of the nodes in memory: 0 = breadth-first, 1 = depth-first, 2 = van Emde Boas, 3 = profile-guided (see NodeLayout)
+// The profile-guided order comes from the node visits of edaa_cpu over PROFILEPOSES camera poses; with USESCENECACHE it is
+// saved with the scene, so the OpenGL renderer uses it too once edaa_cpu ran with the same settings
+const int NODELAYOUT = 0;
+const int PROFILEPOSES = 8;
+
+// Let a traversal cost model decide where each subtree stops: MAXDEPTH is then only a cap and MAXSPHERESPERNODE is ignored.
+// Needs a top-down build mode (BUILDMODE 0, 2 or 3)
+const int AUTOTUNE = 0;
+
+// Keep the scene and its octree in SCENECACHEFILE_<hash of the settings>.bin and memory map it on the next launch instead of
+// generating and building them again. The random scene is then the same on every launch, delete the file for a new one
+const int USESCENECACHE = 0;
+const std::string SCENECACHEFILE = "scene_cache";
+
+// Spheres moved every frame (0 = a static scene). The octree follows them with Octree::refitOrRebuild and is only rebuilt
+// once its predicted cost or references per sphere grow more than REBUILDGROWTH percent past those of the last build
+const int ANIMATESPHERES = 0;
+const int REBUILDGROWTH = 25;
+
+// Traverse the 32 byte compact nodes (Octree::compactTree) instead of the three node buffers
+const int COMPACTNODES = 0;
+
+// Stackless traversal: the ray walks from leaf to leaf through the links to their face neighbours (Octree::ropeTree),
+// with no stack per ray. Not with a loose octree (BUILDMODE 2), takes precedence over COMPACTNODES
+const int USEROPES = 0;
+
+// Spheres each ray remembers having tested, in a ring (0 = off, at most 16). A sphere is in every leaf it overlaps unless the
+// octree is loose, so a ray going through several of them skips it after the first test
+const int MAILBOXSIZE = 0;
+
 // Number of rays incoming from the camera; The more rays, the more accurate the result
 const int NUMSAMPLES = 16;
 
@@ -29,6 +70,37 @@ const unsigned int SCR_HEIGHT = 600;
 
 const bool COLLECTSTATS = 0;
 
-const std::string OUTPUTFILE = "stats.csv";
+const std::string OUTPUTFILE = "stats.csv"; // One row per run under a header of its columns (Raytracer::saveStats), never appended to a file with other columns
+const std::string OCTREESTATSFILE = "octree_stats.jsonl"; // One JSON record per build (Octree::saveStats), appended like OUTPUTFILE
+
+// Headless CPU renderer (edaa_cpu)
+const unsigned int CPUTHREADS = 0; // 0 = one per hardware thread
+const int CPUFRAMES = 5;
+const int CPUTILESIZE = 16; // Tiles are CPUTILESIZE x CPUTILESIZE pixels
+const int CPUSAMPLESPERPASS = 4; // Samples per pixel added by each refinement pass of a tile
+// Test the spheres of a node (or every sphere, without the octree) 16 or 8 at a time with AVX-512 or AVX2, whichever is the
+// widest the CPU runs, instead of one by one
+const int CPUSIMD = 0;
+// Trace the camera rays of 2x2, 4x2 or 4x4 pixel blocks together through the octree, fetching each node once for the block
+// (0 = off, 4, 8 or 16). Bounces are traced one ray at a time
+const int CPUPACKETSIZE = 0;
+const std::string CPUOUTPUTFILE = "frame.ppm";
+const std::string CPUTILESTATSFILE = "tile_times.csv";
+// Render CPUFRAMES more frames with each NodeLayout of the same tree and append their times to CPULAYOUTSTATSFILE
+const int CPULAYOUTBENCHMARK = 0;
+const std::string CPULAYOUTSTATSFILE = "layout_times.csv";
+// Render CPUFRAMES more frames with the stack traversal and with the ropes of the same tree, appended to CPUROPESTATSFILE
+const int CPUROPEBENCHMARK = 0;
+const std::string CPUROPESTATSFILE = "rope_times.csv";
+// Render CPUFRAMES more frames without a mailbox and with each mailbox size, appended to CPUMAILBOXSTATSFILE
+const int CPUMAILBOXBENCHMARK = 0;
+const std::string CPUMAILBOXSTATSFILE = "mailbox_times.csv";
+// Render CPUFRAMES more frames testing the spheres one by one and with each batched kernel the CPU runs, appended to
+// CPUSIMDSTATSFILE
+const int CPUSIMDBENCHMARK = 0;
+const std::string CPUSIMDSTATSFILE = "simd_times.csv";
+// Render CPUFRAMES more frames with single camera rays and with each packet size, appended to CPUPACKETSTATSFILE
+const int CPUPACKETBENCHMARK = 0;
+const std::string CPUPACKETSTATSFILE = "packet_times.csv";
 
 #endif // CONFIG_H
\ No newline at end of file
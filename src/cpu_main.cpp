@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include "opengl/camera.h"
+#include "config.h"
+#include "cpuraytracer.h"
+#include "octree.h"
+#include "scene.h"
+#include "scenecache.h"
+#include "statsrow.h"
+
+/**
+ * Renders PROFILEPOSES frames with node visit counting on, then puts the most visited nodes first (Octree::reorderByVisits).
+ * The poses stand in for the cameras the scene is really seen from: a small sweep of yaw, pitch and position around camera.
+ */
+static void profileNodeOrder(CPURaytracer& raytracer, Octree& octree, const Camera& camera) {
+    const auto start{std::chrono::steady_clock::now()};
+    raytracer.countNodeVisits = true;
+    raytracer.nodeVisits.clear();
+    for (int pose = 0; pose < PROFILEPOSES; pose++) {
+        float sweep = PROFILEPOSES > 1 ? float(pose) / (PROFILEPOSES - 1) - 0.5f : 0.0f; // -0.5 to 0.5
+        Camera view = camera;
+        view.Yaw += 30.0f * sweep;
+        view.Pitch += 10.0f * sweep;
+        view.Position.x += 2.0f * sweep;
+        view.updateCameraVectors();
+        raytracer.renderFrame(view.GetViewMatrix(), view.Position, view.Zoom);
+    }
+    raytracer.countNodeVisits = false;
+
+    size_t visited = std::count_if(raytracer.nodeVisits.begin(), raytracer.nodeVisits.end(), [](uint64_t visits) { return visits > 0; });
+    octree.reorderByVisits(raytracer.nodeVisits);
+    octree.clearDirtyRanges(); // nothing to upload
+    const std::chrono::duration<double> elapsed_seconds{std::chrono::steady_clock::now() - start};
+    std::cout << "Profiled " << PROFILEPOSES << " poses in " << elapsed_seconds.count() << "s: " << visited << " of "
+              << octree.flattenedTree.size() << " nodes visited, now first in memory" << std::endl;
+}
+
+/**
+ * Entry point of the headless renderer: builds the same scene and octree as the OpenGL version,
+ * renders CPUFRAMES frames on the CPU and saves the last one to CPUOUTPUTFILE and its tile costs to CPUTILESTATSFILE.
+ * The frames are then rendered again for each benchmark turned on in config.h, once per setting:
+ * - CPUROPEBENCHMARK: the stack and the rope traversals
+ * - CPUMAILBOXBENCHMARK: no mailbox and each mailbox size
+ * - CPUSIMDBENCHMARK: the spheres tested one by one and with each batched kernel the CPU runs
+ * - CPUPACKETBENCHMARK: single camera rays and each packet size
+ * - CPULAYOUTBENCHMARK: each node layout
+ */
+int main() {
+    Camera camera(glm::vec3(0.0f, 8.0f, 30.0f));
+    if (DEBUG) {
+        std::cout << "Debug mode enabled" << std::endl;
+        camera.Position = glm::vec3(30.0f, 20.0f, -50.0f);
+    } else {
+        camera.Position = glm::vec3(0.0f, 2.5f, -10.0f);
+        camera.updateCameraVectors();
+    }
+
+    int maxDepth = DEBUG ? DEBUGDEPTH : MAXDEPTH;
+    int maxSpheresPerNode = DEBUG ? DEBUGSPHERESPERNODE : MAXSPHERESPERNODE;
+
+    vector<Sphere> spheres;
+    Octree octree(maxDepth, maxSpheresPerNode, BUILDTHREADS, static_cast<OctreeBuildMode>(BUILDMODE), TIGHTBOUNDS, AUTOTUNE, static_cast<NodeLayout>(NODELAYOUT));
+
+    // The CPU renderer works on Sphere and Octree, so a cache hit is copied out of the mapping instead of used in place
+    SceneCache sceneCache;
+    uint64_t cacheKey = 0;
+    if (USESCENECACHE) {
+        cacheKey = sceneCacheKey(maxDepth, maxSpheresPerNode, static_cast<OctreeBuildMode>(BUILDMODE), TIGHTBOUNDS, AUTOTUNE, static_cast<NodeLayout>(NODELAYOUT), COMPACTNODES);
+        if (sceneCache.open(sceneCacheFilename(cacheKey), cacheKey, octree.isLoose())) {
+            const auto start{std::chrono::steady_clock::now()};
+            spheres = sceneCache.loadSpheres();
+            sceneCache.loadOctree(octree);
+            sceneCache.close();
+            const std::chrono::duration<double> elapsed_seconds{std::chrono::steady_clock::now() - start};
+            std::cout << "Scene cache hit: " << sceneCacheFilename(cacheKey) << " loaded in " << elapsed_seconds.count() << "s" << std::endl;
+        }
+    }
+
+    if (spheres.empty()) {
+        spheres = generateSpheres();
+        octree.build(spheres, DEBUG);
+        if (COMPACTNODES) octree.setCompactData();
+        octree.saveStats(OCTREESTATSFILE);
+        if (USESCENECACHE) SceneCache::save(sceneCacheFilename(cacheKey), cacheKey, spheres, octree);
+    }
+    if (USEROPES) octree.setRopeData(); // not cached, the updates and layouts keep them from here on
+
+    CPURaytracer raytracer;
+    raytracer.setScene(spheres, octree);
+    if (raytracer.useSphereBatches) std::cout << "Sphere tests in " << simdLevelName(raytracer.simdLevel) << " batches" << std::endl;
+
+    // Profiled once, the order is then kept in the scene cache for the next launches of either renderer
+    if (NODELAYOUT == ProfiledLayout && !octree.visitOrdered && CPUFRAMES > 0) {
+        profileNodeOrder(raytracer, octree, camera);
+        if (USESCENECACHE) SceneCache::save(sceneCacheFilename(cacheKey), cacheKey, spheres, octree);
+    }
+
+    double totalTime = 0.0, totalUpdateTime = 0.0;
+    unsigned long long totalRays = 0, totalSphereTests = 0, totalMailboxSkips = 0;
+    vector<glm::vec3> restCenters;
+    for (const Sphere& sphere : spheres) {
+        restCenters.push_back(sphere.center);
+    }
+    vector<int> animatedSpheres;
+    vector<glm::vec3> animatedCenters;
+    for (int frame = 0; frame < CPUFRAMES; frame++) {
+        if (ANIMATESPHERES > 0) {
+            // same animation as the OpenGL version, at 60 frames per second
+            animateSpheres(spheres, restCenters, frame / 60.0f, animatedSpheres, animatedCenters);
+            bool rebuilt = octree.refitOrRebuild(spheres, animatedSpheres, animatedCenters, REBUILDGROWTH / 100.0, 1.0f);
+            octree.clearDirtyRanges(); // nothing to upload
+            totalUpdateTime += octree.updateTime;
+            std::cout << "Octree update: " << octree.updateTime << "s" << (rebuilt ? " (rebuilt)" : "") << std::endl;
+        }
+        raytracer.renderFrame(camera.GetViewMatrix(), camera.Position, camera.Zoom);
+        totalTime += raytracer.frameTime;
+        totalRays += raytracer.rayCount;
+        std::cout << "Frame " << frame << ": " << raytracer.frameTime << "s, " << raytracer.mraysPerSecond << " Mrays/s" << std::endl;
+        totalSphereTests += raytracer.sphereTests;
+        totalMailboxSkips += raytracer.mailboxSkips;
+    }
+
+    if (CPUFRAMES > 0) {
+        std::cout << "Average frame time: " << totalTime / CPUFRAMES << "s, " << totalRays / totalTime / 1e6 << " Mrays/s" << std::endl;
+        // Without the mailbox every skipped test would have been done too
+        unsigned long long wouldTest = totalSphereTests + totalMailboxSkips;
+        std::cout << "Sphere tests per ray: " << double(totalSphereTests) / totalRays << ", " << totalMailboxSkips << " repeated ones skipped by the mailbox ("
+                  << (wouldTest > 0 ? 100.0 * totalMailboxSkips / wouldTest : 0.0) << "% of " << wouldTest << ")" << std::endl;
+        if (ANIMATESPHERES > 0) {
+            std::cout << "Average octree update time: " << totalUpdateTime / CPUFRAMES << "s, " << octree.rebuildCount << " rebuilds" << std::endl;
+        }
+        raytracer.savePPM(CPUOUTPUTFILE);
+
+        // Per tile cost of the last frame
+        double maxTileTime = 0.0, sumTileTime = 0.0;
+        for (double time : raytracer.tileTimes) {
+            maxTileTime = std::max(maxTileTime, time);
+            sumTileTime += time;
+        }
+        double avgTileTime = sumTileTime / raytracer.tileTimes.size();
+        std::cout << "Tile cost: avg " << avgTileTime << "s, max " << maxTileTime << "s (" << maxTileTime / avgTileTime << "x avg)" << std::endl;
+        raytracer.saveTileTimes(CPUTILESTATSFILE);
+    }
+
+    /**
+     * Renders CPUFRAMES frames of the same scene and camera with each of count settings, printing the frame time and Mrays/s
+     * of each and appending them to filename. setup(i, stats) applies setting i, adds the columns that tell it apart and
+     * returns its name.
+     */
+    auto benchmark = [&](const std::string& name, int count, const std::function<std::string(int, StatsRow&)>& setup, const std::string& filename) {
+        for (int setting = 0; setting < count; setting++) {
+            StatsRow stats;
+            const std::string settingName = setup(setting, stats);
+            double benchmarkTime = 0.0;
+            unsigned long long benchmarkRays = 0;
+            for (int frame = 0; frame < CPUFRAMES; frame++) {
+                raytracer.renderFrame(camera.GetViewMatrix(), camera.Position, camera.Zoom);
+                benchmarkTime += raytracer.frameTime;
+                benchmarkRays += raytracer.rayCount;
+            }
+            std::cout << name << " " << settingName << ": " << benchmarkTime / CPUFRAMES << "s per frame, " << benchmarkRays / benchmarkTime / 1e6 << " Mrays/s" << std::endl;
+            stats.add("Spheres", NUMSPHERES);
+            stats.add("Uses Octree", USEOCTREE);
+            stats.add("Max Octree Depth", maxDepth);
+            stats.add("Max Spheres Per Node", maxSpheresPerNode);
+            stats.add("Build Mode", BUILDMODE);
+            stats.add("Tight Bounds", TIGHTBOUNDS);
+            stats.add("Frame Time", benchmarkTime / CPUFRAMES);
+            stats.add("Mrays/s", benchmarkRays / benchmarkTime / 1e6);
+            stats.append(filename);
+        }
+    };
+
+    if (CPUROPEBENCHMARK && CPUFRAMES > 0 && !octree.isLoose()) {
+        // The same tree with both traversals, so only the way the ray goes from cell to cell differs
+        if (octree.ropeTree.size() != octree.flattenedTree.size()) octree.setRopeData();
+        const bool useRopes = raytracer.useRopes;
+        benchmark("Traversal", 2, [&](int ropes, StatsRow& stats) {
+            raytracer.useRopes = ropes == 1;
+            const std::string name = ropes == 1 ? "ropes" : "stack";
+            stats.add("Traversal", name);
+            return name;
+        }, CPUROPESTATSFILE);
+        raytracer.useRopes = useRopes;
+    }
+
+    if (CPUMAILBOXBENCHMARK && CPUFRAMES > 0) {
+        const int mailboxSize = raytracer.mailboxSize;
+        const int sizes[] = {0, 4, 8, Mailbox::MAX_SIZE};
+        benchmark("Mailbox", 4, [&](int setting, StatsRow& stats) {
+            raytracer.mailboxSize = sizes[setting];
+            stats.add("Mailbox Size", sizes[setting]);
+            return sizes[setting] > 0 ? std::to_string(sizes[setting]) + " spheres" : std::string("off");
+        }, CPUMAILBOXSTATSFILE);
+        raytracer.mailboxSize = mailboxSize;
+    }
+
+    if (CPUSIMDBENCHMARK && CPUFRAMES > 0) {
+        // One by one, then in batches with each kernel up to the widest the CPU runs
+        const bool useSphereBatches = raytracer.useSphereBatches;
+        const SimdLevel simdLevel = raytracer.simdLevel;
+        benchmark("Sphere tests", detectSimdLevel() + 2, [&](int setting, StatsRow& stats) {
+            raytracer.useSphereBatches = setting > 0;
+            raytracer.simdLevel = setting > 0 ? static_cast<SimdLevel>(setting - 1) : simdLevel;
+            const std::string name = setting > 0 ? simdLevelName(raytracer.simdLevel) : "one by one";
+            stats.add("Sphere Tests", name);
+            return name;
+        }, CPUSIMDSTATSFILE);
+        raytracer.useSphereBatches = useSphereBatches;
+        raytracer.simdLevel = simdLevel;
+    }
+
+    if (CPUPACKETBENCHMARK && CPUFRAMES > 0) {
+        const int packetSize = raytracer.packetSize;
+        const int sizes[] = {0, 4, 8, 16};
+        benchmark("Packets of", 4, [&](int setting, StatsRow& stats) {
+            raytracer.packetSize = sizes[setting];
+            stats.add("Packet Size", sizes[setting]);
+            return sizes[setting] > 0 ? std::to_string(sizes[setting]) + " rays" : std::string("single rays");
+        }, CPUPACKETSTATSFILE);
+        raytracer.packetSize = packetSize;
+    }
+
+    if (CPULAYOUTBENCHMARK && CPUFRAMES > 0) {
+        // The same tree in every node order, so only the memory layout differs between the runs
+        const char* layoutNames[] = {"bfs", "dfs", "veb"};
+        benchmark("Layout", VEBLayout + 1, [&](int layout, StatsRow& stats) {
+            octree.setLayout(static_cast<NodeLayout>(layout));
+            octree.clearDirtyRanges(); // nothing to upload
+            stats.add("Layout", layoutNames[layout]);
+            return std::string(layoutNames[layout]);
+        }, CPULAYOUTSTATSFILE);
+    }
+
+    return 0;
+}
@@ -0,0 +1,1193 @@
+#include "cpuraytracer.h"
+#include <glm/gtc/constants.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+
+#define LAMBERT 0
+#define METAL 1
+#define DIELECTRIC 2
+
+static const float PI = glm::pi<float>();
+// Nodes with fewer spheres are tested one by one even with useSphereBatches, most lanes of a batch would test padding
+static const int MIN_BATCH_SPHERES = SPHERE_BATCH_PADDING / 2;
+// Entries of the traversal stacks, enough for any tree (see MAX_TREE_DEPTH)
+static const int MAX_STACK = 8 * MAX_TREE_DEPTH + 1;
+
+float RandomState::next() {
+    // The shader converts the seed from float to uint, wrap it explicitly to keep it defined here
+    double seed = double(state.x) * 1664525.0 + double(state.y) * 1013904223.0;
+    uint32_t s = uint32_t(std::fmod(seed, 4294967296.0)) + 1013904223u;
+    s = s ^ (s >> 16u);
+    s *= 0x85ebca6bu;
+    s = s ^ (s >> 13u);
+    s *= 0xc2b2ae35u;
+    s = s ^ (s >> 16u);
+
+    state.x = glm::fract(state.y * 1664525.0f);
+    state.y = glm::fract(float(s) / 4294967296.0f);
+
+    return state.y;
+}
+
+static glm::vec3 randomInUnitDisk(RandomState& rng) {
+    float spx = 2.0f * rng.next() - 1.0f;
+    float spy = 2.0f * rng.next() - 1.0f;
+
+    float r, phi;
+
+    if (spx > -spy) {
+        if (spx > spy) {
+            r = spx;
+            phi = spy / spx;
+        } else {
+            r = spy;
+            phi = 2.0f - spx / spy;
+        }
+    } else {
+        if (spx < spy) {
+            r = -spx;
+            phi = 4.0f + spy / spx;
+        } else {
+            r = -spy;
+
+            if (spy != 0.0f)
+                phi = 6.0f - spx / spy;
+            else
+                phi = 0.0f;
+        }
+    }
+
+    phi *= PI / 4.0f;
+
+    return glm::vec3(r * std::cos(phi), r * std::sin(phi), 0.0f);
+}
+
+static glm::vec3 randomInUnitSphere(RandomState& rng) {
+    float z = 2.0f * rng.next() - 1.0f;
+    float phi = 2.0f * PI * rng.next();
+    float r = std::pow(rng.next(), 1.0f / 3.0f);
+    float sqrt1minz2 = std::sqrt(1.0f - z * z);
+    return glm::vec3(r * sqrt1minz2 * std::cos(phi), r * sqrt1minz2 * std::sin(phi), r * z);
+}
+
+static glm::vec3 randomCosineDirection(RandomState& rng) {
+    float r1 = rng.next();
+    float r2 = rng.next();
+    float phi = 2.0f * PI * r1;
+
+    float sqrt_r2 = std::sqrt(r2);
+    return glm::vec3(std::cos(phi) * sqrt_r2, std::sin(phi) * sqrt_r2, std::sqrt(1.0f - r2));
+}
+
+static RayCamera cameraFromViewMatrix(const glm::mat4& viewMatrix, const glm::vec3& position, float fovDegrees, float aspect) {
+    RayCamera camera;
+    camera.origin = position;
+
+    // Set camera vectors from view matrix
+    camera.w = -glm::normalize(glm::vec3(viewMatrix[0][2], viewMatrix[1][2], viewMatrix[2][2]));
+    camera.u = glm::normalize(glm::vec3(viewMatrix[0][0], viewMatrix[1][0], viewMatrix[2][0]));
+    camera.v = glm::normalize(glm::vec3(viewMatrix[0][1], viewMatrix[1][1], viewMatrix[2][1]));
+
+    // Set lens parameters
+    float aperture = 0.1f;
+    camera.lensRadius = aperture / 2.0f;
+
+    // Calculate frustum
+    float distToFocus = 10.0f;
+    float theta = fovDegrees * PI / 180.0f;
+    float halfHeight = std::tan(theta / 2.0f);
+    float halfWidth = aspect * halfHeight;
+
+    camera.lowerLeftCorner = camera.origin - halfWidth * distToFocus * camera.u
+                                           - halfHeight * distToFocus * camera.v
+                                           - distToFocus * camera.w;
+    camera.horizontal = 2.0f * halfWidth * distToFocus * camera.u;
+    camera.vertical = 2.0f * halfHeight * distToFocus * camera.v;
+
+    return camera;
+}
+
+static Ray cameraGetRay(const RayCamera& camera, float s, float t, float pixelRadius, RandomState& rng) {
+    // Add a very small jitter to help with anti-aliasing edges
+    float jitterX = pixelRadius * (rng.next() - 0.5f);
+    float jitterY = pixelRadius * (rng.next() - 0.5f);
+
+    glm::vec3 rd = camera.lensRadius * randomInUnitDisk(rng);
+    glm::vec3 offset = camera.u * rd.x + camera.v * rd.y;
+
+    Ray ray;
+    ray.origin = camera.origin + offset;
+    ray.direction = glm::normalize(camera.lowerLeftCorner +
+                                   (s + jitterX) * camera.horizontal +
+                                   (t + jitterY) * camera.vertical -
+                                   camera.origin - offset);
+    return ray;
+}
+
+// Camera ray of sample s of the pixel centered on fragCoord, stratified over sqrt_ns x sqrt_ns cells of the pixel
+static Ray sampleRay(const RayCamera& camera, const glm::vec2& fragCoord, const glm::vec2& resolution, float pixelRadius, int sqrt_ns, int s,
+                     RandomState& rng) {
+    int i = s % sqrt_ns;
+    int j = s / sqrt_ns;
+
+    float u = (fragCoord.x + (float(i) + rng.next()) / float(sqrt_ns)) / resolution.x;
+    float v = (fragCoord.y + (float(j) + rng.next()) / float(sqrt_ns)) / resolution.y;
+
+    return cameraGetRay(camera, u, v, pixelRadius, rng);
+}
+
+static bool rayBoxIntersection(const Ray& ray, const glm::vec3& boxMin, const glm::vec3& boxMax, float& tmin, float& tmax) {
+    glm::vec3 invDir = 1.0f / ray.direction;
+    glm::vec3 tbot = invDir * (boxMin - ray.origin);
+    glm::vec3 ttop = invDir * (boxMax - ray.origin);
+
+    glm::vec3 tmin3 = glm::min(tbot, ttop);
+    glm::vec3 tmax3 = glm::max(tbot, ttop);
+
+    tmin = std::max(std::max(tmin3.x, tmin3.y), tmin3.z);
+    tmax = std::min(std::min(tmax3.x, tmax3.y), tmax3.z);
+
+    return tmax >= tmin;
+}
+
+// 1 / direction, with zero components made tiny instead so plane crossings stay finite. -0 counts as positive, as in firstOctant
+static glm::vec3 safeInverse(const glm::vec3& direction) {
+    glm::vec3 inverse;
+    for (int axis = 0; axis < 3; axis++) {
+        float d = direction[axis];
+        inverse[axis] = 1.0f / (std::fabs(d) > 1e-20f ? d : (d < 0.0f ? -1e-20f : 1e-20f));
+    }
+    return inverse;
+}
+
+// Octant the ray enters a cell through, the children are then visited in the order i ^ firstOctant, i = 0 to 7: along each
+// axis the ray crosses the split plane at most once, from the side of firstOctant. Bits are z << 2 | x << 1 | y like octants
+static int firstOctant(const glm::vec3& direction) {
+    return (direction.z < 0.0f) << 2 | (direction.x < 0.0f) << 1 | (direction.y < 0.0f);
+}
+
+static bool refractVec(const glm::vec3& v, const glm::vec3& n, float ni_over_nt, glm::vec3& refracted) {
+    glm::vec3 uv = glm::normalize(v);
+    float dt = glm::dot(uv, n);
+    float discriminant = 1.0f - ni_over_nt * ni_over_nt * (1.0f - dt * dt);
+    if (discriminant > 0.0f) {
+        refracted = ni_over_nt * (uv - n * dt) - n * std::sqrt(discriminant);
+        return true;
+    }
+    return false;
+}
+
+static float schlick(float cosine, float refractionIndex) {
+    float r0 = (1.0f - refractionIndex) / (1.0f + refractionIndex);
+    r0 = r0 * r0;
+    return r0 + (1.0f - r0) * std::pow(1.0f - cosine, 5.0f);
+}
+
+static bool materialBsdf(const IntersectInfo& isectInfo, const Ray& wo, Ray& wi, glm::vec3& attenuation, RandomState& rng) {
+    wi.origin = isectInfo.point;
+
+    switch (isectInfo.materialType) {
+        case LAMBERT: {
+            glm::vec3 local_dir = randomCosineDirection(rng);
+
+            // Transform from local to world space
+            glm::vec3 w = isectInfo.normal;
+            glm::vec3 u = glm::normalize(glm::cross((std::abs(w.x) > 0.1f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0)), w));
+            glm::vec3 v = glm::cross(w, u);
+
+            wi.direction = glm::normalize(local_dir.x * u + local_dir.y * v + local_dir.z * w);
+            attenuation = isectInfo.albedo;
+            return true;
+        }
+        case METAL: {
+            glm::vec3 reflected = glm::reflect(glm::normalize(wo.direction), isectInfo.normal);
+            wi.direction = reflected + isectInfo.fuzz * randomInUnitSphere(rng);
+            attenuation = isectInfo.albedo;
+            return (glm::dot(wi.direction, isectInfo.normal) > 0.0f);
+        }
+        case DIELECTRIC: {
+            glm::vec3 outward_normal;
+            float ni_over_nt;
+            float cosine;
+            float refractionIndex = isectInfo.refractionIndex;
+            attenuation = glm::vec3(1.0f);
+
+            // Determine if we're entering or exiting the material
+            if (glm::dot(wo.direction, isectInfo.normal) > 0.0f) {
+                outward_normal = -isectInfo.normal;
+                ni_over_nt = refractionIndex;
+                cosine = glm::dot(wo.direction, isectInfo.normal) / glm::length(wo.direction);
+                cosine = std::sqrt(1.0f - refractionIndex * refractionIndex * (1.0f - cosine * cosine));
+            } else {
+                outward_normal = isectInfo.normal;
+                ni_over_nt = 1.0f / refractionIndex;
+                cosine = -glm::dot(wo.direction, isectInfo.normal) / glm::length(wo.direction);
+            }
+
+            // Calculate reflection probability
+            glm::vec3 refracted;
+            bool can_refract = refractVec(wo.direction, outward_normal, ni_over_nt, refracted);
+            float reflect_prob = can_refract ? schlick(cosine, refractionIndex) : 1.0f;
+
+            if (rng.next() < reflect_prob) {
+                wi.direction = glm::reflect(wo.direction, isectInfo.normal);
+            } else {
+                wi.direction = refracted;
+            }
+
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// Sky color for rays that don't hit anything
+static glm::vec3 skyColor(const Ray& ray) {
+    float t = 0.5f * (ray.direction.y + 1.0f);
+    return (1.0f - t) * glm::vec3(1.0f, 1.0f, 1.0f) + t * glm::vec3(0.5f, 0.7f, 1.0f);
+}
+
+Mailbox::Mailbox(int size) : size(size) {
+    std::fill(ids, ids + size, -1);
+}
+
+bool Mailbox::skip(int sphereIdx) {
+    for (int i = 0; i < size; i++) {
+        if (ids[i] == sphereIdx) {
+            skipped++;
+            return true;
+        }
+    }
+    tests++;
+    if (size > 0) {
+        ids[next] = sphereIdx;
+        next = next + 1 == size ? 0 : next + 1;
+    }
+    return false;
+}
+
+CPURaytracer::CPURaytracer(unsigned int width, unsigned int height, unsigned int numThreads)
+    : width(width), height(height), numThreads(numThreads ? numThreads : std::max(1u, std::thread::hardware_concurrency())),
+    scheduler(this->numThreads), spheres(nullptr), octree(nullptr),
+    numSamples(NUMSAMPLES), maxDepth(MAXRAYSDEPTH) {
+    tilesX = int((width + CPUTILESIZE - 1) / CPUTILESIZE);
+    tilesY = int((height + CPUTILESIZE - 1) / CPUTILESIZE);
+    framebuffer.resize(size_t(width) * height);
+    accumulation.resize(size_t(width) * height);
+    randomStates.resize(size_t(width) * height);
+}
+
+void CPURaytracer::setScene(const std::vector<Sphere>& spheres, const Octree& octree) {
+    this->spheres = &spheres;
+    this->octree = &octree;
+}
+
+void CPURaytracer::prepareFrame() {
+    if (!spheres || !octree) {
+        throw std::logic_error("Scene must be set before rendering a frame");
+    }
+    if (useCompactNodes && octree->compactTree.size() != octree->flattenedTree.size()) {
+        throw std::logic_error("Compact nodes are enabled but the octree has no compact data, call setCompactData after build");
+    }
+    if (useRopes && octree->ropeTree.size() != octree->flattenedTree.size()) {
+        throw std::logic_error("Ropes are enabled but the octree has no rope data, call setRopeData after build");
+    }
+    if (packetSize != 0 && packetSize != 4 && packetSize != 8 && packetSize != 16) {
+        throw std::invalid_argument("Packet size must be 0, 4, 8 or 16, got " + std::to_string(packetSize));
+    }
+    if (mailboxSize < 0 || mailboxSize > Mailbox::MAX_SIZE) {
+        throw std::invalid_argument("Mailbox size must be between 0 and " + std::to_string(Mailbox::MAX_SIZE) + ", got " + std::to_string(mailboxSize));
+    }
+    if (useSphereBatches) gatherSphereBatches();
+}
+
+void CPURaytracer::renderFrame(const glm::mat4& view, const glm::vec3& cameraPosition, float cameraZoom) {
+    const auto start{std::chrono::steady_clock::now()};
+    prepareFrame();
+
+    RayCamera camera = cameraFromViewMatrix(view, cameraPosition, cameraZoom, float(width) / float(height));
+
+    // Each pass adds CPUSAMPLESPERPASS samples to every pixel of a tile
+    int numPasses = (numSamples + CPUSAMPLESPERPASS - 1) / CPUSAMPLESPERPASS;
+    std::vector<ThreadCounts> threadCounts(numThreads);
+    const size_t nodeCount = octree->flattenedTree.size();
+    if (countNodeVisits) threadVisits.assign(numThreads, std::vector<uint32_t>(nodeCount, 0));
+    scheduler.run(tilesX * tilesY, numPasses, [&](unsigned int thread, const TileJob& job) {
+        renderTilePass(job, camera, threadCounts[thread], countNodeVisits ? threadVisits[thread].data() : nullptr);
+    });
+    tileTimes = scheduler.tileTimes;
+
+    if (countNodeVisits) {
+        if (nodeVisits.size() != nodeCount) nodeVisits.assign(nodeCount, 0); // another tree, or another order of it
+        for (const std::vector<uint32_t>& visits : threadVisits) {
+            for (size_t i = 0; i < nodeCount; ++i) nodeVisits[i] += visits[i];
+        }
+        threadVisits.clear();
+    }
+
+    const auto finish{std::chrono::steady_clock::now()};
+    const std::chrono::duration<double> elapsed_seconds{finish - start};
+    frameTime = elapsed_seconds.count();
+
+    rayCount = 0;
+    sphereTests = 0;
+    mailboxSkips = 0;
+    for (const ThreadCounts& counts : threadCounts) {
+        rayCount += counts.rays;
+        sphereTests += counts.sphereTests;
+        mailboxSkips += counts.mailboxSkips;
+    }
+    mraysPerSecond = frameTime > 0.0 ? rayCount / frameTime / 1e6 : 0.0;
+}
+
+/**
+ * SoA copies of the spheres of every node and of the whole scene for batchHit. Gathered again every frame, which costs
+ * far less than the frame: refitOrRebuild and the layouts move spheres and nodes in between.
+ */
+void CPURaytracer::gatherSphereBatches() {
+    const std::vector<GPUOctreeNode>& nodes = octree->flattenedTree;
+    nodeBatches.clear();
+    nodeBatchStart.assign(nodes.size(), 0);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const GPUOctreeNode& node = nodes[i];
+        if (node.objectCount > 0) nodeBatchStart[i] = nodeBatches.append(*spheres, octree->objectIndices.data() + node.objectsOffset, node.objectCount);
+    }
+    sceneBatch.clear();
+    sceneBatch.appendAll(*spheres);
+}
+
+void CPURaytracer::renderTilePass(const TileJob& job, const RayCamera& camera, ThreadCounts& counts, uint32_t* visits) {
+    switch (packetSize) {
+        case 4: renderTilePacketPass<2, 2>(job, camera, counts, visits); return;
+        case 8: renderTilePacketPass<4, 2>(job, camera, counts, visits); return;
+        case 16: renderTilePacketPass<4, 4>(job, camera, counts, visits); return;
+    }
+
+    const glm::vec2 resolution(width, height);
+    const float pixelRadius = 0.5f / std::max(resolution.x, resolution.y);
+    const int sqrt_ns = int(std::sqrt(float(numSamples)));
+
+    const int x0 = (job.tile % tilesX) * CPUTILESIZE;
+    const int y0 = (job.tile / tilesX) * CPUTILESIZE;
+    const int x1 = std::min(x0 + CPUTILESIZE, int(width));
+    const int y1 = std::min(y0 + CPUTILESIZE, int(height));
+
+    const int firstSample = job.pass * CPUSAMPLESPERPASS;
+    const int lastSample = std::min(firstSample + CPUSAMPLESPERPASS, numSamples);
+    ThreadCounts localCounts;
+
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            const size_t pixel = size_t(y) * width + x;
+
+            // Same as FragCoord, i.e. the pixel center
+            glm::vec2 fragCoord(x + 0.5f, y + 0.5f);
+            if (job.pass == 0) {
+                randomStates[pixel].state = fragCoord / resolution;
+                accumulation[pixel] = glm::vec3(0.0f);
+            }
+            RandomState& rng = randomStates[pixel];
+
+            // Accumulate samples
+            glm::vec3 col(0.0f);
+            for (int s = firstSample; s < lastSample; s++) {
+                Ray r = sampleRay(camera, fragCoord, resolution, pixelRadius, sqrt_ns, s, rng);
+                col += radiance(r, rng, localCounts, visits);
+            }
+            accumulation[pixel] += col;
+
+            // Average the samples so far and gamma correct, so the framebuffer refines pass by pass
+            framebuffer[pixel] = glm::pow(accumulation[pixel] / float(lastSample), glm::vec3(1.0f / 2.2f));
+        }
+    }
+
+    counts.rays += localCounts.rays;
+    counts.sphereTests += localCounts.sphereTests;
+    counts.mailboxSkips += localCounts.mailboxSkips;
+}
+
+/**
+ * renderTilePass with the camera rays of each block of W x H pixels traced together by tracePacket, then followed alone by
+ * radiance: after a bounce the rays of a block no longer go the same way. Every pixel still draws from its own random state
+ * in the same order, so the image is the same as without packets.
+ */
+template <int W, int H>
+void CPURaytracer::renderTilePacketPass(const TileJob& job, const RayCamera& camera, ThreadCounts& counts, uint32_t* visits) {
+    constexpr int N = W * H;
+    const glm::vec2 resolution(width, height);
+    const float pixelRadius = 0.5f / std::max(resolution.x, resolution.y);
+    const int sqrt_ns = int(std::sqrt(float(numSamples)));
+
+    const int x0 = (job.tile % tilesX) * CPUTILESIZE;
+    const int y0 = (job.tile / tilesX) * CPUTILESIZE;
+    const int x1 = std::min(x0 + CPUTILESIZE, int(width));
+    const int y1 = std::min(y0 + CPUTILESIZE, int(height));
+
+    const int firstSample = job.pass * CPUSAMPLESPERPASS;
+    const int lastSample = std::min(firstSample + CPUSAMPLESPERPASS, numSamples);
+    ThreadCounts localCounts;
+
+    for (int by = y0; by < y1; by += H) {
+        for (int bx = x0; bx < x1; bx += W) {
+            bool inside[N]; // lanes past the edge of the tile stay empty
+            size_t pixels[N];
+            glm::vec2 fragCoords[N];
+            glm::vec3 col[N];
+            for (int lane = 0; lane < N; ++lane) {
+                int x = bx + lane % W;
+                int y = by + lane / W;
+                inside[lane] = x < x1 && y < y1;
+                pixels[lane] = inside[lane] ? size_t(y) * width + x : 0;
+                fragCoords[lane] = glm::vec2(x + 0.5f, y + 0.5f);
+                col[lane] = glm::vec3(0.0f);
+                if (inside[lane] && job.pass == 0) {
+                    randomStates[pixels[lane]].state = fragCoords[lane] / resolution;
+                    accumulation[pixels[lane]] = glm::vec3(0.0f);
+                }
+            }
+
+            for (int s = firstSample; s < lastSample; s++) {
+                Ray rays[N];
+                PrimaryHit hits[N];
+                for (int lane = 0; lane < N; ++lane) {
+                    if (!inside[lane]) continue;
+                    rays[lane] = sampleRay(camera, fragCoords[lane], resolution, pixelRadius, sqrt_ns, s, randomStates[pixels[lane]]);
+                    rays[lane].direction = glm::normalize(rays[lane].direction); // as radiance does before tracing
+                }
+                tracePacket<N>(rays, inside, 0.001f, FLT_MAX, hits, localCounts, visits);
+                for (int lane = 0; lane < N; ++lane) {
+                    if (inside[lane]) col[lane] += radiance(rays[lane], randomStates[pixels[lane]], localCounts, visits, &hits[lane]);
+                }
+            }
+
+            for (int lane = 0; lane < N; ++lane) {
+                if (!inside[lane]) continue;
+                accumulation[pixels[lane]] += col[lane];
+                framebuffer[pixels[lane]] = glm::pow(accumulation[pixels[lane]] / float(lastSample), glm::vec3(1.0f / 2.2f));
+            }
+        }
+    }
+
+    counts.rays += localCounts.rays;
+    counts.sphereTests += localCounts.sphereTests;
+    counts.mailboxSkips += localCounts.mailboxSkips;
+}
+
+// With primary, the first hit of the ray was found already (by tracePacket, for the normalized ray)
+glm::vec3 CPURaytracer::radiance(Ray ray, RandomState& rng, ThreadCounts& counts, uint32_t* visits, const PrimaryHit* primary) const {
+    IntersectInfo rec;
+    glm::vec3 col(1.0f, 1.0f, 1.0f);
+    float importance = 1.0f;
+
+    if (!primary) ray.direction = glm::normalize(ray.direction);
+
+    for (int i = 0; i < maxDepth; i++) {
+        if (importance < 0.01f) break;
+
+        counts.rays++;
+        bool hit;
+        if (i == 0 && primary) {
+            hit = primary->hit;
+            if (hit) rec = primary->rec;
+        } else {
+            Mailbox mailbox(mailboxSize); // a new ray, the spheres it tested are those of this segment only
+            hit = intersectScene(ray, 0.001f, FLT_MAX, rec, visits, &mailbox);
+            counts.sphereTests += mailbox.tests;
+            counts.mailboxSkips += mailbox.skipped;
+        }
+        if (hit) {
+            Ray wi;
+            glm::vec3 attenuation;
+
+            bool wasScattered = materialBsdf(rec, ray, wi, attenuation, rng);
+
+            ray.origin = wi.origin;
+            ray.direction = wi.direction;
+
+            if (wasScattered)
+                col *= attenuation;
+            else {
+                col *= glm::vec3(0.0f);
+                break;
+            }
+            importance *= std::max(attenuation.r, std::max(attenuation.g, attenuation.b));
+        } else {
+            col *= skyColor(ray);
+            break;
+        }
+    }
+
+    return col;
+}
+
+static void setHitRecord(const Sphere& sphere, const Ray& ray, float t, IntersectInfo& rec) {
+    rec.t = t;
+    rec.point = ray.origin + t * ray.direction;
+    rec.normal = (rec.point - sphere.center) / sphere.radius;
+
+    rec.materialType = sphere.materialType;
+    rec.albedo = sphere.albedo;
+    rec.fuzz = sphere.fuzz;
+    rec.refractionIndex = sphere.refractionIndex;
+}
+
+bool CPURaytracer::sphereHit(int sphereIdx, const Ray& ray, float t_min, float t_max, IntersectInfo& rec) const {
+    const Sphere& sphere = (*spheres)[sphereIdx];
+
+    glm::vec3 oc = ray.origin - sphere.center;
+
+    float a = glm::dot(ray.direction, ray.direction);
+    float half_b = glm::dot(oc, ray.direction);
+    float c = glm::dot(oc, oc) - sphere.radius * sphere.radius;
+    float discriminant = half_b * half_b - a * c;
+
+    if (discriminant > 0.0f) {
+        float sqrtd = std::sqrt(discriminant);
+
+        float temp = (-half_b - sqrtd) / a;
+        if (!(temp < t_max && temp > t_min)) {
+            temp = (-half_b + sqrtd) / a;
+        }
+        if (temp < t_max && temp > t_min) {
+            setHitRecord(sphere, ray, temp, rec);
+            return true;
+        }
+    }
+    return false;
+}
+
+// The count spheres of batch from slot first at once, the nearest one hit in (t_min, closest_so_far) like sphereHit on each
+bool CPURaytracer::batchHit(const SphereBatch& batch, size_t first, int count, const Ray& ray, float t_min, float& closest_so_far, IntersectInfo& rec) const {
+    int slot = nearestSphereHit(simdLevel, batch, first, count, ray.origin, ray.direction, t_min, closest_so_far);
+    if (slot < 0) return false;
+    setHitRecord((*spheres)[batch.ids[slot]], ray, closest_so_far, rec);
+    return true;
+}
+
+/**
+ * Front to back traversal of the cells: a child's t interval is cut from its parent's by the ray's crossings of the split
+ * planes, so no child box is tested, and children go on the stack furthest first. Cells are then popped in ray order, and
+ * the traversal stops at the first one entered past the closest hit. With tight bounds, a node whose box the ray misses is
+ * skipped with everything below it. Spheres are tested over the whole ray, a sphere may stick out of the leaf it is in.
+ */
+bool CPURaytracer::traverseOctree(const Ray& ray, float t_min, float t_max, IntersectInfo& rec, uint32_t* visits, Mailbox* mailbox) const {
+    if (octree->isLoose()) return traverseLooseOctree(ray, t_min, t_max, rec, visits, mailbox);
+
+    int nodeStack[MAX_STACK];
+    float tminStack[MAX_STACK];
+    float tmaxStack[MAX_STACK];
+
+    const std::vector<GPUOctreeNode>& nodes = octree->flattenedTree;
+    const bool tightBoxes = octree->hasTightBounds();
+
+    const glm::vec3 invDir = safeInverse(ray.direction);
+    const int first = firstOctant(ray.direction);
+
+    // Root cell interval, clipped to the ray
+    glm::vec3 tbot = (octree->getRootCellMin() - ray.origin) * invDir;
+    glm::vec3 ttop = (octree->getRootCellMax() - ray.origin) * invDir;
+    glm::vec3 tmin3 = glm::min(tbot, ttop);
+    glm::vec3 tmax3 = glm::max(tbot, ttop);
+    float rootTMin = std::max(std::max(std::max(tmin3.x, tmin3.y), tmin3.z), t_min);
+    float rootTMax = std::min(std::min(std::min(tmax3.x, tmax3.y), tmax3.z), t_max);
+    if (rootTMin > rootTMax) return false;
+
+    int stackPtr = 0;
+    nodeStack[0] = 0;
+    tminStack[0] = rootTMin;
+    tmaxStack[0] = rootTMax;
+
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+
+    while (stackPtr >= 0) {
+        int nodeIdx = nodeStack[stackPtr];
+        float node_tmin = tminStack[stackPtr];
+        float node_tmax = tmaxStack[stackPtr];
+        stackPtr--;
+        if (node_tmin > closest_so_far) break; // every cell left on the stack is further along the ray
+        if (visits) visits[nodeIdx]++;
+
+        const GPUOctreeNode& node = nodes[nodeIdx];
+        if (node.childMask == 0 && node.objectCount == 0) continue;
+
+        // A tight box is smaller than the cell and holds the boxes of the children, the ray may miss it and all below it
+        float boxTMin, boxTMax;
+        if (tightBoxes && (!rayBoxIntersection(ray, node.min, node.max, boxTMin, boxTMax) || boxTMax < t_min || boxTMin > closest_so_far)) {
+            continue;
+        }
+
+        if (node.childMask == 0) {
+            if (nodeSpheresHit(nodeIdx, node.objectsOffset, node.objectCount, ray, t_min, closest_so_far, rec, mailbox)) hit_anything = true;
+            continue;
+        }
+
+        // Where the ray crosses the three split planes, each child is before or after the crossing along each axis
+        glm::vec3 tSplit = (node.split - ray.origin) * invDir;
+        for (int i = 7; i >= 0; i--) {
+            int octant = i ^ first;
+            if (!(node.childMask & (1u << octant))) continue; // empty octant, it has no node
+
+            float childTMin = node_tmin;
+            float childTMax = node_tmax;
+            if (i & 4) childTMin = std::max(childTMin, tSplit.z); else childTMax = std::min(childTMax, tSplit.z);
+            if (i & 2) childTMin = std::max(childTMin, tSplit.x); else childTMax = std::min(childTMax, tSplit.x);
+            if (i & 1) childTMin = std::max(childTMin, tSplit.y); else childTMax = std::min(childTMax, tSplit.y);
+            if (childTMin > childTMax || childTMin > closest_so_far) continue; // the ray misses the child, or gets there too late
+
+            assert(stackPtr < MAX_STACK - 1);
+            stackPtr++;
+            nodeStack[stackPtr] = childIndex(node.childrenOffset, node.childMask, octant);
+            tminStack[stackPtr] = childTMin;
+            tmaxStack[stackPtr] = childTMax;
+        }
+    }
+    return hit_anything;
+}
+
+/**
+ * Loose octrees have objects sticking out of their cells, so their boxes are what the ray is tested against. Sibling boxes
+ * overlap and the order is only roughly front to back: a node is skipped when the ray enters it past the closest hit, the
+ * traversal goes on.
+ */
+bool CPURaytracer::traverseLooseOctree(const Ray& ray, float t_min, float t_max, IntersectInfo& rec, uint32_t* visits, Mailbox* mailbox) const {
+    int nodeStack[MAX_STACK];
+    float tminStack[MAX_STACK];
+
+    const std::vector<GPUOctreeNode>& nodes = octree->flattenedTree;
+    const uint32_t* objectIndices = octree->gpuObjectIndices.data();
+    const int indexBits = octree->indexBits;
+    const int octreeNodeCount = int(nodes.size());
+
+    float childTMin, childTMax;
+    if (!rayBoxIntersection(ray, nodes[0].min, nodes[0].max, childTMin, childTMax) || childTMax < t_min || childTMin > t_max) {
+        return false;
+    }
+
+    int stackPtr = 0;
+    nodeStack[0] = 0;
+    tminStack[0] = std::max(childTMin, t_min);
+
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+    const int first = firstOctant(ray.direction);
+
+    while (stackPtr >= 0) {
+        int nodeIdx = nodeStack[stackPtr];
+        float node_tmin = tminStack[stackPtr];
+        stackPtr--;
+        if (node_tmin > closest_so_far) continue; // a closer hit was found since it was pushed
+        if (visits) visits[nodeIdx]++;
+
+        const GPUOctreeNode& node = nodes[nodeIdx];
+
+        // Internal nodes hold objects too. Each sphere is in a single node, so the mailbox only counts the tests
+        if (mailbox) mailbox->tests += node.objectCount;
+        if (useSphereBatches && node.objectCount >= MIN_BATCH_SPHERES) {
+            if (batchHit(nodeBatches, nodeBatchStart[nodeIdx], node.objectCount, ray, t_min, closest_so_far, rec)) {
+                hit_anything = true;
+            }
+        } else {
+            for (int i = 0; i < node.objectCount; i++) {
+                IntersectInfo temp_rec;
+                if (sphereHit(unpackObjectIndex(objectIndices, indexBits, node.objectsOffset + i), ray, t_min, closest_so_far, temp_rec)) {
+                    hit_anything = true;
+                    closest_so_far = temp_rec.t;
+                    rec = temp_rec;
+                }
+            }
+        }
+
+        if (node.childrenOffset != -1) {
+            // Furthest to closest on the stack
+            for (int i = 7; i >= 0; i--) {
+                int octant = i ^ first;
+                if (!(node.childMask & (1u << octant))) continue; // empty octant, it has no node
+
+                int childIdx = childIndex(node.childrenOffset, node.childMask, octant);
+                if (childIdx >= octreeNodeCount) continue;
+
+                const GPUOctreeNode& child = nodes[childIdx];
+                if (!rayBoxIntersection(ray, child.min, child.max, childTMin, childTMax) ||
+                    childTMax < node_tmin || childTMin > closest_so_far) {
+                    continue; // Skip non-intersecting children
+                }
+
+                assert(stackPtr < MAX_STACK - 1);
+                stackPtr++;
+                nodeStack[stackPtr] = childIdx;
+                tminStack[stackPtr] = std::max(childTMin, node_tmin);
+            }
+        }
+    }
+    return hit_anything;
+}
+
+/**
+ * Traversal of the compact nodes. A node only knows its children's boxes, decoded on the way down, so the stack also carries
+ * the node boxes; the quantized boxes may overlap a little, so like the loose traversal it skips the nodes entered past the
+ * closest hit instead of stopping.
+ */
+bool CPURaytracer::traverseCompactOctree(const Ray& ray, float t_min, float t_max, IntersectInfo& rec, uint32_t* visits, Mailbox* mailbox) const {
+    int nodeStack[MAX_STACK];
+    float tminStack[MAX_STACK];
+    glm::vec3 minStack[MAX_STACK];
+    glm::vec3 maxStack[MAX_STACK];
+
+    const std::vector<GPUCompactNode>& nodes = octree->compactTree;
+
+    float childTMin, childTMax;
+    const glm::vec3& rootMin = octree->flattenedTree[0].min;
+    const glm::vec3& rootMax = octree->flattenedTree[0].max;
+    if (!rayBoxIntersection(ray, rootMin, rootMax, childTMin, childTMax) || childTMax < t_min || childTMin > t_max) {
+        return false;
+    }
+
+    int stackPtr = 0;
+    nodeStack[0] = 0;
+    tminStack[0] = std::max(childTMin, t_min);
+    minStack[0] = rootMin;
+    maxStack[0] = rootMax;
+
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+    const int first = firstOctant(ray.direction);
+
+    while (stackPtr >= 0) {
+        float node_tmin = tminStack[stackPtr];
+        if (node_tmin > closest_so_far) { // a closer hit was found since it was pushed
+            stackPtr--;
+            continue;
+        }
+        const int nodeIdx = nodeStack[stackPtr];
+        if (visits) visits[nodeIdx]++;
+        const GPUCompactNode& node = nodes[nodeIdx];
+        glm::vec3 nodeMin = minStack[stackPtr];
+        glm::vec3 nodeMax = maxStack[stackPtr];
+        stackPtr--;
+
+        unsigned int childMask = node.info & 0xffu;
+
+        // Test objects in leaf nodes
+        if (childMask == 0) {
+            if (nodeSpheresHit(nodeIdx, int(node.offset), int(node.info >> 8), ray, t_min, closest_so_far, rec, mailbox)) hit_anything = true;
+        } else {
+            // Furthest to closest on the stack
+            for (int i = 7; i >= 0; i--) {
+                int octant = i ^ first;
+                if (!(childMask & (1u << octant))) continue; // empty octant, it has no node
+
+                glm::vec3 childMin, childMax;
+                decodeCompactChildBox(node, octant, nodeMin, nodeMax, childMin, childMax);
+
+                // Check if child intersects ray before adding to stack
+                if (!rayBoxIntersection(ray, childMin, childMax, childTMin, childTMax) ||
+                    childTMax < node_tmin || childTMin > closest_so_far) {
+                    continue; // Skip non-intersecting children
+                }
+
+                assert(stackPtr < MAX_STACK - 1);
+                stackPtr++;
+                nodeStack[stackPtr] = childIndex(int(node.offset), childMask, octant);
+                tminStack[stackPtr] = std::max(childTMin, node_tmin);
+                minStack[stackPtr] = childMin;
+                maxStack[stackPtr] = childMax;
+            }
+        }
+    }
+    return hit_anything;
+}
+
+// Parameter where the ray leaves the cell [cellMin, cellMax], and the face it leaves through (see GPURopeNode)
+static float cellExit(const Ray& ray, const glm::vec3& invDir, const glm::vec3& cellMin, const glm::vec3& cellMax, int& face) {
+    float tExit = FLT_MAX;
+    for (int axis = 0; axis < 3; axis++) {
+        bool positive = !(ray.direction[axis] < 0.0f);
+        float t = ((positive ? cellMax[axis] : cellMin[axis]) - ray.origin[axis]) * invDir[axis];
+        if (t < tExit) {
+            tExit = t;
+            face = 2 * axis + positive;
+        }
+    }
+    return tExit;
+}
+
+/**
+ * Stackless traversal along the ropes of Octree::ropeTree. From the node it enters, the ray goes down to the cell it is in
+ * just after t, picking at each node the octant whose interval of the front to back traversal holds t, and on to the cell's
+ * exit: through a leaf's rope, through the parent again for an empty octant left through a split, or through the parent's
+ * rope for one left through the parent's face. It stops at the first exit past the closest hit or past the root cell.
+ */
+bool CPURaytracer::traverseRopes(const Ray& ray, float t_min, float t_max, IntersectInfo& rec, uint32_t* visits, Mailbox* mailbox) const {
+    const std::vector<GPUOctreeNode>& nodes = octree->flattenedTree;
+    const std::vector<GPURopeNode>& ropes = octree->ropeTree;
+    const bool tightBoxes = octree->hasTightBounds();
+
+    const glm::vec3 invDir = safeInverse(ray.direction);
+    const int first = firstOctant(ray.direction);
+
+    // Root cell interval, clipped to the ray
+    glm::vec3 tbot = (octree->getRootCellMin() - ray.origin) * invDir;
+    glm::vec3 ttop = (octree->getRootCellMax() - ray.origin) * invDir;
+    glm::vec3 tmin3 = glm::min(tbot, ttop);
+    glm::vec3 tmax3 = glm::max(tbot, ttop);
+    float t = std::max(std::max(std::max(tmin3.x, tmin3.y), tmin3.z), t_min);
+    float rootTMax = std::min(std::min(std::min(tmax3.x, tmax3.y), tmax3.z), t_max);
+    if (t > rootTMax) return false;
+
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+    int nodeIdx = 0;
+
+    while (nodeIdx != -1) {
+        glm::vec3 cellMin(ropes[nodeIdx].cellMin);
+        glm::vec3 cellMax(ropes[nodeIdx].cellMax);
+        glm::vec3 parentMin, parentMax;
+        int parent = -1;
+
+        // Down to the leaf, or the empty octant, holding the ray just after t
+        while (nodeIdx != -1 && nodes[nodeIdx].childMask != 0) {
+            if (visits) visits[nodeIdx]++;
+            const GPUOctreeNode& node = nodes[nodeIdx];
+            glm::vec3 tSplit = (node.split - ray.origin) * invDir;
+            int octant = ((t >= tSplit.z) << 2 | (t >= tSplit.x) << 1 | (t >= tSplit.y)) ^ first;
+
+            parent = nodeIdx;
+            parentMin = cellMin;
+            parentMax = cellMax;
+            octantBounds(octant, parentMin, parentMax, node.split, cellMin, cellMax);
+            nodeIdx = (node.childMask & (1u << octant)) ? childIndex(node.childrenOffset, node.childMask, octant) : -1;
+        }
+
+        int face = 0;
+        float tExit = cellExit(ray, invDir, cellMin, cellMax, face);
+
+        if (nodeIdx != -1) {
+            if (visits) visits[nodeIdx]++;
+            const GPUOctreeNode& leaf = nodes[nodeIdx];
+            // A tight box is smaller than the cell, the ray may miss it
+            float boxTMin, boxTMax;
+            bool missed = leaf.objectCount == 0 ||
+                (tightBoxes && (!rayBoxIntersection(ray, leaf.min, leaf.max, boxTMin, boxTMax) || boxTMax < t_min || boxTMin > closest_so_far));
+            if (!missed && nodeSpheresHit(nodeIdx, leaf.objectsOffset, leaf.objectCount, ray, t_min, closest_so_far, rec, mailbox)) {
+                hit_anything = true;
+            }
+        }
+
+        // Every cell after this one starts at tExit
+        if (tExit >= closest_so_far || tExit >= rootTMax) break;
+
+        if (nodeIdx != -1) {
+            nodeIdx = ropes[nodeIdx].ropes[face];
+        } else {
+            int parentFace = 0;
+            float parentExit = cellExit(ray, invDir, parentMin, parentMax, parentFace);
+            nodeIdx = tExit < parentExit ? parent : ropes[parent].ropes[parentFace];
+        }
+        t = tExit;
+    }
+    return hit_anything;
+}
+
+// The objectCount spheres of leaf nodeIdx from objectsOffset, as its full or compact node has them, against one ray: in a
+// batch, or one by one past the mailbox
+bool CPURaytracer::nodeSpheresHit(int nodeIdx, int objectsOffset, int objectCount, const Ray& ray, float t_min, float& closest_so_far, IntersectInfo& rec, Mailbox* mailbox) const {
+    if (useSphereBatches && objectCount >= MIN_BATCH_SPHERES) {
+        if (mailbox) mailbox->tests += objectCount;
+        return batchHit(nodeBatches, nodeBatchStart[nodeIdx], objectCount, ray, t_min, closest_so_far, rec);
+    }
+
+    const uint32_t* objectIndices = octree->gpuObjectIndices.data();
+    bool hit_anything = false;
+    for (int i = 0; i < objectCount; i++) {
+        int sphereIdx = unpackObjectIndex(objectIndices, octree->indexBits, objectsOffset + i);
+        if (mailbox && mailbox->skip(sphereIdx)) continue;
+        IntersectInfo temp_rec;
+        if (sphereHit(sphereIdx, ray, t_min, closest_so_far, temp_rec)) {
+            hit_anything = true;
+            closest_so_far = temp_rec.t;
+            rec = temp_rec;
+        }
+    }
+    return hit_anything;
+}
+
+/**
+ * traverseOctree for a packet of N rays, such as the camera rays of a pixel block: each node is fetched once for the whole
+ * packet and pushed with the t interval of every ray, empty for the rays that miss it: their lanes are inactive below it.
+ * Children go on the stack in the front to back order of the packet's dominant direction, the sign most of its rays have
+ * along each axis, and are skipped without looking at the lanes when the bounds of the packet's intervals already miss
+ * them. A child is pushed when any ray reaches it before its closest hit, and each ray tests the spheres of the leaves it
+ * is active in. A ray going the dominant way meets the same leaves in the same order as alone and stops at the same one,
+ * the others meet every leaf they reach before their closest hit, in another order, and get the same closest hit. The
+ * loose, compact and rope traversals are traced ray by ray.
+ */
+template <int N>
+void CPURaytracer::tracePacket(const Ray* rays, const bool* active, float t_min, float t_max, PrimaryHit* hits, ThreadCounts& counts, uint32_t* visits) const {
+    int laneOctant[N] = {};
+    int negative[3] = {}, lanes = 0; // rays going down each bit of the octants
+    for (int lane = 0; lane < N; ++lane) {
+        if (!active[lane]) continue;
+        laneOctant[lane] = firstOctant(rays[lane].direction);
+        for (int bit = 0; bit < 3; ++bit) negative[bit] += (laneOctant[lane] >> bit) & 1;
+        lanes++;
+    }
+    if (useOctree != 1 || useRopes || useCompactNodes || octree->isLoose() || lanes == 0) {
+        for (int lane = 0; lane < N; ++lane) {
+            if (!active[lane]) continue;
+            Mailbox mailbox(mailboxSize);
+            hits[lane].hit = intersectScene(rays[lane], t_min, t_max, hits[lane].rec, visits, &mailbox);
+            counts.sphereTests += mailbox.tests;
+            counts.mailboxSkips += mailbox.skipped;
+        }
+        return;
+    }
+
+    // Lanes are kept as arrays of each coordinate so the loops over them vectorize. A lane out of a cell has the empty
+    // interval [INF, -INF] there, which every child keeps
+    struct PacketEntry {
+        int node;
+        float tmin[N];
+        float tmax[N];
+    };
+    PacketEntry stack[MAX_STACK];
+    const float INF = std::numeric_limits<float>::infinity();
+
+    const std::vector<GPUOctreeNode>& nodes = octree->flattenedTree;
+    const bool tightBoxes = octree->hasTightBounds();
+
+    int first = 0;
+    for (int bit = 0; bit < 3; ++bit) first |= (2 * negative[bit] > lanes) << bit;
+
+    float ox[N], oy[N], oz[N];
+    float ix[N], iy[N], iz[N];
+    float closest[N];
+    bool done[N] = {};
+    Mailbox mailboxes[N];
+
+    // Root cell interval of each ray, clipped to the ray
+    bool reached = false;
+    stack[0].node = 0;
+    for (int lane = 0; lane < N; ++lane) {
+        ox[lane] = oy[lane] = oz[lane] = 0.0f;
+        ix[lane] = iy[lane] = iz[lane] = 0.0f;
+        closest[lane] = t_max;
+        stack[0].tmin[lane] = INF;
+        stack[0].tmax[lane] = -INF;
+        if (!active[lane]) continue;
+
+        const Ray& ray = rays[lane];
+        glm::vec3 invDir = safeInverse(ray.direction);
+        ox[lane] = ray.origin.x;
+        oy[lane] = ray.origin.y;
+        oz[lane] = ray.origin.z;
+        ix[lane] = invDir.x;
+        iy[lane] = invDir.y;
+        iz[lane] = invDir.z;
+        mailboxes[lane] = Mailbox(mailboxSize);
+
+        glm::vec3 tbot = (octree->getRootCellMin() - ray.origin) * invDir;
+        glm::vec3 ttop = (octree->getRootCellMax() - ray.origin) * invDir;
+        glm::vec3 tmin3 = glm::min(tbot, ttop);
+        glm::vec3 tmax3 = glm::max(tbot, ttop);
+        float rootTMin = std::max(std::max(std::max(tmin3.x, tmin3.y), tmin3.z), t_min);
+        float rootTMax = std::min(std::min(std::min(tmax3.x, tmax3.y), tmax3.z), t_max);
+        if (rootTMin > rootTMax) continue;
+        stack[0].tmin[lane] = rootTMin;
+        stack[0].tmax[lane] = rootTMax;
+        reached = true;
+    }
+    int stackPtr = reached ? 0 : -1;
+
+    while (stackPtr >= 0) {
+        PacketEntry entry = stack[stackPtr--]; // a copy, the children go in its slot
+
+        // Lanes that reach the cell before their closest hit. A ray going the dominant way past it is done, as a lone ray
+        // stops there, the others may still have nearer cells on the stack
+        bool live[N];
+        bool anyLive = false;
+        for (int lane = 0; lane < N; ++lane) {
+            bool inCell = entry.tmin[lane] <= entry.tmax[lane];
+            bool late = inCell && entry.tmin[lane] > closest[lane];
+            done[lane] = done[lane] || (late && laneOctant[lane] == first);
+            live[lane] = inCell && !late && !done[lane];
+            anyLive = anyLive || live[lane];
+        }
+        if (!anyLive) continue;
+        if (visits) visits[entry.node]++;
+        const GPUOctreeNode& node = nodes[entry.node];
+        if (node.childMask == 0 && node.objectCount == 0) continue;
+
+        // A tight box is smaller than the cell and holds the boxes of the children, the rays that miss it are out below it
+        if (tightBoxes) {
+            anyLive = false;
+            for (int lane = 0; lane < N; ++lane) {
+                float boxTMin, boxTMax;
+                live[lane] = live[lane] && rayBoxIntersection(rays[lane], node.min, node.max, boxTMin, boxTMax) && !(boxTMax < t_min) && !(boxTMin > closest[lane]);
+                anyLive = anyLive || live[lane];
+            }
+            if (!anyLive) continue;
+        }
+
+        if (node.childMask == 0) {
+            for (int lane = 0; lane < N; ++lane) {
+                if (!live[lane]) continue;
+                if (nodeSpheresHit(entry.node, node.objectsOffset, node.objectCount, rays[lane], t_min, closest[lane], hits[lane].rec, &mailboxes[lane])) hits[lane].hit = true;
+            }
+            continue;
+        }
+
+        // Where each ray crosses the three split planes, and the lanes that are not live emptied so their children stay empty
+        float tSplitX[N], tSplitY[N], tSplitZ[N];
+        for (int lane = 0; lane < N; ++lane) {
+            tSplitX[lane] = (node.split.x - ox[lane]) * ix[lane];
+            tSplitY[lane] = (node.split.y - oy[lane]) * iy[lane];
+            tSplitZ[lane] = (node.split.z - oz[lane]) * iz[lane];
+            entry.tmin[lane] = live[lane] ? entry.tmin[lane] : INF;
+            entry.tmax[lane] = live[lane] ? entry.tmax[lane] : -INF;
+        }
+
+        // Bounds of the live lanes: the earliest entry, the latest exit and closest hit, and the crossings of each plane (in
+        // z, x, y order, as the bits of the octants). A plane the live rays cross going different ways, or that one of them
+        // runs along (a NaN crossing, which the lanes ignore), bounds no child
+        float packetTMin = INF, packetTMax = -INF, packetClosest = -INF;
+        float splitMin[3] = {INF, INF, INF}, splitMax[3] = {-INF, -INF, -INF};
+        bool bounding[3] = {true, true, true};
+        for (int lane = 0; lane < N; ++lane) {
+            if (!live[lane]) continue;
+            packetTMin = std::min(packetTMin, entry.tmin[lane]);
+            packetTMax = std::max(packetTMax, entry.tmax[lane]);
+            packetClosest = std::max(packetClosest, closest[lane]);
+            const float crossings[3] = {tSplitY[lane], tSplitX[lane], tSplitZ[lane]};
+            for (int bit = 0; bit < 3; ++bit) {
+                bounding[bit] = bounding[bit] && ((laneOctant[lane] ^ first) >> bit & 1) == 0 && !std::isnan(crossings[bit]);
+                splitMin[bit] = std::min(splitMin[bit], crossings[bit]);
+                splitMax[bit] = std::max(splitMax[bit], crossings[bit]);
+            }
+        }
+
+        for (int i = 7; i >= 0; i--) {
+            int octant = i ^ first;
+            if (!(node.childMask & (1u << octant))) continue; // empty octant, it has no node
+
+            // no live ray can reach the child before its closest hit
+            float boundTMin = packetTMin, boundTMax = packetTMax;
+            for (int bit = 0; bit < 3; ++bit) {
+                if (!bounding[bit]) continue;
+                if (i >> bit & 1) boundTMin = std::max(boundTMin, splitMin[bit]); else boundTMax = std::min(boundTMax, splitMax[bit]);
+            }
+            if (boundTMin > boundTMax || boundTMin > packetClosest) continue;
+
+            PacketEntry& child = stack[stackPtr + 1];
+            bool anyChild = false;
+            for (int lane = 0; lane < N; ++lane) {
+                // the child in the order of this ray
+                int near = octant ^ laneOctant[lane];
+                float childTMin = entry.tmin[lane];
+                float childTMax = entry.tmax[lane];
+                if (near & 4) childTMin = std::max(childTMin, tSplitZ[lane]); else childTMax = std::min(childTMax, tSplitZ[lane]);
+                if (near & 2) childTMin = std::max(childTMin, tSplitX[lane]); else childTMax = std::min(childTMax, tSplitX[lane]);
+                if (near & 1) childTMin = std::max(childTMin, tSplitY[lane]); else childTMax = std::min(childTMax, tSplitY[lane]);
+                // this ray misses the child, or gets there too late
+                bool in = !(childTMin > childTMax) && !(childTMin > closest[lane]);
+                child.tmin[lane] = in ? childTMin : INF;
+                child.tmax[lane] = in ? childTMax : -INF;
+                anyChild = anyChild || in;
+            }
+            if (anyChild) {
+                child.node = childIndex(node.childrenOffset, node.childMask, octant);
+                stackPtr++;
+            }
+        }
+    }
+
+    for (int lane = 0; lane < N; ++lane) {
+        counts.sphereTests += mailboxes[lane].tests;
+        counts.mailboxSkips += mailboxes[lane].skipped;
+    }
+}
+
+bool CPURaytracer::bruteForceIntersect(const Ray& ray, float t_min, float t_max, IntersectInfo& rec) const {
+    if (useSphereBatches) {
+        float closest_so_far = t_max;
+        return batchHit(sceneBatch, 0, int(spheres->size()), ray, t_min, closest_so_far, rec);
+    }
+
+    IntersectInfo temp_rec;
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+
+    for (int i = 0; i < int(spheres->size()); i++) {
+        if (sphereHit(i, ray, t_min, closest_so_far, temp_rec)) {
+            hit_anything = true;
+            closest_so_far = temp_rec.t;
+            rec = temp_rec;
+        }
+    }
+
+    return hit_anything;
+}
+
+bool CPURaytracer::intersectScene(const Ray& ray, float t_min, float t_max, IntersectInfo& rec, uint32_t* visits, Mailbox* mailbox) const {
+    if (useOctree == 1) {
+        if (useRopes) return traverseRopes(ray, t_min, t_max, rec, visits, mailbox);
+        if (useCompactNodes) return traverseCompactOctree(ray, t_min, t_max, rec, visits, mailbox);
+        return traverseOctree(ray, t_min, t_max, rec, visits, mailbox);
+    } else {
+        return bruteForceIntersect(ray, t_min, t_max, rec);
+    }
+}
+
+bool CPURaytracer::intersect(const Ray& ray, float t_min, float t_max, IntersectInfo& rec) const {
+    Mailbox mailbox(mailboxSize);
+    return intersectScene(ray, t_min, t_max, rec, nullptr, &mailbox);
+}
+
+bool CPURaytracer::savePPM(const std::string& filename) const {
+    std::ofstream outFile(filename, std::ios::out | std::ios::binary);
+    if (!outFile || !outFile.is_open()) {
+        std::cerr << "Error opening file for writing: " << filename << std::endl;
+        return false;
+    }
+
+    outFile << "P6\n" << width << " " << height << "\n255\n";
+    // PPM rows go top to bottom
+    for (int y = int(height) - 1; y >= 0; --y) {
+        for (unsigned int x = 0; x < width; ++x) {
+            glm::vec3 color = glm::clamp(framebuffer[size_t(y) * width + x], 0.0f, 1.0f);
+            unsigned char rgb[3] = {
+                static_cast<unsigned char>(color.r * 255.0f + 0.5f),
+                static_cast<unsigned char>(color.g * 255.0f + 0.5f),
+                static_cast<unsigned char>(color.b * 255.0f + 0.5f)
+            };
+            outFile.write(reinterpret_cast<const char*>(rgb), 3);
+        }
+    }
+
+    return true;
+}
+
+bool CPURaytracer::saveTileTimes(const std::string& filename) const {
+    std::ofstream outFile(filename, std::ios::out);
+    if (!outFile || !outFile.is_open()) {
+        std::cerr << "Error opening file for writing: " << filename << std::endl;
+        return false;
+    }
+
+    outFile << "tileX;tileY;seconds" << std::endl;
+    for (int tile = 0; tile < int(tileTimes.size()); ++tile) {
+        outFile << tile % tilesX << ";" << tile / tilesX << ";" << tileTimes[tile] << std::endl;
+    }
+
+    return true;
+}
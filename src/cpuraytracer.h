@@ -0,0 +1,176 @@
+#ifndef CPURAYTRACER_H
+#define CPURAYTRACER_H
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "config.h"
+#include "octree.h"
+#include "sphere.h"
+#include "spherebatch.h"
+#include "tilescheduler.h"
+
+// The same structures as the ones in the fragment shader
+struct Ray {
+    glm::vec3 origin;
+    glm::vec3 direction;
+};
+
+struct IntersectInfo {
+    // surface properties
+    float t;
+    glm::vec3 point;
+    glm::vec3 normal;
+
+    // material properties
+    int materialType;
+    glm::vec3 albedo;
+    float fuzz;
+    float refractionIndex;
+};
+
+struct RayCamera {
+    glm::vec3 origin;
+    glm::vec3 lowerLeftCorner;
+    glm::vec3 horizontal;
+    glm::vec3 vertical;
+    glm::vec3 u, v, w;
+    float lensRadius;
+};
+
+// Per pixel random state, seeded like randState in the shader
+struct RandomState {
+    glm::vec2 state;
+
+    float next();
+};
+
+/**
+ * The last spheres one ray tested, in a ring of size slots (0 turns it off). Strict octrees put a sphere in every leaf it
+ * overlaps, so a ray crossing several of them skips it after the first test: it either missed over a longer interval then,
+ * or it is the closest hit already. Also counts the tests done and skipped.
+ */
+struct Mailbox {
+    static const int MAX_SIZE = 16;
+
+    explicit Mailbox(int size = 0);
+    // True if sphereIdx was tested already, otherwise it is remembered and counted as a test
+    bool skip(int sphereIdx);
+
+    int ids[MAX_SIZE];
+    int size;
+    int next = 0; // Slot the next sphere goes to, the oldest one
+    unsigned long long tests = 0;
+    unsigned long long skipped = 0;
+};
+
+static_assert(MAILBOXSIZE >= 0 && MAILBOXSIZE <= Mailbox::MAX_SIZE, "MAILBOXSIZE must be between 0 and Mailbox::MAX_SIZE");
+
+/**
+ * Headless renderer that runs the octree fragment shader on the CPU.
+ * Each frame is cut into tiles that are refined pass by pass on a work-stealing thread pool
+ * and written into an in-memory framebuffer, so it needs neither a window nor an OpenGL context.
+ */
+class CPURaytracer {
+    public:
+        CPURaytracer(unsigned int width = SCR_WIDTH, unsigned int height = SCR_HEIGHT, unsigned int numThreads = CPUTHREADS);
+
+        // Gamma corrected colors, rows go bottom to top like gl_FragCoord
+        std::vector<glm::vec3> framebuffer;
+
+        // Stats of the last rendered frame
+        double frameTime = 0.0;
+        unsigned long long rayCount = 0; // Number of rays cast against the scene (camera rays and bounces)
+        double mraysPerSecond = 0.0;
+        unsigned long long sphereTests = 0;  // Sphere intersection tests of the octree traversals
+        unsigned long long mailboxSkips = 0; // Tests the mailbox saved, spheres met again in another leaf
+
+        // Seconds spent on each tile (row major, bottom row first), shows where the load imbalance is
+        int tilesX, tilesY;
+        std::vector<double> tileTimes;
+
+        // With countNodeVisits, every frame adds the times the traversal visited each node to nodeVisits (for Octree::reorderByVisits)
+        bool countNodeVisits = false;
+        std::vector<uint64_t> nodeVisits;
+
+        // Same as the shader uniforms: trace through the octree (1) or test every sphere (0), and read its compact nodes
+        int useOctree = USEOCTREE;
+        int useCompactNodes = COMPACTNODES;
+        // Walk the leaves along the ropes of Octree::ropeTree instead of the stack traversal, like useRopes in the shader
+        bool useRopes = USEROPES != 0;
+        // Slots of the mailbox of each ray, like mailboxSize in the shader (0 = off, at most Mailbox::MAX_SIZE)
+        int mailboxSize = MAILBOXSIZE;
+        // Test the spheres of a node, or of the whole scene without the octree, in batches of SoA copies (CPUSIMD) with the
+        // kernels of simdLevel, the widest the CPU runs unless set lower. The mailbox only counts the tests of a batch
+        bool useSphereBatches = CPUSIMD != 0;
+        SimdLevel simdLevel = detectSimdLevel();
+        // Rays per packet of camera rays (CPUPACKETSIZE: 0 = off, 4, 8 or 16)
+        int packetSize = CPUPACKETSIZE;
+
+        void setScene(const std::vector<Sphere>& spheres, const Octree& octree);
+        // Checks the settings against the scene and gathers the sphere batches, renderFrame starts with it
+        void prepareFrame();
+        void renderFrame(const glm::mat4& view, const glm::vec3& cameraPosition, float cameraZoom);
+        // Closest hit of a single ray in (t_min, t_max) with the current settings, once prepareFrame ran for them
+        bool intersect(const Ray& ray, float t_min, float t_max, IntersectInfo& rec) const;
+        bool savePPM(const std::string& filename) const;
+        bool saveTileTimes(const std::string& filename) const;
+    private:
+        unsigned int width, height;
+        unsigned int numThreads;
+        TileScheduler scheduler;
+
+        // Sample sums and random states kept between the passes of a tile
+        std::vector<glm::vec3> accumulation;
+        std::vector<RandomState> randomStates;
+        std::vector<std::vector<uint32_t>> threadVisits; // Visits of the current frame, per thread so they need no atomics
+
+        // Counts of the current frame, per thread like threadVisits
+        struct ThreadCounts {
+            unsigned long long rays = 0;
+            unsigned long long sphereTests = 0;
+            unsigned long long mailboxSkips = 0;
+        };
+
+        // First hit of a camera ray, found by tracePacket before radiance follows the ray
+        struct PrimaryHit {
+            bool hit = false;
+            IntersectInfo rec;
+        };
+
+        const std::vector<Sphere>* spheres;
+        const Octree* octree;
+
+        // With useSphereBatches, gathered by renderFrame: the spheres of each node from slot nodeBatchStart[node] of
+        // nodeBatches, and every sphere in sceneBatch
+        SphereBatch nodeBatches;
+        std::vector<size_t> nodeBatchStart;
+        SphereBatch sceneBatch;
+        void gatherSphereBatches();
+
+        // Same as the shader uniforms
+        int numSamples;
+        int maxDepth;
+
+        // visits is null unless countNodeVisits, otherwise the counts of the calling thread
+        void renderTilePass(const TileJob& job, const RayCamera& camera, ThreadCounts& counts, uint32_t* visits);
+        template <int W, int H>
+        void renderTilePacketPass(const TileJob& job, const RayCamera& camera, ThreadCounts& counts, uint32_t* visits);
+        glm::vec3 radiance(Ray ray, RandomState& rng, ThreadCounts& counts, uint32_t* visits, const PrimaryHit* primary = nullptr) const;
+
+        // Intersection functions
+        bool sphereHit(int sphereIdx, const Ray& ray, float t_min, float t_max, IntersectInfo& rec) const;
+        bool batchHit(const SphereBatch& batch, size_t first, int count, const Ray& ray, float t_min, float& closest_so_far, IntersectInfo& rec) const;
+        bool traverseOctree(const Ray& ray, float t_min, float t_max, IntersectInfo& rec, uint32_t* visits = nullptr, Mailbox* mailbox = nullptr) const;
+        bool traverseLooseOctree(const Ray& ray, float t_min, float t_max, IntersectInfo& rec, uint32_t* visits = nullptr, Mailbox* mailbox = nullptr) const;
+        bool traverseCompactOctree(const Ray& ray, float t_min, float t_max, IntersectInfo& rec, uint32_t* visits = nullptr, Mailbox* mailbox = nullptr) const;
+        bool traverseRopes(const Ray& ray, float t_min, float t_max, IntersectInfo& rec, uint32_t* visits = nullptr, Mailbox* mailbox = nullptr) const;
+        template <int N>
+        void tracePacket(const Ray* rays, const bool* active, float t_min, float t_max, PrimaryHit* hits, ThreadCounts& counts, uint32_t* visits) const;
+        bool nodeSpheresHit(int nodeIdx, int objectsOffset, int objectCount, const Ray& ray, float t_min, float& closest_so_far, IntersectInfo& rec, Mailbox* mailbox) const;
+        bool bruteForceIntersect(const Ray& ray, float t_min, float t_max, IntersectInfo& rec) const;
+        bool intersectScene(const Ray& ray, float t_min, float t_max, IntersectInfo& rec, uint32_t* visits = nullptr, Mailbox* mailbox = nullptr) const;
+};
+
+#endif // CPURAYTRACER_H
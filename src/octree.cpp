@@ -1,47 +1,46 @@
 #include "octree.h"
+#include "parallel.h"
 #include <glm/glm.hpp>
-#include <map>
-#include <queue>
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <thread>
 
 OctreeNode::OctreeNode(const glm::vec3& min, const glm::vec3& max)
-    : min(min), max(max), isLeaf(true), childrenOffset(-1), objectsOffset(-1), objectCount(0){
+    : isLeaf(true), min(min), max(max), split((min + max) * 0.5f), childrenOffset(-1), objectIndices(nullptr), objectsOffset(-1), objectCount(0){
     for (int i = 0; i < 8; ++i) {
         children[i] = nullptr;
     }
 }
 
-OctreeNode::~OctreeNode() {
-    for (int i = 0; i < 8; ++i) {
-        delete children[i];
+Octree::Octree(int maxDepth, int maxSpheresPerNode, int numThreads, OctreeBuildMode buildMode, bool tightBounds, bool autoTune, NodeLayout layout)
+    : root(nullptr), maxDepth(maxDepth), maxSpheresPerNode(maxSpheresPerNode),
+    numThreads(numThreads > 0 ? numThreads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()))),
+    buildMode(buildMode), tightBounds(tightBounds), autoTune(autoTune), layout(layout) {
+    if (maxDepth < 0 || maxDepth > MAX_TREE_DEPTH) {
+        throw std::invalid_argument("The octree depth must be between 0 and MAX_TREE_DEPTH, the traversal stacks are sized for it");
+    }
+    if (autoTune && buildMode == MortonBuild) {
+        throw std::invalid_argument("Automatic tuning needs a top-down build mode, the Morton build has no per node split decision");
     }
 }
 
-Octree::Octree(int maxDepth, int maxSpheresPerNode)
-    : root(nullptr), maxDepth(maxDepth), maxSpheresPerNode(maxSpheresPerNode) {}
-
 Octree::~Octree() {
     cleanup();
 }
 
+/**
+ * Drops the whole tree at once. The arenas keep their memory for the next build, it is only freed with the Octree.
+ */
 void Octree::cleanup() {
-    if (root) {
-        cleanupNode(root);
-        delete root;
-        root = nullptr;
-    }
-}
-
-void Octree::cleanupNode(OctreeNode* node) {
-    if (!node->isLeaf) {
-        for (int i = 0; i < 8; ++i) {
-            if (node->children[i]) {
-                cleanupNode(node->children[i]);
-                delete node->children[i];
-                node->children[i] = nullptr;
-            }
-        }
-    }
+    root = nullptr;
+    nodeArena.reset();
+    indexArena.reset();
 }
 
 void Octree::build(const std::vector<Sphere>& spheres, const int debug) {
@@ -51,22 +50,56 @@ void Octree::build(const std::vector<Sphere>& spheres, const int debug) {
         throw std::invalid_argument("Sphere list is empty");
     }
 
-    glm::vec3 min = spheres[0].center - glm::vec3(spheres[0].radius, spheres[0].radius, spheres[0].radius);
-    glm::vec3 max = spheres[0].center + glm::vec3(spheres[0].radius, spheres[0].radius, spheres[0].radius);
-
-    for (const Sphere& sphere : spheres) {
-        glm::vec3 sphereMin = sphere.center - glm::vec3(sphere.radius, sphere.radius, sphere.radius);
-        glm::vec3 sphereMax = sphere.center + glm::vec3(sphere.radius, sphere.radius, sphere.radius);
+    cleanup();
 
-        min = glm::min(min, sphereMin);
-        max = glm::max(max, sphereMax);
+    glm::vec3 min, max;
+    computeBounds(spheres, min, max);
+    min -= glm::vec3(rootMargin);
+    max += glm::vec3(rootMargin);
+    rootCellMin = min;
+    rootCellMax = max;
+    resetUpdates();
+    visitOrdered = false;
+    compactTree.clear(); // of the previous tree, setCompactData and setRopeData fill them again
+    ropeTree.clear();
+
+    const auto boundsEnd{std::chrono::steady_clock::now()};
+
+    if (buildMode == MortonBuild) {
+        // No OctreeNodes at all, the flattened tree is written directly
+        buildMorton(spheres, min, max);
+
+        const auto finish{std::chrono::steady_clock::now()};
+        const std::chrono::duration<double> bounds_seconds{boundsEnd - start};
+        const std::chrono::duration<double> subdivide_seconds{finish - boundsEnd};
+        const std::chrono::duration<double> elapsed_seconds{finish - start};
+        boundsTime = bounds_seconds.count();
+        subdivideTime = subdivide_seconds.count();
+        buildTime = elapsed_seconds.count();
+        cout << "Total build time: " << buildTime << "s (bounds: " << boundsTime << "s, morton build: " << subdivideTime << "s, " << numThreads << " threads)" << std::endl;
+        duplicationFactor = double(objectIndices.size()) / spheres.size();
+        cout << "References per sphere: " << duplicationFactor << std::endl;
+
+        const auto start2{std::chrono::steady_clock::now()};
+        if (tightBounds) tightenBounds(spheres);
+        if (layout != BFSLayout) reorderNodes();
+        indexBits = objectIndexBits(spheres.size());
+        packObjectIndices(0, objectIndices.size());
+        const std::chrono::duration<double> elapsed_seconds2{std::chrono::steady_clock::now() - start2};
+        gpuConversionTime = elapsed_seconds2.count();
+        cout << "Object indices: " << indexBits << " bit, " << gpuObjectIndices.size() * sizeof(uint32_t) << " bytes" << std::endl;
+        computeCostStats();
+        builtCost = predictedCost;
+        builtDuplication = duplicationFactor;
+        return;
     }
     
-    root = new OctreeNode(min, max);
+    root = new (nodeArena.allocate(1)) OctreeNode(min, max);
 
     // since it contains everything, we add all indices to the root node
-    for (int i = 0; i < spheres.size(); ++i) {
-        root->objectIndices.push_back(i); 
+    root->objectIndices = indexArena.allocate(spheres.size());
+    for (int i = 0; i < static_cast<int>(spheres.size()); ++i) {
+        root->objectIndices[i] = i; 
     }
     root->objectCount = spheres.size();
 
@@ -77,35 +110,75 @@ void Octree::build(const std::vector<Sphere>& spheres, const int debug) {
         cout << "Root Node Object Count: " << root->objectCount << std::endl; // DEBUG: Object Count: 3
     }
 
-    subdivideNode(root, spheres, 0, debug);
+    atomic<int> activeTasks(0);
+    subdivideNode(root, spheres, 0, activeTasks, debug);
 
     const auto finish{std::chrono::steady_clock::now()};
+    const std::chrono::duration<double> bounds_seconds{boundsEnd - start};
+    const std::chrono::duration<double> subdivide_seconds{finish - boundsEnd};
     const std::chrono::duration<double> elapsed_seconds{finish - start};
-    cout << "Total build time: " << elapsed_seconds.count() << "s" << std::endl;
+    boundsTime = bounds_seconds.count();
+    subdivideTime = subdivide_seconds.count();
     buildTime = elapsed_seconds.count();
+    cout << "Total build time: " << buildTime << "s (bounds: " << boundsTime << "s, subdivision: " << subdivideTime << "s, " << numThreads << " threads)" << std::endl;
 
     const auto start2{std::chrono::steady_clock::now()};
 
     setGPUData();
+    if (tightBounds) tightenBounds(spheres);
+    if (layout != BFSLayout) reorderNodes();
+    indexBits = objectIndexBits(spheres.size());
+    packObjectIndices(0, objectIndices.size());
 
     const auto finish2{std::chrono::steady_clock::now()};
     const std::chrono::duration<double> elapsed_seconds2{finish2 - start2};
-    cout << "Total GPU conversion time: " << elapsed_seconds2.count() << "s" << std::endl;
+    gpuConversionTime = elapsed_seconds2.count();
+    cout << "Total GPU conversion time: " << gpuConversionTime << "s" << std::endl;
+    duplicationFactor = double(objectIndices.size()) / spheres.size();
+    cout << "References per sphere: " << duplicationFactor << (isLoose() ? " (loose)" : "") << std::endl;
+    cout << "Object indices: " << indexBits << " bit, " << gpuObjectIndices.size() * sizeof(uint32_t) << " bytes" << std::endl;
+    computeCostStats();
+    builtCost = predictedCost;
+    builtDuplication = duplicationFactor;
+}
+
+void Octree::computeBounds(const vector<Sphere>& spheres, glm::vec3& min, glm::vec3& max) {
+    // Each chunk reduces its own range, min/max are exact so the merge order does not matter
+    std::vector<glm::vec3> chunkMin(numThreads), chunkMax(numThreads);
+    int numChunks = parallelFor(spheres.size(), numThreads, [&](int chunk, size_t begin, size_t end) {
+        glm::vec3 localMin = spheres[begin].center - glm::vec3(spheres[begin].radius);
+        glm::vec3 localMax = spheres[begin].center + glm::vec3(spheres[begin].radius);
+
+        for (size_t i = begin; i < end; ++i) {
+            const Sphere& sphere = spheres[i];
+            glm::vec3 sphereMin = sphere.center - glm::vec3(sphere.radius, sphere.radius, sphere.radius);
+            glm::vec3 sphereMax = sphere.center + glm::vec3(sphere.radius, sphere.radius, sphere.radius);
 
+            localMin = glm::min(localMin, sphereMin);
+            localMax = glm::max(localMax, sphereMax);
+        }
+        chunkMin[chunk] = localMin;
+        chunkMax[chunk] = localMax;
+    });
+
+    min = chunkMin[0];
+    max = chunkMax[0];
+    for (int chunk = 1; chunk < numChunks; ++chunk) {
+        min = glm::min(min, chunkMin[chunk]);
+        max = glm::max(max, chunkMax[chunk]);
+    }
 }
 
-OctreeNode* createSubnodes(int index, OctreeNode* node, const glm::vec3& mid) {
-    glm::vec3 childMin, childMax;
-        
+void octantBounds(int index, const glm::vec3& min, const glm::vec3& max, const glm::vec3& mid, glm::vec3& childMin, glm::vec3& childMax) {
     switch (index){
         case TopLeftFront: { // example: (-1, 0, 0) to (0, 1, 1) 
-            childMin.x = node->min.x;
+            childMin.x = min.x;
             childMin.y = mid.y;
             childMin.z = mid.z;
             
             childMax.x = mid.x;
-            childMax.y = node->max.y;
-            childMax.z = node->max.z;
+            childMax.y = max.y;
+            childMax.z = max.z;
             break;
         }
         case TopRightFront: { // example: (0, 0, 0) to (1, 1, 1)
@@ -113,65 +186,65 @@ OctreeNode* createSubnodes(int index, OctreeNode* node, const glm::vec3& mid) {
             childMin.y = mid.y;
             childMin.z = mid.z;
             
-            childMax.x = node->max.x;
-            childMax.y = node->max.y;
-            childMax.z = node->max.z;
+            childMax.x = max.x;
+            childMax.y = max.y;
+            childMax.z = max.z;
             break;
         }
         case BottomRightFront: { // example: (0, 0, -1) to (1, 1, 0)
             childMin.x = mid.x;
             childMin.y = mid.y;
-            childMin.z = node->min.z;
+            childMin.z = min.z;
 
-            childMax.x = node->max.x;
-            childMax.y = node->max.y;
+            childMax.x = max.x;
+            childMax.y = max.y;
             childMax.z = mid.z;
             break;
         }
         case BottomLeftFront: { // example: (-1, 0, -1) to (0, 1, 0)
-            childMin.x = node->min.x;
+            childMin.x = min.x;
             childMin.y = mid.y;
-            childMin.z = node->min.z;
+            childMin.z = min.z;
 
             childMax.x = mid.x;
-            childMax.y = node->max.y;
+            childMax.y = max.y;
             childMax.z = mid.z;
             break;
         }
         case TopLeftBack: { // example: (-1, -1, 0) to (0, 0, 1)
-            childMin.x = node->min.x;
-            childMin.y = node->min.y;
+            childMin.x = min.x;
+            childMin.y = min.y;
             childMin.z = mid.z;
 
             childMax.x = mid.x;
             childMax.y = mid.y;
-            childMax.z = node->max.z;
+            childMax.z = max.z;
             break;
         }
         case TopRightBack: { // example: (0, -1, 0) to (1, 0, 1)
             childMin.x = mid.x;
-            childMin.y = node->min.y;
+            childMin.y = min.y;
             childMin.z = mid.z;
 
-            childMax.x = node->max.x;
+            childMax.x = max.x;
             childMax.y = mid.y;
-            childMax.z = node->max.z;
+            childMax.z = max.z;
             break;
         }
         case BottomRightBack: { // example: (0, -1, -1) to (1, 0, 0)
             childMin.x = mid.x;
-            childMin.y = node->min.y;
-            childMin.z = node->min.z;
+            childMin.y = min.y;
+            childMin.z = min.z;
 
-            childMax.x = node->max.x;
+            childMax.x = max.x;
             childMax.y = mid.y;
             childMax.z = mid.z;
             break;
         }
         case BottomLeftBack: { // example: (-1, -1, -1) to (0, 0, 0)
-            childMin.x = node->min.x;
-            childMin.y = node->min.y;
-            childMin.z = node->min.z;
+            childMin.x = min.x;
+            childMin.y = min.y;
+            childMin.z = min.z;
 
             childMax.x = mid.x;
             childMax.y = mid.y;
@@ -182,50 +255,458 @@ OctreeNode* createSubnodes(int index, OctreeNode* node, const glm::vec3& mid) {
             throw std::invalid_argument("Invalid octant index while subdividing node with index = " + std::to_string(index));
             break;
     }
+}
 
-    return new OctreeNode(childMin, childMax);
+OctreeNode createSubnodes(int index, OctreeNode* node, const glm::vec3& mid) {
+    glm::vec3 childMin, childMax;
+    octantBounds(index, node->min, node->max, mid, childMin, childMax);
+    return OctreeNode(childMin, childMax);
 }
 
-void Octree::subdivideNode(OctreeNode* node, const std::vector<Sphere>& spheres, int depth, const int debug) {
+void Octree::subdivideNode(OctreeNode* node, const std::vector<Sphere>& spheres, int depth, atomic<int>& activeTasks, const int debug) {
     // Stop if we're at max depth
-    if (depth >= maxDepth || node->objectIndices.size() <= static_cast<size_t>(maxSpheresPerNode)) {
-        if (debug) std::cout << "Stopping subdivision at depth " << depth << " with " << node->objectIndices.size() << " objects." << std::endl;
+    if (depth >= maxDepth || node->objectCount <= (autoTune ? 1 : maxSpheresPerNode)) {
+        if (debug) std::cout << "Stopping subdivision at depth " << depth << " with " << node->objectCount << " objects." << std::endl;
         return;
     }
 
+    int* indices = node->objectIndices;
+    int count = node->objectCount;
+    if (isLoose()) {
+        distributeLooseSpheres(node, spheres, debug);
+        if (node->isLeaf) return; // no sphere fits in a child
+    } else {
+        distributeSpheres(node, spheres, debug);
+    }
 
-    glm::vec3 mid = (node->min + node->max) * 0.5f;
+    // Undo the split if the node is cheaper as a leaf. The children's lists stay unused in the arena until the next build
+    if (autoTune && !splitPays(node, count)) {
+        if (debug) std::cout << "Split does not pay off at depth " << depth << " with " << count << " objects." << std::endl;
+        for (int i = 0; i < 8; ++i) {
+            node->children[i] = nullptr;
+        }
+        node->isLeaf = true;
+        node->split = (node->min + node->max) * 0.5f;
+        node->objectIndices = indices;
+        node->objectCount = count;
+        return;
+    }
+
+    // Subtrees are independent, so big ones go to other threads while there are threads to spare
+    std::vector<std::future<void>> tasks;
+    for (int i = 0; i < 8; ++i) {
+        OctreeNode* child = node->children[i];
+        if (!child) continue;
+
+        bool spawn = false;
+        if (!debug && static_cast<size_t>(child->objectCount) >= PARALLEL_BUILD_GRAIN) {
+            spawn = activeTasks.fetch_add(1) < numThreads - 1;
+            if (!spawn) activeTasks--;
+        }
+
+        if (spawn) {
+            tasks.push_back(std::async(std::launch::async, [this, child, &spheres, depth, &activeTasks]() {
+                subdivideNode(child, spheres, depth + 1, activeTasks);
+                activeTasks--;
+            }));
+        } else {
+            subdivideNode(child, spheres, depth + 1, activeTasks, debug);
+        }
+    }
+
+    for (std::future<void>& task : tasks) {
+        task.get();
+    }
+}
+
+void Octree::distributeSpheres(OctreeNode* node, const std::vector<Sphere>& spheres, const int debug) {
+    if (buildMode == SAHBuild) node->split = sahSplit(node, spheres);
+    glm::vec3 mid = node->split;
     if (debug) std::cout << "Midpoint: " << mid.x << ", " << mid.y << ", " << mid.z << std::endl;
     
 
     node->isLeaf = false;
+    OctreeNode* children = nodeArena.allocate(8);
     for (int i = 0; i < 8; ++i) {
-        node->children[i] = createSubnodes(i, node, mid);
+        node->children[i] = new (&children[i]) OctreeNode(createSubnodes(i, node, mid));
     }
     
-    // Distribute spheres to child nodes
-    for (int sphereIdx : node->objectIndices) {
-        const Sphere& sphere = spheres[sphereIdx];
-        
+    // First pass: which children each sphere intersects, as a bit mask, and how many spheres each child gets.
+    // The scratch buffer is per thread and keeps its capacity, so it stops allocating after the first build
+    static thread_local std::vector<unsigned char> scratchMasks;
+    scratchMasks.resize(node->objectCount);
+    std::vector<unsigned char>& childMasks = scratchMasks; // the chunks run on other threads, they must see this thread's buffer
+
+    auto classify = [&](size_t begin, size_t end, int* counts) {
+        for (size_t j = begin; j < end; ++j) {
+            const Sphere& sphere = spheres[node->objectIndices[j]];
+
+            unsigned char mask = 0;
+            for (int i = 0; i < 8; ++i) {
+                if (sphereIntersectsBox(sphere, children[i].min, children[i].max)) {
+                    if (debug) cout << "Sphere " << node->objectIndices[j] << " intersects child node " << i << std::endl;
+                    mask |= 1 << i;
+                    counts[i]++;
+                }
+            }
+            childMasks[j] = mask;
+        }
+    };
+
+    // Second pass: scatter the indices into exact sized lists
+    auto scatter = [&](size_t begin, size_t end, int* offsets) {
+        for (size_t j = begin; j < end; ++j) {
+            // visit only the set bits, most spheres go to a single child
+            for (unsigned int mask = childMasks[j]; mask; mask &= mask - 1) {
+                int i = __builtin_ctz(mask);
+                children[i].objectIndices[offsets[i]++] = node->objectIndices[j];
+            }
+        }
+    };
+
+    if (debug || static_cast<size_t>(node->objectCount) < 2 * PARALLEL_BUILD_GRAIN) {
+        int counts[8] = {0};
+        classify(0, node->objectCount, counts);
+        for (int i = 0; i < 8; ++i) {
+            children[i].objectIndices = indexArena.allocate(counts[i]);
+            children[i].objectCount = counts[i];
+            counts[i] = 0;
+        }
+        scatter(0, node->objectCount, counts);
+    } else {
+        std::vector<int> chunkCounts(numThreads * 8, 0);
+        int numChunks = parallelFor(node->objectCount, numThreads, [&](int chunk, size_t begin, size_t end) {
+            classify(begin, end, &chunkCounts[chunk * 8]);
+        });
+
+        // every chunk writes at its own offset so the order is the same as a serial pass
+        std::vector<int> chunkOffsets(numChunks * 8);
         for (int i = 0; i < 8; ++i) {
-            if (sphereIntersectsBox(sphere, node->children[i]->min, node->children[i]->max)) {
-                if (debug) cout << "Sphere " << sphereIdx << " intersects child node " << i << std::endl;
-                node->children[i]->objectIndices.push_back(sphereIdx);
-                node->children[i]->objectCount++;
+            int total = 0;
+            for (int chunk = 0; chunk < numChunks; ++chunk) {
+                chunkOffsets[chunk * 8 + i] = total;
+                total += chunkCounts[chunk * 8 + i];
             }
+            children[i].objectIndices = indexArena.allocate(total);
+            children[i].objectCount = total;
         }
+
+        // same chunk count, so the same chunk boundaries as the first pass
+        parallelFor(node->objectCount, numChunks, [&](int chunk, size_t begin, size_t end) {
+            scatter(begin, end, &chunkOffsets[chunk * 8]);
+        });
     }
     
-    // clear parent's indices to save space
-    node->objectIndices.clear();
+    // empty octants get no child at all, they are left out of the flattened tree
+    for (int i = 0; i < 8; ++i) {
+        if (children[i].objectCount == 0) node->children[i] = nullptr;
+    }
+
+    // the parent's indices stay in the arena until the next build, the node just stops referencing them
+    node->objectIndices = nullptr;
     node->objectCount = 0;
-    
+}
 
+// Candidate planes of SAHBuild are the inner edges of this many bins per axis, the middle edge is the midpoint
+static const int SAH_BINS = 16;
+
+/**
+ * Split point for SAHBuild, chosen on each axis separately: the bin edge with the lowest
+ * area(below) * spheres(below) + area(above) * spheres(above), a sphere crossing the plane counting on both sides.
+ * Spheres are binned by their bounding boxes, so each axis is a single pass over the node's spheres.
+ */
+glm::vec3 Octree::sahSplit(const OctreeNode* node, const vector<Sphere>& spheres) const {
+    const glm::vec3 size = node->max - node->min;
+    const int histogramSize = 3 * 2 * SAH_BINS; // [axis][lower/upper extent][bin]
+
+    std::vector<int> chunkHistograms(size_t(numThreads) * histogramSize, 0);
+    int numChunks = parallelFor(node->objectCount, numThreads, [&](int chunk, size_t begin, size_t end) {
+        int* histogram = &chunkHistograms[size_t(chunk) * histogramSize];
+        for (size_t j = begin; j < end; ++j) {
+            const Sphere& sphere = spheres[node->objectIndices[j]];
+            for (int axis = 0; axis < 3; ++axis) {
+                if (!(size[axis] > 0.0f)) continue;
+                float scale = SAH_BINS / size[axis];
+                int lower = static_cast<int>((sphere.center[axis] - sphere.radius - node->min[axis]) * scale);
+                int upper = static_cast<int>((sphere.center[axis] + sphere.radius - node->min[axis]) * scale);
+                histogram[(axis * 2) * SAH_BINS + std::min(std::max(lower, 0), SAH_BINS - 1)]++;
+                histogram[(axis * 2 + 1) * SAH_BINS + std::min(std::max(upper, 0), SAH_BINS - 1)]++;
+            }
+        }
+    });
+    for (int chunk = 1; chunk < numChunks; ++chunk) {
+        for (int k = 0; k < histogramSize; ++k) {
+            chunkHistograms[k] += chunkHistograms[size_t(chunk) * histogramSize + k];
+        }
+    }
+
+    glm::vec3 split = node->split;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (!(size[axis] > 0.0f)) continue;
+        const int* lowers = &chunkHistograms[(axis * 2) * SAH_BINS];
+        const int* uppers = &chunkHistograms[(axis * 2 + 1) * SAH_BINS];
+        float side1 = size[(axis + 1) % 3], side2 = size[(axis + 2) % 3];
+        auto area = [&](float length) { return 2.0f * (length * side1 + length * side2 + side1 * side2); };
+
+        // spheres starting below edge k, and ending above it
+        int below[SAH_BINS + 1] = {0}, above[SAH_BINS + 1] = {0};
+        for (int k = 1; k <= SAH_BINS; ++k) below[k] = below[k - 1] + lowers[k - 1];
+        for (int k = SAH_BINS - 1; k >= 0; --k) above[k] = above[k + 1] + uppers[k];
+
+        // the midpoint goes first, so it is kept unless another plane is strictly better
+        int best = SAH_BINS / 2;
+        auto cost = [&](int k) {
+            float length = size[axis] * k / SAH_BINS;
+            return area(length) * below[k] + area(size[axis] - length) * above[k];
+        };
+        float bestCost = cost(best);
+        for (int k = 1; k < SAH_BINS; ++k) {
+            float c = cost(k);
+            if (c < bestCost) {
+                bestCost = c;
+                best = k;
+            }
+        }
+        if (best != SAH_BINS / 2) split[axis] = node->min[axis] + size[axis] * best / SAH_BINS;
+    }
+    return split;
+}
+
+/**
+ * Loose version: a sphere goes down to the child holding its center, but only if it fits in that child's loose box.
+ * The others stay in this node, so every sphere is stored exactly once.
+ */
+void Octree::distributeLooseSpheres(OctreeNode* node, const std::vector<Sphere>& spheres, const int debug) {
+    glm::vec3 mid = (node->min + node->max) * 0.5f;
+    glm::vec3 childSize = (node->max - node->min) * 0.5f;
+    // A sphere centered in a child cell is inside the child's loose box if its radius is at most this
+    float fitRadius = std::min(childSize.x, std::min(childSize.y, childSize.z)) * (LOOSE_OCTREE_FACTOR - 1.0f) * 0.5f;
+
+    static thread_local std::vector<unsigned char> scratchOctants;
+    scratchOctants.resize(node->objectCount);
+    std::vector<unsigned char>& octants = scratchOctants;
+
+    int counts[9] = {0}; // 8 = stays in this node
+    for (int j = 0; j < node->objectCount; ++j) {
+        const Sphere& sphere = spheres[node->objectIndices[j]];
+        int octant = 8;
+        if (sphere.radius <= fitRadius) {
+            octant = (sphere.center.z >= mid.z) << 2 | (sphere.center.x >= mid.x) << 1 | (sphere.center.y >= mid.y);
+        }
+        octants[j] = octant;
+        counts[octant]++;
+    }
+    if (debug) std::cout << counts[8] << " of " << node->objectCount << " spheres stay in the node" << std::endl;
+    if (counts[8] == node->objectCount) return;
+
+    node->isLeaf = false;
+    OctreeNode* children = nodeArena.allocate(8);
+    for (int i = 0; i < 8; ++i) {
+        node->children[i] = new (&children[i]) OctreeNode(createSubnodes(i, node, mid));
+        children[i].objectIndices = indexArena.allocate(counts[i]);
+        children[i].objectCount = counts[i];
+        if (counts[i] == 0) node->children[i] = nullptr;
+    }
+
+    int* kept = indexArena.allocate(counts[8]);
+    int offsets[9] = {0};
+    for (int j = 0; j < node->objectCount; ++j) {
+        int octant = octants[j];
+        int* target = octant == 8 ? kept : children[octant].objectIndices;
+        target[offsets[octant]++] = node->objectIndices[j];
+    }
+    node->objectIndices = kept;
+    node->objectCount = counts[8];
+}
+
+static float boxArea(const glm::vec3& min, const glm::vec3& max) {
+    glm::vec3 size = max - min;
+    return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+/**
+ * Greedy surface area cost test for autoTune, made right after a node has been split: a ray through the node hits a child
+ * with probability area(child) / area(node), so the split costs a box test per child plus the expected sphere tests of the
+ * children as leaves (and of the spheres a loose node keeps). It pays off if that is less than testing all objectCount spheres.
+ */
+bool Octree::splitPays(const OctreeNode* node, int objectCount) const {
+    float nodeArea = boxArea(node->min, node->max);
+    if (!(nodeArea > 0.0f)) return false;
+
+    float leafCost = SPHERE_TEST_COST * objectCount;
+    float splitCost = SPHERE_TEST_COST * node->objectCount;
     for (int i = 0; i < 8; ++i) {
-        if (!node->children[i]->objectIndices.empty()) {
-            subdivideNode(node->children[i], spheres, depth + 1, debug);
+        const OctreeNode* child = node->children[i];
+        if (!child) continue;
+        splitCost += BOX_TEST_COST + boxArea(child->min, child->max) / nodeArea * SPHERE_TEST_COST * child->objectCount;
+    }
+    return splitCost < leafCost;
+}
+
+// Cost of the subtree of node from the nodeCosts of its children, see computeCostStats
+double Octree::nodeCost(int index) const {
+    const GPUOctreeNode& node = flattenedTree[index];
+    double cost = SPHERE_TEST_COST * node.objectCount;
+    double nodeArea = boxArea(node.min, node.max);
+    for (int octant = 0; octant < 8; ++octant) {
+        if (!(node.childMask & (1u << octant))) continue;
+        int child = childIndex(node.childrenOffset, node.childMask, octant);
+        double hitChance = nodeArea > 0.0 ? boxArea(flattenedTree[child].min, flattenedTree[child].max) / nodeArea : 1.0;
+        cost += BOX_TEST_COST + std::min(hitChance, 1.0) * nodeCosts[child];
+    }
+    return cost;
+}
+
+/**
+ * Applies the same cost model to the whole flattened tree, bottom-up (children before their parent, see topDownOrder):
+ * cost(node) = its sphere tests + for each child, a box test + area(child) / area(node) * cost(child).
+ * predictedCost is the cost of a ray through the root box, so trees built with different limits can be compared without rendering.
+ * Only printed if report. The costs and parents of the nodes are kept for refitOrRebuild, which only redoes the nodes updates write.
+ */
+void Octree::computeCostStats(bool report) {
+    const size_t nodeCount = flattenedTree.size();
+    const std::vector<int> order = topDownOrder();
+    nodeCosts.assign(nodeCount, 0.0);
+    for (size_t i = order.size(); i-- > 0;) {
+        nodeCosts[order[i]] = nodeCost(order[i]);
+    }
+    predictedCost = nodeCount > 0 ? BOX_TEST_COST + nodeCosts[0] : 0.0;
+    staleNodes.clear();
+
+    std::vector<int> depths = nodeDepths();
+    nodeParents.assign(nodeCount, -1);
+    referenceCount = 0;
+    treeDepth = 0;
+    leafCount = 0;
+    maxLeafSize = 0;
+    size_t leafObjects = 0;
+    for (int i : order) {
+        const GPUOctreeNode& node = flattenedTree[i];
+        for (int j = 0; j < __builtin_popcount(node.childMask); ++j) nodeParents[node.childrenOffset + j] = i;
+        referenceCount += node.objectCount;
+        treeDepth = std::max(treeDepth, depths[i]);
+        if (node.childMask == 0) {
+            leafCount++;
+            leafObjects += node.objectCount;
+            maxLeafSize = std::max(maxLeafSize, node.objectCount);
         }
     }
+    averageLeafSize = leafCount > 0 ? double(leafObjects) / leafCount : 0.0;
+
+    if (!report) return;
+    cout << "Predicted cost per ray: " << predictedCost << " (" << (autoTune ? "auto-tuned, " : "") << "depth " << treeDepth
+         << ", " << leafCount << " leaves, " << averageLeafSize << " spheres per leaf on average, " << maxLeafSize << " at most)" << std::endl;
+}
+
+/**
+ * Nodes reachable from the root, each after its parent. Right after a build or a layout change that is every node in index
+ * order, but incremental updates append the blocks they move (a parent can then come after its children) and leave the
+ * released nodes behind.
+ */
+std::vector<int> Octree::topDownOrder() const {
+    std::vector<int> order;
+    if (flattenedTree.empty()) return order;
+    order.reserve(flattenedTree.size());
+    order.push_back(0);
+    for (size_t i = 0; i < order.size(); ++i) {
+        const GPUOctreeNode& node = flattenedTree[order[i]];
+        for (int j = 0; j < __builtin_popcount(node.childMask); ++j) order.push_back(node.childrenOffset + j);
+    }
+    return order;
+}
+
+// Depth of every node of the flattened tree, the root is 0 and nodes released by updates are -1
+std::vector<int> Octree::nodeDepths() const {
+    std::vector<int> depths(flattenedTree.size(), -1);
+    if (!flattenedTree.empty()) depths[0] = 0;
+    for (int i : topDownOrder()) {
+        const GPUOctreeNode& node = flattenedTree[i];
+        for (int j = 0; j < __builtin_popcount(node.childMask); ++j) depths[node.childrenOffset + j] = depths[i] + 1;
+    }
+    return depths;
+}
+
+OctreeStats Octree::getStats() const {
+    OctreeStats stats;
+    std::vector<int> depths = nodeDepths();
+
+    // treeDepth is only set by a build, the inserts since may have gone deeper
+    const int deepest = depths.empty() ? 0 : *std::max_element(depths.begin(), depths.end());
+
+    stats.nodeCount = static_cast<int>(flattenedTree.size());
+    stats.nodesPerDepth.assign(deepest + 1, 0);
+    stats.leavesPerDepth.assign(deepest + 1, 0);
+    for (size_t i = 0; i < flattenedTree.size(); ++i) {
+        const GPUOctreeNode& node = flattenedTree[i];
+        if (depths[i] < 0) continue; // released by an update
+        stats.nodesPerDepth[depths[i]]++;
+        if (node.childMask != 0) continue;
+
+        stats.leafCount++;
+        stats.leavesPerDepth[depths[i]]++;
+        if (node.objectCount == 0) stats.emptyLeafCount++;
+
+        // bucket 0 is empty leaves, bucket b holds [2^(b-1), 2^b) spheres
+        size_t bucket = 0;
+        while ((1 << bucket) <= node.objectCount) bucket++;
+        if (stats.leafOccupancy.size() <= bucket) stats.leafOccupancy.resize(bucket + 1, 0);
+        stats.leafOccupancy[bucket]++;
+    }
+    stats.emptyLeafRatio = stats.leafCount > 0 ? double(stats.emptyLeafCount) / stats.leafCount : 0.0;
+    stats.duplicationFactor = duplicationFactor;
+    stats.expectedCost = predictedCost;
+
+    stats.flattenedTreeBytes = flattenedTree.size() * sizeof(GPUOctreeNode);
+    stats.objectIndicesBytes = gpuObjectIndices.size() * sizeof(uint32_t);
+    stats.indexBits = indexBits;
+    stats.minAndChildrenBytes = gpuMinAndChildren.size() * sizeof(GPUNodeCorner);
+    stats.maxAndObjectsBytes = gpuMaxAndObjects.size() * sizeof(GPUNodeCorner);
+    stats.objectCountsBytes = gpuObjectCounts.size() * sizeof(unsigned int);
+    stats.splitsBytes = gpuSplits.size() * sizeof(glm::vec4);
+    stats.compactTreeBytes = compactTree.size() * sizeof(GPUCompactNode);
+    stats.ropeTreeBytes = ropeTree.size() * sizeof(GPURopeNode);
+    return stats;
+}
+
+/**
+ * Appends getStats() and the build settings to filename as one JSON object per line, a record per build,
+ * so runs can be compared (and regressions caught) before rendering anything.
+ */
+bool Octree::saveStats(const std::string& filename) const {
+    std::ofstream outFile(filename, std::ios::out | std::ios::app);
+    if (!outFile || !outFile.is_open()) {
+        std::cerr << "Error opening file for writing: " << filename << std::endl;
+        return false;
+    }
+
+    auto writeArray = [&outFile](const std::vector<int>& values) {
+        outFile << "[";
+        for (size_t i = 0; i < values.size(); ++i) {
+            outFile << (i > 0 ? "," : "") << values[i];
+        }
+        outFile << "]";
+    };
+
+    const OctreeStats stats = getStats();
+    outFile << "{\"buildMode\":" << buildMode << ",\"maxDepth\":" << maxDepth << ",\"maxSpheresPerNode\":" << maxSpheresPerNode
+            << ",\"tightBounds\":" << tightBounds << ",\"autoTune\":" << autoTune << ",\"layout\":" << layout << ",\"threads\":" << numThreads
+            << ",\"buildTime\":" << buildTime << ",\"gpuConversionTime\":" << gpuConversionTime
+            << ",\"nodeCount\":" << stats.nodeCount << ",\"leafCount\":" << stats.leafCount
+            << ",\"emptyLeafCount\":" << stats.emptyLeafCount << ",\"emptyLeafRatio\":" << stats.emptyLeafRatio
+            << ",\"nodesPerDepth\":";
+    writeArray(stats.nodesPerDepth);
+    outFile << ",\"leavesPerDepth\":";
+    writeArray(stats.leavesPerDepth);
+    outFile << ",\"leafOccupancy\":";
+    writeArray(stats.leafOccupancy);
+    outFile << ",\"duplicationFactor\":" << stats.duplicationFactor << ",\"expectedCost\":" << stats.expectedCost
+            << ",\"indexBits\":" << stats.indexBits
+            << ",\"bytes\":{\"flattenedTree\":" << stats.flattenedTreeBytes << ",\"objectIndices\":" << stats.objectIndicesBytes
+            << ",\"minAndChildren\":" << stats.minAndChildrenBytes << ",\"maxAndObjects\":" << stats.maxAndObjectsBytes
+            << ",\"objectCounts\":" << stats.objectCountsBytes << ",\"splits\":" << stats.splitsBytes
+            << ",\"compactTree\":" << stats.compactTreeBytes << ",\"ropeTree\":" << stats.ropeTreeBytes << "}}" << std::endl;
+
+    return true;
 }
 
 bool Octree::sphereIntersectsBox(const Sphere& sphere, const glm::vec3& boxMin, const glm::vec3& boxMax) {
@@ -249,6 +730,7 @@ void Octree::printFlattenedTree() {
         std::cout << "Node Min: " << node.min.x << ", " << node.min.y << ", " << node.min.z << std::endl;
         std::cout << "Node Max: " << node.max.x << ", " << node.max.y << ", " << node.max.z << std::endl;
         std::cout << "Children Offset: " << node.childrenOffset << std::endl;
+        std::cout << "Child Mask: " << node.childMask << std::endl;
         std::cout << "Objects Offset: " << node.objectsOffset << std::endl;
         std::cout << "Object Count: " << node.objectCount << std::endl;
         if (node.objectCount > 0) {
@@ -263,50 +745,266 @@ void Octree::printFlattenedTree() {
     }
 }
 /**
- * BFS type shit
+ * BFS in a single pass: the node list is also the queue, so a node's position in it is its index in the flattened tree.
+ * Children get their indices as soon as their parent is visited, and every node is written straight into the upload buffers.
  */
 void Octree::setGPUData() {
-    std::queue<OctreeNode*> nodeQueue;
-    nodeQueue.push(root);
+    objectIndices.clear();
+    resizeGPUData(0);
 
-    int currentOffset = 0;
-    std::vector<OctreeNode*> allNodes;
-    std::map<OctreeNode*, int> nodeToIndex;
-
-    while (!nodeQueue.empty()) {
-        OctreeNode* node = nodeQueue.front();
-        nodeQueue.pop();
-
-        allNodes.push_back(node);
-        nodeToIndex[node] = currentOffset;
-        currentOffset++;
+    std::vector<OctreeNode*> nodes = {root};
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        OctreeNode* node = nodes[i];
+        unsigned int childMask = 0;
 
         if (!node->isLeaf) {
-            for (int i = 0; i < 8; ++i) {
-                if (!node->children[i]) throw std::invalid_argument("Child node is null on non-leaf node");
-                nodeQueue.push(node->children[i]);
+            node->childrenOffset = toOffset(nodes.size(), "Node");
+            for (int j = 0; j < 8; ++j) {
+                if (!node->children[j]) continue;
+                childMask |= 1u << j;
+                nodes.push_back(node->children[j]);
             }
         }
-    }
-
-    int currentObjectIndex = 0;
-    flattenedTree.reserve(allNodes.size());
-    for (OctreeNode* node : allNodes) {
-        if (!node->isLeaf) {
-            node->childrenOffset = nodeToIndex[node->children[0]];
-        } else if (node->isLeaf && node->objectCount > 0) {
-            objectIndices.insert(objectIndices.end(), node->objectIndices.begin(), node->objectIndices.end());
-            node->objectsOffset = currentObjectIndex;
-            currentObjectIndex += node->objectCount;
+        if (node->objectCount > 0) {
+            node->objectsOffset = toOffset(objectIndices.size(), "Object index");
+            objectIndices.insert(objectIndices.end(), node->objectIndices, node->objectIndices + node->objectCount);
         }
 
+        if (i >= flattenedTree.size()) resizeGPUData(nodes.size());
+
         GPUOctreeNode gpuNode;
         gpuNode.min = node->min;
         gpuNode.max = node->max;
+        if (isLoose() && i > 0) { // the root cell already holds every sphere
+            glm::vec3 margin = (node->max - node->min) * ((LOOSE_OCTREE_FACTOR - 1.0f) * 0.5f);
+            gpuNode.min -= margin;
+            gpuNode.max += margin;
+        }
+        gpuNode.split = node->split;
         gpuNode.childrenOffset = node->childrenOffset;
         gpuNode.objectsOffset = node->objectsOffset;
         gpuNode.objectCount = node->objectCount;
+        gpuNode.childMask = childMask;
+        setGPUNode(i, gpuNode);
+    }
+}
+
+/**
+ * Bottom-up over the flattened tree (children always come after their parent): a node gets the bounds of its spheres
+ * and of its children, clipped to its own box so siblings never overlap more than they did.
+ */
+void Octree::tightenBounds(const vector<Sphere>& spheres) {
+    double reduction = 0.0;
+    int measured = 0;
+
+    for (size_t i = flattenedTree.size(); i-- > 0;) {
+        GPUOctreeNode node = flattenedTree[i];
+        glm::vec3 tightMin(std::numeric_limits<float>::max());
+        glm::vec3 tightMax(-std::numeric_limits<float>::max());
+
+        for (int j = 0; j < node.objectCount; ++j) {
+            const Sphere& sphere = spheres[objectIndices[node.objectsOffset + j]];
+            tightMin = glm::min(tightMin, sphere.center - glm::vec3(sphere.radius));
+            tightMax = glm::max(tightMax, sphere.center + glm::vec3(sphere.radius));
+        }
+        if (node.childrenOffset != -1) {
+            for (int j = 0; j < __builtin_popcount(node.childMask); ++j) {
+                const GPUOctreeNode& child = flattenedTree[node.childrenOffset + j];
+                tightMin = glm::min(tightMin, child.min);
+                tightMax = glm::max(tightMax, child.max);
+            }
+        }
+        if (tightMin.x > tightMax.x) continue; // nothing inside, keep the octant box
+
+        tightMin = glm::max(tightMin, node.min);
+        tightMax = glm::max(glm::min(tightMax, node.max), tightMin); // a sphere may only touch the box
+
+        glm::vec3 octantSize = node.max - node.min;
+        glm::vec3 tightSize = tightMax - tightMin;
+        double octantVolume = double(octantSize.x) * octantSize.y * octantSize.z;
+        if (octantVolume > 0.0) {
+            reduction += 1.0 - double(tightSize.x) * tightSize.y * tightSize.z / octantVolume;
+            measured++;
+        }
 
-        flattenedTree.push_back(gpuNode);
+        node.min = tightMin;
+        node.max = tightMax;
+        setGPUNode(i, node);
     }
-}
\ No newline at end of file
+
+    tightBoundsReduction = measured ? reduction / measured : 0.0;
+    cout << "Tight bounds: average node volume reduced by " << tightBoundsReduction * 100.0 << "% over " << measured << " nodes" << std::endl;
+}
+
+void Octree::resizeGPUData(size_t nodeCount) {
+    flattenedTree.resize(nodeCount);
+    gpuMinAndChildren.resize(nodeCount);
+    gpuMaxAndObjects.resize(nodeCount);
+    gpuObjectCounts.resize(nodeCount);
+    gpuSplits.resize(nodeCount);
+}
+
+void Octree::setGPUNode(size_t index, const GPUOctreeNode& node) {
+    flattenedTree[index] = node;
+    gpuMinAndChildren[index] = {node.min, node.childrenOffset};
+    gpuMaxAndObjects[index] = {node.max, node.objectsOffset};
+    if (node.objectCount > 0xFFFFFF) {
+        throw std::overflow_error("Leaf with " + std::to_string(node.objectCount) + " objects does not fit in the 24 bit count of the node buffers");
+    }
+    gpuObjectCounts[index] = static_cast<unsigned int>(node.objectCount) | node.childMask << 24;
+    gpuSplits[index] = glm::vec4(node.split, 0.0f);
+}
+
+// Pack objectIndices[begin, end) into gpuObjectIndices, which follows the size of objectIndices
+void Octree::packObjectIndices(size_t begin, size_t end) {
+    gpuObjectIndices.resize(packedIndexWords(objectIndices.size(), indexBits), 0);
+    if (indexBits == 32) {
+        std::copy(objectIndices.begin() + begin, objectIndices.begin() + end, gpuObjectIndices.begin() + begin);
+        return;
+    }
+    // whole words, the other half of the first and last one may be outside the range
+    for (size_t word = begin / 2; word < (end + 1) / 2; ++word) {
+        uint32_t low = static_cast<uint32_t>(objectIndices[2 * word]) & 0xFFFFu;
+        uint32_t high = 2 * word + 1 < objectIndices.size() ? static_cast<uint32_t>(objectIndices[2 * word + 1]) & 0xFFFFu : 0u;
+        gpuObjectIndices[word] = low | high << 16;
+    }
+}
+
+// Record a change of objectIndices[begin, end): packed again and marked dirty
+void Octree::writeIndices(size_t begin, size_t end) {
+    packObjectIndices(begin, end);
+    markDirty(dirtyIndices, begin, end);
+}
+
+/**
+ * Takes the upload buffers of a tree built earlier (see SceneCache) instead of building one,
+ * and rebuilds flattenedTree from them. The build times stay 0 since nothing was built.
+ */
+void Octree::loadGPUData(const GPUNodeCorner* minAndChildren, const GPUNodeCorner* maxAndObjects, const unsigned int* objectCounts,
+                         const glm::vec4* splits, size_t nodeCount, const uint32_t* packedIndices, size_t indexCount,
+                         const GPUCompactNode* compact, size_t compactCount, size_t sphereCount,
+                         const glm::vec3& cellMin, const glm::vec3& cellMax) {
+    cleanup();
+    buildTime = boundsTime = subdivideTime = gpuConversionTime = 0.0;
+
+    visitOrdered = false; // the cache knows, see SceneCache::loadOctree
+    resizeGPUData(nodeCount);
+    for (size_t i = 0; i < nodeCount; ++i) {
+        GPUOctreeNode node;
+        node.min = minAndChildren[i].corner;
+        node.max = maxAndObjects[i].corner;
+        node.childrenOffset = minAndChildren[i].offset;
+        node.objectsOffset = maxAndObjects[i].offset;
+        node.objectCount = static_cast<int>(objectCounts[i] & 0xFFFFFFu);
+        node.childMask = objectCounts[i] >> 24;
+        node.split = glm::vec3(splits[i]);
+        setGPUNode(i, node);
+    }
+    indexBits = objectIndexBits(sphereCount);
+    gpuObjectIndices.assign(packedIndices, packedIndices + packedIndexWords(indexCount, indexBits));
+    objectIndices.resize(indexCount);
+    for (size_t i = 0; i < indexCount; ++i) {
+        objectIndices[i] = unpackObjectIndex(packedIndices, indexBits, i);
+    }
+    compactTree.assign(compact, compact + compactCount);
+    ropeTree.clear(); // not cached, setRopeData takes a single pass
+    rootCellMin = cellMin;
+    rootCellMax = cellMax;
+    resetUpdates();
+
+    duplicationFactor = sphereCount > 0 ? double(indexCount) / sphereCount : 0.0;
+    computeCostStats();
+    builtCost = predictedCost;
+    builtDuplication = duplicationFactor;
+}
+
+/**
+ * @brief Offsets are 32 bit ints on the GPU, fail instead of wrapping around when the tree gets too big.
+ */
+int Octree::toOffset(size_t offset, const char* what) {
+    if (offset > static_cast<size_t>(std::numeric_limits<int>::max())) {
+        throw std::overflow_error(std::string(what) + " offset " + std::to_string(offset) + " does not fit in the 32 bit offsets of GPUOctreeNode");
+    }
+    return static_cast<int>(offset);
+}
+
+// Step (in 1/16ths of the parent box, 0 to 15) of a child's min coordinate, rounded down: decoded as
+// decodeCompactChildBox does, it is never above value
+static uint32_t quantizeMin(float value, float parentMin, float cell) {
+    if (!(cell > 0.0f)) return 0;
+    int q = std::min(std::max(static_cast<int>(std::floor((value - parentMin) / cell)), 0), 15);
+    while (q > 0 && parentMin + float(q) * cell > value) q--;
+    return q;
+}
+
+// Step (1 to 16) of a child's max coordinate, rounded up: decoded, it is never below value
+static uint32_t quantizeMax(float value, float parentMin, float cell) {
+    if (!(cell > 0.0f)) return 16;
+    int q = std::min(std::max(static_cast<int>(std::ceil((value - parentMin) / cell)), 1), 16);
+    while (q < 16 && parentMin + float(q) * cell < value) q++;
+    return q;
+}
+
+/**
+ * Builds compactTree from flattenedTree, same indices. Children are quantized against their parent's decoded box,
+ * not its exact one, so the error does not build up with depth: the nodes go top-down (topDownOrder), after updates a
+ * parent can sit after its children. Boxes are always rounded outwards, so a midpoint split that float rounding puts just
+ * off its step costs a step of overlap between the siblings. Nodes released by updates are left zeroed.
+ */
+void Octree::setCompactData() {
+    if (isLoose()) {
+        throw std::invalid_argument("Compact nodes have a single offset, they cannot hold a loose octree whose internal nodes have objects");
+    }
+    compactTree.assign(flattenedTree.size(), GPUCompactNode());
+    compactBoxMin.assign(flattenedTree.size(), glm::vec3(0.0f));
+    compactBoxMax.assign(flattenedTree.size(), glm::vec3(0.0f));
+    if (flattenedTree.empty()) return;
+
+    compactBoxMin[0] = flattenedTree[0].min;
+    compactBoxMax[0] = flattenedTree[0].max;
+    for (int i : topDownOrder()) {
+        setCompactNode(i);
+    }
+}
+
+/**
+ * @brief Write compactTree[index] from its node and decoded box, and the decoded boxes of its children.
+ * @return The octants of the children whose decoded box changed.
+ */
+unsigned int Octree::setCompactNode(size_t index) {
+    const GPUOctreeNode& node = flattenedTree[index];
+    GPUCompactNode& compact = compactTree[index];
+    compact = GPUCompactNode();
+
+    if (node.childrenOffset == -1) {
+        compact.offset = static_cast<uint32_t>(node.objectsOffset);
+        compact.info = static_cast<uint32_t>(node.objectCount) << 8;
+        return 0u;
+    }
+
+    compact.offset = static_cast<uint32_t>(node.childrenOffset);
+    compact.info = node.childMask;
+    const glm::vec3 parentMin = compactBoxMin[index], parentMax = compactBoxMax[index];
+    glm::vec3 cell = (parentMax - parentMin) * 0.0625f;
+    unsigned int moved = 0u;
+    for (int j = 0; j < 8; ++j) {
+        if (!(node.childMask & (1u << j))) continue;
+        size_t childIdx = childIndex(node.childrenOffset, node.childMask, j);
+        const GPUOctreeNode& child = flattenedTree[childIdx];
+
+        for (int axis = 0; axis < 3; ++axis) {
+            uint32_t lo = quantizeMin(child.min[axis], parentMin[axis], cell[axis]);
+            uint32_t hi = quantizeMax(child.max[axis], parentMin[axis], cell[axis]);
+            compact.childBoxes[axis] |= lo << (4 * j);
+            compact.childBoxes[axis + 3] |= (hi - 1) << (4 * j);
+        }
+        glm::vec3 childMin, childMax;
+        decodeCompactChildBox(compact, j, parentMin, parentMax, childMin, childMax);
+        if (childMin != compactBoxMin[childIdx] || childMax != compactBoxMax[childIdx]) {
+            moved |= 1u << j;
+            compactBoxMin[childIdx] = childMin;
+            compactBoxMax[childIdx] = childMax;
+        }
+    }
+    return moved;
+}
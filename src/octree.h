@@ -2,8 +2,12 @@
 #define OCTREE_H
 
 #include <iostream>
+#include <atomic>
+#include <cstdint>
 #include <glm/glm.hpp>
+#include <string>
 #include <vector>
+#include "arena.h"
 #include "sphere.h"
 using namespace std;
 
@@ -19,62 +23,373 @@ enum OctantPosition {
     TopRightFront    = 7   // 111: (max.z, max.x, max.y)
 };
 
+/**
+ * @brief Bounds of the octant `index` of the box [min, max] split at mid.
+ */
+void octantBounds(int index, const glm::vec3& min, const glm::vec3& max, const glm::vec3& mid, glm::vec3& childMin, glm::vec3& childMax);
+
+enum OctreeBuildMode {
+    TopDownBuild = 0, // Recursive midpoint subdivision of OctreeNodes, then flattened by setGPUData
+    MortonBuild  = 1, // Sorted Morton codes of the spheres, written straight into the flattened tree
+    LooseBuild   = 2, // Loose octree: every sphere is stored once, in the deepest node whose loose box contains it
+    SAHBuild     = 3  // Top-down, with the split point of each node placed by a binned surface area heuristic
+};
+
+// Order of the nodes in flattenedTree, see octree_layout.cpp. Children of a node are contiguous in all of them
+enum NodeLayout {
+    BFSLayout = 0, // Breadth-first, level after level, the order setGPUData writes
+    DFSLayout = 1, // Depth-first: the children of a node, then the whole subtree of each child in turn
+    VEBLayout = 2, // van Emde Boas: the top half of the levels, then each subtree below it, recursively; cache-oblivious
+    ProfiledLayout = 3 // Breadth-first until Octree::reorderByVisits puts the most visited nodes first
+};
+
+// Deepest tree an Octree may have. A traversal stack holds at most 8 nodes per level, so 8 * MAX_TREE_DEPTH + 1 entries always
+// suffice, and a cell 2^24 times smaller than the root is below float precision anyway
+const int MAX_TREE_DEPTH = 24;
+
+// Loose node boxes are this many times the size of their cell, around the same center
+const float LOOSE_OCTREE_FACTOR = 2.0f;
+
+// Relative costs of the traversal cost model: testing a ray against one node box, and against one sphere
+const float BOX_TEST_COST = 1.0f;
+const float SPHERE_TEST_COST = 1.5f;
 
 // The same structure as the one in the fragment shader
 struct GPUOctreeNode {
     glm::vec3 min; // Bottom Left Back
     glm::vec3 max; // Top Right Front
-    int childrenOffset;
+    int childrenOffset; // First child, only the children in childMask are stored, in octant order
     int objectsOffset;
     int objectCount;
+    unsigned int childMask; // Bit i set if octant i has a child, it is at childrenOffset + popcount of the lower bits
+    glm::vec3 split; // Point where the node is split in 8, the box center unless built with SAHBuild
+};
+
+/**
+ * @brief Index of the child in `octant` of a node, given its childrenOffset and childMask. The octant must be in the mask.
+ */
+inline int childIndex(int childrenOffset, unsigned int childMask, int octant) {
+    return childrenOffset + __builtin_popcount(childMask & ((1u << octant) - 1u));
+}
+
+// One element of the node SSBOs (std430 struct {vec3; int;}): the offset is a real int in the 4th word, not a float
+struct GPUNodeCorner {
+    glm::vec3 corner;
+    int offset;
+};
+static_assert(sizeof(GPUNodeCorner) == 16, "GPUNodeCorner must match the std430 layout of the shader");
+
+/**
+ * Compact node, 32 bytes in a single SSBO (std430 struct of 8 uints) instead of 36 bytes over three.
+ * Node boxes are not stored: the box of each child is quantized to 1/16ths of its parent's box,
+ * so the traversal decodes the boxes top-down from the root box.
+ */
+struct GPUCompactNode {
+    uint32_t offset;        // childrenOffset for internal nodes, objectsOffset for leaves (0xFFFFFFFF = none)
+    uint32_t info;          // bits 0-7: mask of the non-empty children (0 for leaves), bits 8-31: objectCount
+    uint32_t childBoxes[6]; // min.x, min.y, min.z, max.x - 1, max.y - 1, max.z - 1; 4 bits per child, child i at bits 4i
+};
+static_assert(sizeof(GPUCompactNode) == 32, "GPUCompactNode must match the std430 layout of the shader");
+
+/**
+ * @brief Box of the child `index` of a compact node whose own box is [parentMin, parentMax]. Same math as the shader.
+ */
+inline void decodeCompactChildBox(const GPUCompactNode& node, int index, const glm::vec3& parentMin, const glm::vec3& parentMax, glm::vec3& childMin, glm::vec3& childMax) {
+    glm::vec3 cell = (parentMax - parentMin) * 0.0625f;
+    int shift = 4 * index;
+    glm::vec3 lo((node.childBoxes[0] >> shift) & 15u, (node.childBoxes[1] >> shift) & 15u, (node.childBoxes[2] >> shift) & 15u);
+    glm::vec3 hi((node.childBoxes[3] >> shift) & 15u, (node.childBoxes[4] >> shift) & 15u, (node.childBoxes[5] >> shift) & 15u);
+    childMin = parentMin + lo * cell;
+    childMax = parentMin + (hi + 1.0f) * cell;
+}
+
+/**
+ * Cell and face neighbours of a node, for the stackless traversal (std430 struct {vec4; vec4; int[6];}, 64 bytes).
+ * Face f is f / 2 = x, y, z and f % 2 = 0 for the min side, 1 for the max side. Its rope is the deepest node whose cell
+ * holds the whole face from the other side, -1 on the faces of the root cell.
+ */
+struct GPURopeNode {
+    glm::vec4 cellMin; // xyz, the cell before tightBounds
+    glm::vec4 cellMax;
+    int ropes[6];
+    int padding[2];
+};
+static_assert(sizeof(GPURopeNode) == 64, "GPURopeNode must match the std430 layout of the shader");
+
+/**
+ * @brief Sphere index i of object indices packed to indexBits (see Octree::gpuObjectIndices). Same decoding as the shader.
+ */
+inline int unpackObjectIndex(const uint32_t* packed, int indexBits, size_t i) {
+    if (indexBits == 16) return static_cast<int>((packed[i >> 1] >> ((i & 1) * 16)) & 0xFFFFu);
+    return static_cast<int>(packed[i]);
+}
+
+// 32 bit words holding count object indices of indexBits each
+inline size_t packedIndexWords(size_t count, int indexBits) {
+    return indexBits == 16 ? (count + 1) / 2 : count;
+}
+
+// Width of the object indices of a scene: 16 bit while every sphere index fits, 32 past that
+inline int objectIndexBits(size_t sphereCount) {
+    return sphereCount <= 0x10000 ? 16 : 32;
+}
+
+// Shape and memory of a built tree, returned by Octree::getStats
+struct OctreeStats {
+    int nodeCount = 0;
+    int leafCount = 0;
+    int emptyLeafCount = 0;
+    double emptyLeafRatio = 0.0; // emptyLeafCount / leafCount
+    vector<int> nodesPerDepth;   // Index = depth, the root is 0
+    vector<int> leavesPerDepth;
+    vector<int> leafOccupancy;   // Leaves per sphere count: [0] empty, then [1], [2, 3], [4, 7], ... doubling
+    double duplicationFactor = 0.0;
+    double expectedCost = 0.0;   // Octree::predictedCost
+
+    // Bytes of each buffer
+    size_t flattenedTreeBytes = 0;
+    size_t objectIndicesBytes = 0; // Packed to indexBits, as uploaded
+    int indexBits = 32;
+    size_t minAndChildrenBytes = 0;
+    size_t maxAndObjectsBytes = 0;
+    size_t objectCountsBytes = 0;
+    size_t splitsBytes = 0;
+    size_t compactTreeBytes = 0; // 0 unless setCompactData was called
+    size_t ropeTreeBytes = 0; // 0 unless setRopeData was called
 };
 
+// Elements [begin, end) of a buffer changed by an incremental update
+struct DirtyRange {
+    size_t begin;
+    size_t end;
+};
+
+// Nodes and their index lists live in the arenas of the Octree that built them
 class OctreeNode {
     public:
-        OctreeNode* children[8];
+        OctreeNode* children[8]; // Null for empty octants, the others are in the same contiguous run of 8 nodes
         bool isLeaf;
         glm::vec3 min; // Bottom Left Back
         glm::vec3 max; // Top Right Front
+        glm::vec3 split; // Corner shared by the 8 children
 
         int childrenOffset; // Offset to first children in flat array (-1 if leaf)
-        // there is no need for childrenCount, as if it has any children, it must have 8 children
+        // there is no need for childrenCount, it is the number of non-null children
 
-        std::vector<int> objectIndices; // Indices of the spheres in this node, i.e. if the sphere1 and sphere3 are in this node, the objectIndices will be [1, 3]
-        int objectsOffset; // Offset to object indices array (-1 if not leaf, has it has no objects (spheres))
-        int objectCount; // Number of objects in this node
+        int* objectIndices; // Indices of the spheres in this node, i.e. if the sphere1 and sphere3 are in this node, the objectIndices will be [1, 3]
+        int objectsOffset; // Offset to object indices array (-1 if it has no objects (spheres), only leaves have any unless the octree is loose)
+        int objectCount; // Number of objects in this node, i.e. the length of objectIndices
 
         OctreeNode(const glm::vec3& min, const glm::vec3& max);
-        ~OctreeNode();
 };
 
 class Octree {
     public:
-        Octree(int maxDepth = 8, int maxSpheresPerNode = 8);
+        Octree(int maxDepth = 8, int maxSpheresPerNode = 8, int numThreads = 0, OctreeBuildMode buildMode = TopDownBuild, bool tightBounds = false, bool autoTune = false,
+               NodeLayout layout = BFSLayout);
         ~Octree();
 
+        Octree(Octree&&) = default;
+        Octree& operator=(Octree&&) = default;
+
         // Vectors for GPU
         vector<GPUOctreeNode> flattenedTree;
         vector<int> objectIndices;
 
-        double buildTime = 0.0;
+        // flattenedTree split the way the shader reads it, ready to be uploaded as is
+        vector<GPUNodeCorner> gpuMinAndChildren;  // min, childrenOffset
+        vector<GPUNodeCorner> gpuMaxAndObjects;   // max, objectsOffset
+        vector<unsigned int> gpuObjectCounts; // objectCount | childMask << 24
+        vector<glm::vec4> gpuSplits;          // split.xyz, 0
+        // objectIndices packed to indexBits, two to a word (low half first) when 16. The width follows the sphere count
+        // (objectIndexBits), so it is chosen by the build and only widened by an insert past 65536 spheres
+        int indexBits = 32;
+        vector<uint32_t> gpuObjectIndices;
+
+        double buildTime = 0.0; // boundsTime + subdivideTime
+        double boundsTime = 0.0;
+        double subdivideTime = 0.0;
+        double gpuConversionTime = 0.0;
+        double tightBoundsReduction = 0.0; // Average fraction of node box volume removed by tightBounds
+        double duplicationFactor = 0.0; // References per sphere in objectIndices, 1 for a loose octree
+
+        // Traversal cost model of the built tree, see computeCostStats
+        double predictedCost = 0.0; // Expected box and sphere tests of a ray through the root box, weighted by their costs
+        int treeDepth = 0; // Depth of the deepest node, the root is 0
+        int leafCount = 0;
+        double averageLeafSize = 0.0; // Spheres per leaf
+        int maxLeafSize = 0;
+
+        // Internal nodes can hold objects too, and sibling boxes overlap
+        bool isLoose() const { return buildMode == LooseBuild; }
+        // Node boxes smaller than their cells, worth testing before the spheres of a leaf
+        bool hasTightBounds() const { return tightBounds && !isLoose(); }
+        // Root cell the splits divide, the root box unless tightBounds shrank it. Traversals walk the cells, see CPURaytracer::traverseOctree
+        const glm::vec3& getRootCellMin() const { return rootCellMin; }
+        const glm::vec3& getRootCellMax() const { return rootCellMax; }
 
         void build(const vector<Sphere>& spheres, const int debug = 0);
 
         void setGPUData();
+        void loadGPUData(const GPUNodeCorner* minAndChildren, const GPUNodeCorner* maxAndObjects, const unsigned int* objectCounts,
+                         const glm::vec4* splits, size_t nodeCount, const uint32_t* packedIndices, size_t indexCount,
+                         const GPUCompactNode* compact, size_t compactCount, size_t sphereCount,
+                         const glm::vec3& cellMin, const glm::vec3& cellMax);
+
+        // Optional compact copy of flattenedTree, filled by setCompactData
+        vector<GPUCompactNode> compactTree;
+        void setCompactData();
+
+        // Optional cells and face neighbours of flattenedTree, same indices, filled by setRopeData (octree_ropes.cpp)
+        vector<GPURopeNode> ropeTree;
+        void setRopeData();
 
         void printFlattenedTree();
+
+        // Lay the current tree out again, every node buffer is marked dirty. The build already uses the layout given to the constructor
+        void setLayout(NodeLayout layout);
+        NodeLayout getLayout() const { return layout; }
+
+        /**
+         * Profile-guided order: sibling blocks sorted by the visits of their busiest node, most visited first, so the part of the
+         * tree the cameras actually use is packed at the front. A block counts as no busier than its parent's, which keeps
+         * parents first whatever traversal counted the visits. visits has a count per node of the current order (see
+         * CPURaytracer::nodeVisits); ties, and nodes never visited, keep the order of the layout.
+         */
+        void reorderByVisits(const vector<uint64_t>& visits);
+        bool visitOrdered = false; // Set by reorderByVisits until the next build, stored in the scene cache
+
+        OctreeStats getStats() const;
+        bool saveStats(const std::string& filename) const;
+
+        /**
+         * Incremental updates of a built tree (octree_update.cpp), on the flattened tree only. spheres is the vector the tree was
+         * built from, a sphere keeps its index for as long as it exists. Leaves are split past the leaf size limit and subtrees
+         * merged back below half of it; lists that outgrow their slots in objectIndices and replaced child blocks move to the end
+         * of their buffers, the old slots are just left unused (see unusedNodes and unusedIndices) until the next build.
+         * A sphere that would stick out of the root cell cannot be placed without a rebuild: insert returns -1 and update false,
+         * and nothing changes. compactTree and ropeTree are dropped by any change made here, call setCompactData and setRopeData again.
+         */
+        int insert(vector<Sphere>& spheres, const Sphere& sphere); // Appends the sphere, returns its index
+        bool remove(const vector<Sphere>& spheres, int index); // Drops every reference to it, its slot in spheres stays
+        bool update(vector<Sphere>& spheres, int index, const glm::vec3& newCenter);
+
+        // Changed since the last clearDirtyRanges: node indices (of flattenedTree and the node buffers), objectIndices, and spheres
+        vector<DirtyRange> dirtyNodes;
+        vector<DirtyRange> dirtyIndices;
+        vector<DirtyRange> dirtySpheres;
+        void clearDirtyRanges();
+        // Sorted ranges with the overlapping ones, and those less than maxGap apart, joined
+        static vector<DirtyRange> mergeRanges(vector<DirtyRange> ranges, size_t maxGap = 0);
+
+        size_t unusedNodes = 0;   // Nodes no longer referenced since the last build
+        size_t unusedIndices = 0; // objectIndices slots no longer referenced since the last build
+
+        /**
+         * Refit-or-rebuild policy for animated scenes, meant to run once per frame. Each sphere of moved goes to the matching
+         * center through update, so only the leaves it leaves and enters are rewritten and, with tightBounds, the boxes it left
+         * shrink back to what they still hold. The whole tree is rebuilt from spheres instead when a sphere leaves the root cell,
+         * or when predictedCost or the references per sphere grew more than maxGrowth (a fraction) past those of the last build;
+         * a rebuild pads the root cell by rootMargin on every side so spheres moving around their place stay inside it.
+         * After a rebuild every buffer is marked dirty, so uploading the dirty ranges is enough either way.
+         * Without a rebuild, predictedCost and compactTree are only redone for the nodes the updates wrote and the nodes above
+         * them, and ropeTree for the nodes that got other children and the ropes across them. treeDepth and the leaf sizes stay
+         * those of the build.
+         * @return true if the tree was rebuilt.
+         */
+        bool refitOrRebuild(vector<Sphere>& spheres, const vector<int>& moved, const vector<glm::vec3>& centers, double maxGrowth, float rootMargin = 0.0f);
+        double updateTime = 0.0; // Seconds spent in the last refitOrRebuild, rebuild included; buildTime is only the build itself
+        int rebuildCount = 0;    // Rebuilds done by refitOrRebuild
     private:
         OctreeNode* root;
         int maxDepth;
         int maxSpheresPerNode;
+        int numThreads; // Threads used by build, 0 = one per hardware thread
+        OctreeBuildMode buildMode;
+        bool tightBounds; // Shrink the flattened node boxes to the spheres they hold, clipped to their octant
+        bool autoTune; // Each node is only split if the cost model says it pays off, maxDepth is just a cap and maxSpheresPerNode is ignored
+        NodeLayout layout;
+        float rootMargin = 0.0f; // Added on every side of the sphere bounds to make the root box, set by refitOrRebuild
+
+        // Storage of all OctreeNodes and their objectIndices, reused by the next build
+        Arena<OctreeNode> nodeArena;
+        Arena<int> indexArena;
         
         // Build functions
-        void subdivideNode(OctreeNode* node, const vector<Sphere>& spheres, int depth, const int debug = 0);
-        bool sphereIntersectsBox(const Sphere& sphere, const glm::vec3& boxMin, const glm::vec3& boxMax);
+        void computeBounds(const vector<Sphere>& spheres, glm::vec3& min, glm::vec3& max);
+        void subdivideNode(OctreeNode* node, const vector<Sphere>& spheres, int depth, atomic<int>& activeTasks, const int debug = 0);
+        void distributeSpheres(OctreeNode* node, const vector<Sphere>& spheres, const int debug = 0);
+        void distributeLooseSpheres(OctreeNode* node, const vector<Sphere>& spheres, const int debug = 0);
+        glm::vec3 sahSplit(const OctreeNode* node, const vector<Sphere>& spheres) const;
+        static bool sphereIntersectsBox(const Sphere& sphere, const glm::vec3& boxMin, const glm::vec3& boxMax);
+        // How much the Morton build enlarges its grid cells on each side, for a root cell from min to max
+        static float mortonCellSlack(const glm::vec3& min, const glm::vec3& max);
+        void tightenBounds(const vector<Sphere>& spheres);
+        bool splitPays(const OctreeNode* node, int objectCount) const;
+        void computeCostStats(bool report = true);
+        double nodeCost(int index) const;
+        vector<int> topDownOrder() const;
+        vector<int> nodeDepths() const;
+
+        // Morton build functions (octree_morton.cpp)
+        void buildMorton(const vector<Sphere>& spheres, const glm::vec3& min, const glm::vec3& max);
+        template <typename KeyT>
+        void buildMortonTree(const vector<Sphere>& spheres, const glm::vec3& min, const glm::vec3& max, int gridDepth);
+
+        // Ropes (octree_ropes.cpp)
+        int childRope(int node, int octant, int face, const glm::vec3& childMin, const glm::vec3& childMax) const;
+        void setChildRopes(int node);
+        void updateRopes();
+
+        // Node order (octree_layout.cpp)
+        void reorderNodes();
+        void applyBlockOrder(const vector<int>& blocks);
+        void markRelaidOut(bool compact, bool ropes);
+
+        // Incremental update helpers (octree_update.cpp)
+        glm::vec3 rootCellMin, rootCellMax; // Root box as built, before tightBounds; the cells below follow from the splits
+        vector<int> objectCapacity; // objectIndices slots reserved for each node, filled by the first update after a build
+        double builtCost = 0.0, builtDuplication = 0.0; // predictedCost and duplicationFactor of the last build, see refitOrRebuild
+        vector<int> nodeParents; // Of every node, -1 for the root and released nodes; empty until computeCostStats, and after a relayout
+        vector<double> nodeCosts; // Cost of the subtree of every node, see computeCostStats
+        size_t referenceCount = 0; // objectCount of all the nodes
+        vector<DirtyRange> staleNodes; // Written since nodeCosts and compactTree were last brought up to date
+        vector<int> reshapedNodes; // Nodes given other children while ropeTree was kept, see updateRopes
+        vector<glm::vec3> compactBoxMin, compactBoxMax; // Boxes of the nodes decoded from compactTree, as the traversals see them
+        void resetUpdates();
+        void prepareUpdates(bool keepDerivedData = false);
+        bool moveSphere(vector<Sphere>& spheres, int index, const glm::vec3& newCenter);
+        unsigned int setCompactNode(size_t index);
+        void refreshStaleNodes(bool compact);
+        void refreshNode(int index, const vector<char>& stale, bool compact);
+        int leafLimit() const;
+        bool fitsRootCell(const Sphere& sphere) const;
+        void fullBox(const glm::vec3& cellMin, const glm::vec3& cellMax, glm::vec3& boxMin, glm::vec3& boxMax) const;
+        GPUOctreeNode emptyNode(const glm::vec3& cellMin, const glm::vec3& cellMax) const;
+        void writeNode(size_t index, const GPUOctreeNode& node);
+        void releaseNode(size_t index);
+        int appendNodes(int count);
+        int addChild(int node, int octant, const GPUOctreeNode& child);
+        void addObject(int node, int sphere);
+        void growBox(int node, const Sphere& sphere, const glm::vec3& cellMin, const glm::vec3& cellMax);
+        void refitBox(const vector<Sphere>& spheres, int node, const glm::vec3& cellMin, const glm::vec3& cellMax);
+        void growToChild(int node, int child);
+        bool removeObject(int node, int sphere);
+        void insertReference(const vector<Sphere>& spheres, int sphere, int node, const glm::vec3& cellMin, const glm::vec3& cellMax, int depth);
+        bool removeReference(const vector<Sphere>& spheres, int sphere, int node, const glm::vec3& cellMin, const glm::vec3& cellMax);
+        void splitNode(const vector<Sphere>& spheres, int node, const glm::vec3& cellMin, const glm::vec3& cellMax, int depth);
+        void mergeChildren(int node);
+        static void markDirty(vector<DirtyRange>& ranges, size_t begin, size_t end);
+
+        // Flattened tree writers, keep flattenedTree and the upload buffers in step
+        void resizeGPUData(size_t nodeCount);
+        void setGPUNode(size_t index, const GPUOctreeNode& node);
+        void packObjectIndices(size_t begin, size_t end);
+        void writeIndices(size_t begin, size_t end);
+        static int toOffset(size_t offset, const char* what);
 
         // Cleanup functions
         void cleanup();
-        void cleanupNode(OctreeNode* node);
         
 };
 
@@ -0,0 +1,193 @@
+#include "octree.h"
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+/**
+ * Node orders of the flattened tree.
+ *
+ * The children of a node always stay one contiguous block in octant order, childIndex depends on it, so every layout is an
+ * order of these sibling blocks (the root is a block of its own). All of them keep parents before their children, as the
+ * build does.
+ */
+
+// First node and size of the block holding the children of parent, or the root block for parent -1
+static void siblingBlock(const vector<GPUOctreeNode>& tree, int parent, int& first, int& count) {
+    if (parent == -1) {
+        first = 0;
+        count = 1;
+        return;
+    }
+    first = tree[parent].childrenOffset;
+    count = __builtin_popcount(tree[parent].childMask);
+}
+
+// Blocks in the order of layout, each given by its parent as in siblingBlock
+static vector<int> blockOrder(const vector<GPUOctreeNode>& tree, NodeLayout layout) {
+    vector<int> order;
+
+    if (layout == BFSLayout || layout == ProfiledLayout) {
+        order.push_back(-1);
+        for (size_t i = 0; i < order.size(); ++i) {
+            int first, count;
+            siblingBlock(tree, order[i], first, count);
+            for (int j = first; j < first + count; ++j) {
+                if (tree[j].childMask != 0) order.push_back(j);
+            }
+        }
+        return order;
+    }
+
+    if (layout == DFSLayout) {
+        std::function<void(int)> visit = [&](int parent) {
+            order.push_back(parent);
+            int first, count;
+            siblingBlock(tree, parent, first, count);
+            for (int j = first; j < first + count; ++j) {
+                if (tree[j].childMask != 0) visit(j);
+            }
+        };
+        visit(-1);
+        return order;
+    }
+
+    // van Emde Boas: the blocks of the top half of the levels first, then each subtree hanging below them, both laid out the
+    // same way. Whatever the cache line or page size, some level of the recursion makes subtrees that fit one, without knowing it
+    // Levels of the subtree of each node, 1 for a leaf. The blocks go deepest first in reverse breadth-first order: after
+    // incremental updates a moved block sits after its parent's children, so index order does not put children first
+    vector<int> levels(tree.size(), 1);
+    vector<int> breadthFirst = blockOrder(tree, BFSLayout);
+    for (size_t b = breadthFirst.size(); b-- > 0;) {
+        int first, count;
+        siblingBlock(tree, breadthFirst[b], first, count);
+        for (int i = first; i < first + count; ++i) {
+            const GPUOctreeNode& node = tree[i];
+            for (int j = 0; j < __builtin_popcount(node.childMask); ++j) {
+                levels[i] = std::max(levels[i], levels[node.childrenOffset + j] + 1);
+            }
+        }
+    }
+
+    std::function<void(int, int)> visit = [&](int parent, int height) {
+        if (height == 1) {
+            order.push_back(parent);
+            return;
+        }
+        int top = height / 2;
+        visit(parent, top);
+
+        // nodes of the deepest block level of the top part, their children blocks start the bottom subtrees
+        int first, count;
+        siblingBlock(tree, parent, first, count);
+        vector<int> frontier;
+        for (int j = first; j < first + count; ++j) frontier.push_back(j);
+        for (int level = 1; level < top; ++level) {
+            vector<int> next;
+            for (int node : frontier) {
+                for (int j = 0; j < __builtin_popcount(tree[node].childMask); ++j) next.push_back(tree[node].childrenOffset + j);
+            }
+            frontier.swap(next);
+        }
+        for (int node : frontier) {
+            if (tree[node].childMask != 0) visit(node, height - top);
+        }
+    };
+    visit(-1, levels[0]);
+    return order;
+}
+
+// Rewrite flattenedTree in the order of layout
+void Octree::reorderNodes() {
+    applyBlockOrder(blockOrder(flattenedTree, layout));
+}
+
+/**
+ * @brief Rewrite flattenedTree with its sibling blocks in the order of blocks, the object lists following their nodes.
+ * Only the nodes reachable from the root are kept, so the slack left by incremental updates goes too.
+ */
+void Octree::applyBlockOrder(const vector<int>& blocks) {
+    if (flattenedTree.empty()) return;
+    const vector<GPUOctreeNode> oldTree = flattenedTree;
+    const vector<int> oldIndices = objectIndices;
+
+    vector<int> newIndex(oldTree.size(), -1);
+    vector<int> oldIndex;
+    oldIndex.reserve(oldTree.size());
+    for (int parent : blocks) {
+        int first, count;
+        siblingBlock(oldTree, parent, first, count);
+        for (int j = first; j < first + count; ++j) {
+            newIndex[j] = static_cast<int>(oldIndex.size());
+            oldIndex.push_back(j);
+        }
+    }
+
+    resizeGPUData(oldIndex.size());
+    objectIndices.clear();
+    for (size_t i = 0; i < oldIndex.size(); ++i) {
+        GPUOctreeNode node = oldTree[oldIndex[i]];
+        if (node.childMask != 0) node.childrenOffset = newIndex[node.childrenOffset];
+        if (node.objectCount > 0) {
+            int offset = toOffset(objectIndices.size(), "Object index");
+            objectIndices.insert(objectIndices.end(), oldIndices.begin() + node.objectsOffset, oldIndices.begin() + node.objectsOffset + node.objectCount);
+            node.objectsOffset = offset;
+        } else {
+            node.objectsOffset = -1;
+        }
+        setGPUNode(i, node);
+    }
+    packObjectIndices(0, objectIndices.size());
+}
+
+// Everything moved: forget the update state and mark every node buffer dirty
+void Octree::markRelaidOut(bool compact, bool ropes) {
+    resetUpdates();
+    markDirty(dirtyNodes, 0, flattenedTree.size());
+    markDirty(dirtyIndices, 0, objectIndices.size());
+    if (compact) setCompactData();
+    if (ropes) setRopeData();
+}
+
+void Octree::setLayout(NodeLayout newLayout) {
+    layout = newLayout;
+    bool compact = !compactTree.empty();
+    bool ropes = !ropeTree.empty();
+    reorderNodes();
+    visitOrdered = false;
+    markRelaidOut(compact, ropes);
+}
+
+void Octree::reorderByVisits(const vector<uint64_t>& visits) {
+    if (visits.size() != flattenedTree.size()) {
+        throw std::invalid_argument("Expected a visit count for each of the " + std::to_string(flattenedTree.size()) + " nodes, got " + std::to_string(visits.size()));
+    }
+    bool compact = !compactTree.empty();
+    bool ropes = !ropeTree.empty();
+
+    // The stack traversal visits a child only after its parent, but the ropes jump straight to leaves, so a block can be
+    // hotter than its parent's. Each block is capped at the heat of its parent's block, top-down in the layout order (parents
+    // first): the stable sort then keeps every parent before its children
+    vector<int> blocks = blockOrder(flattenedTree, layout);
+    vector<uint64_t> heat(blocks.size(), 0);
+    vector<int> blockOf(flattenedTree.size(), -1);
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        int first, count;
+        siblingBlock(flattenedTree, blocks[i], first, count);
+        for (int j = first; j < first + count; ++j) {
+            heat[i] = std::max(heat[i], visits[j]);
+            blockOf[j] = static_cast<int>(i);
+        }
+        if (blocks[i] != -1) heat[i] = std::min(heat[i], heat[blockOf[blocks[i]]]);
+    }
+    vector<size_t> order(blocks.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&heat](size_t a, size_t b) { return heat[a] > heat[b]; });
+
+    vector<int> sorted;
+    sorted.reserve(blocks.size());
+    for (size_t i : order) sorted.push_back(blocks[i]);
+    applyBlockOrder(sorted);
+    visitOrdered = true;
+    markRelaidOut(compact, ropes);
+}
@@ -0,0 +1,353 @@
+#include "octree.h"
+#include "parallel.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+/**
+ * Bottom-up build from Morton codes.
+ *
+ * Every sphere is referenced by each cell of a regular grid it touches, the references are radix sorted
+ * by the Morton code of their cell, and then any octree node down to the grid depth is just a contiguous range
+ * of the sorted references: its children are the sub-ranges that share the next 3 bits of the code.
+ * The tree is written level by level, which is exactly the BFS order of flattenedTree.
+ * Spheres that would touch too many cells, and every sphere of a node split below the grid depth,
+ * are pushed down with sphereIntersectsBox instead, the same way subdivideNode does it.
+ */
+
+// A sphere touching more grid cells than this is distributed top-down instead of getting a reference per cell
+static const int MAX_CELLS_PER_SPHERE = 64;
+
+namespace {
+
+// A sphere's cell, with the first level from which it is the sphere's first cell in its node: its cells sorted by code,
+// two neighbours are in the same node down to the level of their longest common prefix
+template <typename KeyT>
+struct MortonRef {
+    KeyT code;
+    int sphere;
+    int firstFrom;
+};
+
+// Node of the level being written, covers refs[refBegin, refEnd) and big[bigBegin, bigEnd)
+struct MortonLevelNode {
+    size_t refBegin, refEnd;
+    size_t bigBegin, bigEnd;
+    glm::vec3 min, max;
+};
+
+// Puts two zero bits between each of the low 10 bits
+inline uint32_t expandBits(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Puts two zero bits between each of the low 21 bits
+inline uint64_t expandBits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x1f00000000ffffull;
+    v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+    v = (v | (v << 8)) & 0x100f00f00f00f00full;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+    v = (v | (v << 2)) & 0x1249249249249249ull;
+    return v;
+}
+
+// Interleaved as zxy, so every 3 bits of the code are an OctantPosition
+template <typename KeyT>
+inline KeyT mortonCode(uint32_t x, uint32_t y, uint32_t z) {
+    return (expandBits(KeyT(z)) << 2) | (expandBits(KeyT(x)) << 1) | expandBits(KeyT(y));
+}
+
+/**
+ * Stable LSD radix sort on the low `bits` bits of the codes, 8 bits per pass.
+ * Every pass counts digits per chunk and then scatters per chunk at its own offsets.
+ */
+template <typename KeyT>
+void radixSort(std::vector<MortonRef<KeyT>>& refs, int bits, int numThreads) {
+    std::vector<MortonRef<KeyT>> buffer(refs.size());
+    std::vector<size_t> chunkCounts;
+
+    for (int shift = 0; shift < bits; shift += 8) {
+        chunkCounts.assign(size_t(numThreads) * 256, 0);
+        int numChunks = parallelFor(refs.size(), numThreads, [&](int chunk, size_t begin, size_t end) {
+            size_t* counts = &chunkCounts[size_t(chunk) * 256];
+            for (size_t i = begin; i < end; ++i) {
+                counts[(refs[i].code >> shift) & 0xff]++;
+            }
+        });
+
+        // offsets go digit by digit, and chunk by chunk inside a digit, so the sort stays stable
+        size_t total = 0;
+        for (int digit = 0; digit < 256; ++digit) {
+            for (int chunk = 0; chunk < numChunks; ++chunk) {
+                size_t count = chunkCounts[size_t(chunk) * 256 + digit];
+                chunkCounts[size_t(chunk) * 256 + digit] = total;
+                total += count;
+            }
+        }
+
+        parallelFor(refs.size(), numChunks, [&](int chunk, size_t begin, size_t end) {
+            size_t* offsets = &chunkCounts[size_t(chunk) * 256];
+            for (size_t i = begin; i < end; ++i) {
+                buffer[offsets[(refs[i].code >> shift) & 0xff]++] = refs[i];
+            }
+        });
+        refs.swap(buffer);
+    }
+}
+
+// Levels (3 bit digits from the top of a depth digit code) on which a and b agree
+template <typename KeyT>
+inline int commonLevels(KeyT a, KeyT b, int depth) {
+    int level = 0;
+    while (level < depth && ((a ^ b) >> (3 * (depth - level - 1))) == 0) level++;
+    return level;
+}
+
+} // namespace
+
+float Octree::mortonCellSlack(const glm::vec3& min, const glm::vec3& max) {
+    const glm::vec3 extent = glm::max(max - min, glm::vec3(1e-6f));
+    return 1e-5f * std::max(extent.x, std::max(extent.y, extent.z));
+}
+
+void Octree::buildMorton(const vector<Sphere>& spheres, const glm::vec3& min, const glm::vec3& max) {
+    // Reference grid: deep enough to split the tree, but with cells no smaller than the average sphere,
+    // so a sphere touches a handful of cells. Deeper levels are split top-down from there
+    double radiusSum = 0.0;
+    for (const Sphere& sphere : spheres) radiusSum += sphere.radius;
+    const glm::vec3 extent = max - min;
+    const double diameter = 2.0 * radiusSum / spheres.size();
+    const double largest = std::max(extent.x, std::max(extent.y, extent.z));
+
+    int gridDepth = 0;
+    while (gridDepth < std::min(maxDepth, 21) && largest / double(1u << (gridDepth + 1)) >= diameter) {
+        gridDepth++;
+    }
+
+    if (gridDepth <= 10) {
+        buildMortonTree<uint32_t>(spheres, min, max, gridDepth); // 30 bit codes
+    } else {
+        buildMortonTree<uint64_t>(spheres, min, max, gridDepth); // 63 bit codes
+    }
+}
+
+template <typename KeyT>
+void Octree::buildMortonTree(const vector<Sphere>& spheres, const glm::vec3& min, const glm::vec3& max, int gridDepth) {
+    const auto start{std::chrono::steady_clock::now()};
+
+    const int depth = gridDepth;
+    const uint32_t gridSize = 1u << depth;
+    const glm::vec3 extent = glm::max(max - min, glm::vec3(1e-6f));
+    const glm::vec3 cellSize = extent / float(gridSize);
+    // Grid cells are not computed with the same midpoints as the node boxes, so they are slightly enlarged:
+    // a sphere may get an extra reference on a cell border, but never misses a cell it touches (remove looks as far)
+    const float epsilon = mortonCellSlack(min, max);
+
+    auto cellRange = [&](const Sphere& sphere, glm::uvec3& lo, glm::uvec3& hi) {
+        glm::vec3 cellMin = glm::floor((sphere.center - sphere.radius - epsilon - min) / cellSize);
+        glm::vec3 cellMax = glm::floor((sphere.center + sphere.radius + epsilon - min) / cellSize);
+        lo = glm::uvec3(glm::clamp(cellMin, glm::vec3(0.0f), glm::vec3(float(gridSize - 1))));
+        hi = glm::uvec3(glm::clamp(cellMax, glm::vec3(0.0f), glm::vec3(float(gridSize - 1))));
+    };
+
+    // Visits the grid cells the sphere touches, returns false if there are too many of them
+    auto forEachCell = [&](const Sphere& sphere, auto&& visit) {
+        glm::uvec3 lo, hi;
+        cellRange(sphere, lo, hi);
+        glm::uvec3 span = hi - lo + 1u;
+        if (uint64_t(span.x) * span.y * span.z > MAX_CELLS_PER_SPHERE) return false;
+
+        for (uint32_t z = lo.z; z <= hi.z; ++z) {
+            for (uint32_t x = lo.x; x <= hi.x; ++x) {
+                for (uint32_t y = lo.y; y <= hi.y; ++y) {
+                    glm::vec3 boxMin = min + cellSize * glm::vec3(x, y, z) - epsilon;
+                    glm::vec3 boxMax = min + cellSize * glm::vec3(x + 1, y + 1, z + 1) + epsilon;
+                    if (sphereIntersectsBox(sphere, boxMin, boxMax)) {
+                        visit(mortonCode<KeyT>(x, y, z));
+                    }
+                }
+            }
+        }
+        return true;
+    };
+
+    // 1. References: count per sphere, then write them at their prefix offsets
+    const size_t numSpheres = spheres.size();
+    std::vector<int> refCounts(numSpheres);
+    parallelFor(numSpheres, numThreads, [&](int, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            int count = 0;
+            bool small = forEachCell(spheres[i], [&](KeyT) { count++; });
+            refCounts[i] = small ? count : -1; // -1 = too big, distributed top-down
+        }
+    });
+
+    std::vector<size_t> refOffsets(numSpheres);
+    std::vector<int> bigSpheres;
+    size_t totalRefs = 0;
+    for (size_t i = 0; i < numSpheres; ++i) {
+        refOffsets[i] = totalRefs;
+        if (refCounts[i] < 0) {
+            bigSpheres.push_back(int(i));
+        } else {
+            totalRefs += refCounts[i];
+        }
+    }
+
+    std::vector<MortonRef<KeyT>> refs(totalRefs);
+    parallelFor(numSpheres, numThreads, [&](int, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (refCounts[i] < 0) continue;
+            size_t offset = refOffsets[i];
+            forEachCell(spheres[i], [&](KeyT code) { refs[offset++] = {code, int(i), 0}; });
+
+            MortonRef<KeyT>* first = &refs[refOffsets[i]];
+            MortonRef<KeyT>* last = &refs[offset];
+            std::sort(first, last, [](const MortonRef<KeyT>& a, const MortonRef<KeyT>& b) { return a.code < b.code; });
+            for (MortonRef<KeyT>* ref = first + 1; ref < last; ++ref) {
+                ref->firstFrom = commonLevels(ref[-1].code, ref->code, depth) + 1;
+            }
+        }
+    });
+
+    // 2. Sort by cell, spheres of the same cell keep their index order
+    radixSort(refs, 3 * depth, numThreads);
+
+    const auto sorted{std::chrono::steady_clock::now()};
+
+    // 3. Write the tree level by level. A sphere may be referenced by several cells of the same node, only the first of
+    // them (firstFrom <= d) counts, as the refs of a node are in code order
+    objectIndices.clear();
+
+    auto forEachUniqueSphere = [&](const MortonLevelNode& node, const std::vector<int>& big, int d, auto&& visit) {
+        for (size_t r = node.refBegin; r < node.refEnd; ++r) {
+            if (refs[r].firstFrom <= d) visit(refs[r].sphere);
+        }
+        for (size_t b = node.bigBegin; b < node.bigEnd; ++b) {
+            visit(big[b]);
+        }
+    };
+
+    std::vector<MortonLevelNode> level = {{0, totalRefs, 0, bigSpheres.size(), min, max}};
+    std::vector<int> levelBig = bigSpheres;
+    std::vector<MortonLevelNode> nextLevel;
+    std::vector<int> nextBig;
+    std::vector<int> counts;
+    std::vector<int> candidates;
+    resizeGPUData(1);
+
+    for (int d = 0; !level.empty(); ++d) {
+        const size_t levelStart = flattenedTree.size() - level.size();
+        const int childShift = 3 * (depth - d - 1);
+
+        // a. Number of distinct spheres in every node of the level
+        counts.assign(level.size(), 0);
+        int numChunks = parallelFor(level.size(), numThreads, [&](int, size_t begin, size_t end) {
+            for (size_t k = begin; k < end; ++k) {
+                forEachUniqueSphere(level[k], levelBig, d, [&](int) { counts[k]++; });
+            }
+        });
+
+        // b. Leaves get their object ranges, the others their 8 children at the end of the tree
+        nextLevel.clear();
+        nextBig.clear();
+        size_t objectsStart = objectIndices.size();
+        size_t objectsEnd = objectsStart;
+        for (size_t k = 0; k < level.size(); ++k) {
+            const MortonLevelNode& node = level[k];
+            GPUOctreeNode gpuNode;
+            gpuNode.min = node.min;
+            gpuNode.max = node.max;
+            gpuNode.split = (node.min + node.max) * 0.5f;
+            gpuNode.childrenOffset = -1;
+            gpuNode.objectsOffset = -1;
+            gpuNode.objectCount = 0;
+            gpuNode.childMask = 0;
+
+            if (d >= maxDepth || counts[k] <= maxSpheresPerNode) {
+                if (counts[k] > 0) {
+                    gpuNode.objectsOffset = toOffset(objectsEnd, "Object index");
+                    gpuNode.objectCount = counts[k];
+                    objectsEnd += counts[k];
+                }
+                setGPUNode(levelStart + k, gpuNode);
+                continue;
+            }
+
+            // Below the grid depth the codes say nothing more, every sphere of the node is tested against the children
+            const std::vector<int>* pushedDown = &levelBig;
+            size_t pushedBegin = node.bigBegin, pushedEnd = node.bigEnd;
+            if (d >= depth) {
+                candidates.clear();
+                forEachUniqueSphere(node, levelBig, d, [&](int sphere) { candidates.push_back(sphere); });
+                pushedDown = &candidates;
+                pushedBegin = 0;
+                pushedEnd = candidates.size();
+            }
+
+            gpuNode.childrenOffset = toOffset(levelStart + level.size() + nextLevel.size(), "Node");
+            glm::vec3 mid = gpuNode.split;
+            size_t childBegin = node.refBegin;
+            for (int i = 0; i < 8; ++i) {
+                MortonLevelNode child;
+                if (d < depth) {
+                    // refs of the node are sorted, so the child is the run with digit i
+                    child.refBegin = childBegin;
+                    child.refEnd = std::partition_point(refs.begin() + childBegin, refs.begin() + node.refEnd, [&](const MortonRef<KeyT>& ref) {
+                        return int((ref.code >> childShift) & 7) <= i;
+                    }) - refs.begin();
+                    childBegin = child.refEnd;
+                } else {
+                    child.refBegin = child.refEnd = 0;
+                }
+
+                octantBounds(i, node.min, node.max, mid, child.min, child.max);
+                child.bigBegin = nextBig.size();
+                for (size_t b = pushedBegin; b < pushedEnd; ++b) {
+                    int sphere = (*pushedDown)[b];
+                    if (sphereIntersectsBox(spheres[sphere], child.min, child.max)) {
+                        nextBig.push_back(sphere);
+                    }
+                }
+                child.bigEnd = nextBig.size();
+
+                // empty octants are left out of the tree
+                if (child.refBegin == child.refEnd && child.bigBegin == child.bigEnd) continue;
+                gpuNode.childMask |= 1u << i;
+                nextLevel.push_back(child);
+            }
+            setGPUNode(levelStart + k, gpuNode);
+        }
+
+        // c. Write the objects of the leaves
+        objectIndices.resize(objectsEnd);
+        parallelFor(level.size(), numChunks, [&](int, size_t begin, size_t end) {
+            for (size_t k = begin; k < end; ++k) {
+                const GPUOctreeNode& gpuNode = flattenedTree[levelStart + k];
+                if (gpuNode.objectCount == 0) continue;
+
+                int offset = gpuNode.objectsOffset;
+                forEachUniqueSphere(level[k], levelBig, d, [&](int sphere) { objectIndices[offset++] = sphere; });
+            }
+        });
+
+        resizeGPUData(flattenedTree.size() + nextLevel.size());
+        level.swap(nextLevel);
+        levelBig.swap(nextBig);
+    }
+
+    const auto finish{std::chrono::steady_clock::now()};
+    const std::chrono::duration<double> sort_seconds{sorted - start};
+    const std::chrono::duration<double> emit_seconds{finish - sorted};
+    cout << "Morton build: grid depth " << depth << ", " << totalRefs << " references, " << bigSpheres.size() << " large spheres, codes + sort: "
+         << sort_seconds.count() << "s, tree: " << emit_seconds.count() << "s" << std::endl;
+}
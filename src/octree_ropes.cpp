@@ -0,0 +1,174 @@
+#include "octree.h"
+#include <stdexcept>
+
+/**
+ * Ropes of the flattened tree, for the stackless traversal.
+ *
+ * A ray leaving a leaf follows the rope of the face it leaves through and goes down from there to the leaf it enters,
+ * so it never goes back up the tree. Octants with no node are cells too: a ray leaving one goes down from its parent
+ * again if it stays inside it, or follows the parent's rope otherwise, which is why internal nodes have ropes as well.
+ */
+
+// Bit of axis (x, y, z) in an octant index, octants are z << 2 | x << 1 | y
+static const unsigned int axisBits[3] = {2u, 1u, 4u};
+
+/**
+ * @brief Deepest node at or below node whose cell still holds the whole face of the cell [cellMin, cellMax], from the
+ * other side. Stops at a node whose split cuts through the face, or whose octant beyond the face has no node.
+ */
+static int refineRope(const vector<GPUOctreeNode>& tree, int node, int face, const glm::vec3& cellMin, const glm::vec3& cellMax) {
+    const int axis = face / 2;
+    const bool maxSide = face % 2 == 1;
+    const float plane = maxSide ? cellMax[axis] : cellMin[axis];
+
+    while (node != -1 && tree[node].childMask != 0) {
+        const GPUOctreeNode& current = tree[node];
+        // Beyond a max face is above the plane, beyond a min face below it
+        bool high = maxSide ? plane >= current.split[axis] : plane > current.split[axis];
+        unsigned int octant = high ? axisBits[axis] : 0u;
+        for (int other = 0; other < 3; ++other) {
+            if (other == axis) continue;
+            if (cellMin[other] >= current.split[other]) {
+                octant |= axisBits[other];
+            } else if (cellMax[other] > current.split[other]) {
+                return node; // the split cuts the face
+            }
+        }
+        if (!(current.childMask & (1u << octant))) return node;
+        node = childIndex(current.childrenOffset, current.childMask, static_cast<int>(octant));
+    }
+    return node;
+}
+
+/**
+ * @brief Rope of face of the child in octant of node, whose cell is [childMin, childMax]: the sibling behind a face inside
+ * node, or node itself when that octant is empty; on node's boundary, where node's rope on that face leads, as deep as the face allows.
+ */
+int Octree::childRope(int node, int octant, int face, const glm::vec3& childMin, const glm::vec3& childMax) const {
+    const GPUOctreeNode& parent = flattenedTree[node];
+    const unsigned int bit = axisBits[face / 2];
+    const bool maxSide = face % 2 == 1;
+    if (maxSide != ((octant & bit) != 0)) {
+        int sibling = octant ^ static_cast<int>(bit);
+        return (parent.childMask & (1u << sibling)) ? childIndex(parent.childrenOffset, parent.childMask, sibling) : node;
+    }
+    return refineRope(flattenedTree, ropeTree[node].ropes[face], face, childMin, childMax);
+}
+
+// Cells and ropes of the children of node, from its own
+void Octree::setChildRopes(int node) {
+    const GPUOctreeNode& parent = flattenedTree[node];
+    const glm::vec3 parentMin(ropeTree[node].cellMin), parentMax(ropeTree[node].cellMax);
+    for (int octant = 0; octant < 8; ++octant) {
+        if (!(parent.childMask & (1u << octant))) continue;
+        GPURopeNode& child = ropeTree[childIndex(parent.childrenOffset, parent.childMask, octant)];
+        glm::vec3 childMin, childMax;
+        octantBounds(octant, parentMin, parentMax, parent.split, childMin, childMax);
+        child.cellMin = glm::vec4(childMin, 0.0f);
+        child.cellMax = glm::vec4(childMax, 0.0f);
+        for (int face = 0; face < 6; ++face) {
+            child.ropes[face] = childRope(node, octant, face, childMin, childMax);
+        }
+    }
+}
+
+/**
+ * Builds ropeTree from flattenedTree, same indices, top-down from the root cell (see setChildRopes). Updates append the
+ * child blocks they move, so a parent may come after its children: the nodes are taken from a list of the ones reached so
+ * far, not in index order.
+ */
+void Octree::setRopeData() {
+    if (isLoose()) {
+        throw std::invalid_argument("Ropes link cells, they cannot be used with a loose octree whose objects stick out of them");
+    }
+    ropeTree.assign(flattenedTree.size(), GPURopeNode());
+    reshapedNodes.clear();
+    if (flattenedTree.empty()) return;
+
+    GPURopeNode& root = ropeTree[0];
+    root.cellMin = glm::vec4(rootCellMin, 0.0f);
+    root.cellMax = glm::vec4(rootCellMax, 0.0f);
+    for (int face = 0; face < 6; ++face) {
+        root.ropes[face] = -1;
+    }
+
+    vector<int> pending(1, 0);
+    while (!pending.empty()) {
+        int i = pending.back();
+        pending.pop_back();
+        const GPUOctreeNode& node = flattenedTree[i];
+        setChildRopes(i);
+        for (int j = 0; j < __builtin_popcount(node.childMask); ++j) pending.push_back(node.childrenOffset + j);
+    }
+}
+
+/**
+ * Brings ropeTree up to date after updates that gave the nodes of reshapedNodes other children, without a full setRopeData.
+ * Below a reshaped node every rope is redone, top-down from its own, which the change did not touch. Outside of it, only
+ * ropes that cross one of its faces can lead into it: those of the nodes right across each face are redone, top-down from
+ * the root so that each one starts from its parent's. nodeParents must be up to date.
+ */
+void Octree::updateRopes() {
+    ropeTree.resize(flattenedTree.size());
+    vector<char> reshaped(flattenedTree.size(), 0);
+    vector<int> nodes;
+    for (int node : reshapedNodes) {
+        if (reshaped[node] || (node != 0 && nodeParents[node] == -1)) continue; // released since
+        reshaped[node] = 1;
+        nodes.push_back(node);
+    }
+    reshapedNodes.clear();
+
+    // subtrees, only from the topmost reshaped nodes
+    for (int node : nodes) {
+        bool topmost = true;
+        for (int above = nodeParents[node]; above != -1 && topmost; above = nodeParents[above]) topmost = !reshaped[above];
+        if (!topmost) continue;
+        vector<int> pending(1, node);
+        while (!pending.empty()) {
+            int i = pending.back();
+            pending.pop_back();
+            setChildRopes(i);
+            for (int j = 0; j < __builtin_popcount(flattenedTree[i].childMask); ++j) pending.push_back(flattenedTree[i].childrenOffset + j);
+        }
+    }
+
+    // the nodes across each face, a face on the root cell has nothing behind it
+    for (int node : nodes) {
+        const glm::vec3 cellMin(ropeTree[node].cellMin), cellMax(ropeTree[node].cellMax);
+        for (int face = 0; face < 6; ++face) {
+            const int axis = face / 2;
+            const bool maxSide = face % 2 == 1;
+            const float plane = maxSide ? cellMax[axis] : cellMin[axis];
+            if (plane == (maxSide ? rootCellMax[axis] : rootCellMin[axis])) continue;
+            const int across = face ^ 1; // the face of the nodes behind it that lies on the plane
+
+            vector<int> pending(1, 0);
+            while (!pending.empty()) {
+                int i = pending.back();
+                pending.pop_back();
+                const GPURopeNode& rope = ropeTree[i];
+                bool overlaps = true;
+                for (int other = 0; other < 3; ++other) {
+                    if (other == axis) continue;
+                    overlaps = overlaps && rope.cellMin[other] < cellMax[other] && rope.cellMax[other] > cellMin[other];
+                }
+                if (!overlaps) continue;
+                const float nearSide = maxSide ? rope.cellMin[axis] : rope.cellMax[axis];
+                const float farSide = maxSide ? rope.cellMax[axis] : rope.cellMin[axis];
+                if (maxSide ? farSide <= plane : farSide >= plane) continue; // on the side of node
+                if (nearSide == plane) {
+                    // right across: its rope on this face may lead into node
+                    const int parent = nodeParents[i];
+                    const GPUOctreeNode& parentNode = flattenedTree[parent];
+                    int octant = 0;
+                    while (!(parentNode.childMask & (1u << octant)) || childIndex(parentNode.childrenOffset, parentNode.childMask, octant) != i) octant++;
+                    ropeTree[i].ropes[across] = childRope(parent, octant, across, glm::vec3(rope.cellMin), glm::vec3(rope.cellMax));
+                } else if (maxSide ? nearSide > plane : nearSide < plane) {
+                    continue; // beyond, not touching
+                }
+                for (int j = 0; j < __builtin_popcount(flattenedTree[i].childMask); ++j) pending.push_back(flattenedTree[i].childrenOffset + j);
+            }
+        }
+    }
+}
@@ -0,0 +1,577 @@
+#include "octree.h"
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+/**
+ * Incremental updates of the flattened tree.
+ *
+ * The cell of a node is not stored, it is found on the way down from the root cell and the split points, the same
+ * cells the build used. Children of a node stay contiguous, so adding one moves the whole block to the end of the node buffers.
+ * A leaf left empty keeps its place, a sphere moving back into it then costs no new block, until its parent is merged. Object lists get twice the slots they need when they move, so a sphere
+ * moving within a leaf or between neighbouring leaves mostly rewrites a few slots in place.
+ * Every write goes through writeNode or markDirty, so dirtyNodes and dirtyIndices list exactly what to upload again, and
+ * staleNodes what refitOrRebuild has to redo the costs and compact nodes of.
+ */
+
+// Forget the update state of the previous tree, called whenever a new tree is built or loaded
+void Octree::resetUpdates() {
+    objectCapacity.clear();
+    unusedNodes = 0;
+    unusedIndices = 0;
+    clearDirtyRanges();
+    nodeParents.clear();
+    nodeCosts.clear();
+    staleNodes.clear();
+    reshapedNodes.clear();
+    compactBoxMin.clear();
+    compactBoxMax.clear();
+}
+
+// keepDerivedData is for refitOrRebuild, which brings compactTree and ropeTree up to date after its updates
+void Octree::prepareUpdates(bool keepDerivedData) {
+    if (flattenedTree.empty()) {
+        throw std::logic_error("The octree must be built before it can be updated");
+    }
+    if (objectCapacity.size() != flattenedTree.size()) {
+        objectCapacity.resize(flattenedTree.size());
+        for (size_t i = 0; i < flattenedTree.size(); ++i) {
+            objectCapacity[i] = flattenedTree[i].objectCount;
+        }
+    }
+    if (keepDerivedData) return;
+    compactTree.clear();
+    ropeTree.clear();
+}
+
+// Leaves above this many spheres are split, autoTune trees keep the largest leaf the cost model chose
+int Octree::leafLimit() const {
+    return autoTune ? std::max(maxLeafSize, 1) : maxSpheresPerNode;
+}
+
+bool Octree::fitsRootCell(const Sphere& sphere) const {
+    return glm::all(glm::greaterThanEqual(sphere.center - glm::vec3(sphere.radius), rootCellMin)) &&
+           glm::all(glm::lessThanEqual(sphere.center + glm::vec3(sphere.radius), rootCellMax));
+}
+
+// Box of a node of the cell [cellMin, cellMax] before tightBounds: the cell, or its loose box
+void Octree::fullBox(const glm::vec3& cellMin, const glm::vec3& cellMax, glm::vec3& boxMin, glm::vec3& boxMax) const {
+    boxMin = cellMin;
+    boxMax = cellMax;
+    if (isLoose()) {
+        glm::vec3 margin = (cellMax - cellMin) * ((LOOSE_OCTREE_FACTOR - 1.0f) * 0.5f);
+        boxMin -= margin;
+        boxMax += margin;
+    }
+}
+
+// A node with no children and no objects for the cell [cellMin, cellMax]
+GPUOctreeNode Octree::emptyNode(const glm::vec3& cellMin, const glm::vec3& cellMax) const {
+    GPUOctreeNode node;
+    fullBox(cellMin, cellMax, node.min, node.max);
+    if (tightBounds) { // grows with every sphere added
+        std::swap(node.min, node.max);
+    }
+    node.split = (cellMin + cellMax) * 0.5f;
+    node.childrenOffset = -1;
+    node.objectsOffset = -1;
+    node.objectCount = 0;
+    node.childMask = 0;
+    return node;
+}
+
+void Octree::markDirty(vector<DirtyRange>& ranges, size_t begin, size_t end) {
+    if (!ranges.empty() && begin <= ranges.back().end && end >= ranges.back().begin) {
+        ranges.back().begin = std::min(ranges.back().begin, begin);
+        ranges.back().end = std::max(ranges.back().end, end);
+        return;
+    }
+    ranges.push_back({begin, end});
+}
+
+void Octree::clearDirtyRanges() {
+    dirtyNodes.clear();
+    dirtyIndices.clear();
+    dirtySpheres.clear();
+}
+
+vector<DirtyRange> Octree::mergeRanges(vector<DirtyRange> ranges, size_t maxGap) {
+    std::sort(ranges.begin(), ranges.end(), [](const DirtyRange& a, const DirtyRange& b) { return a.begin < b.begin; });
+    vector<DirtyRange> merged;
+    for (const DirtyRange& range : ranges) {
+        if (!merged.empty() && range.begin <= merged.back().end + maxGap) {
+            merged.back().end = std::max(merged.back().end, range.end);
+        } else {
+            merged.push_back(range);
+        }
+    }
+    return merged;
+}
+
+void Octree::writeNode(size_t index, const GPUOctreeNode& node) {
+    const GPUOctreeNode& old = flattenedTree[index];
+    if (!ropeTree.empty() && (node.childMask != old.childMask || (node.childMask != 0 && node.childrenOffset != old.childrenOffset))) {
+        reshapedNodes.push_back(static_cast<int>(index));
+    }
+    if (!nodeParents.empty()) {
+        referenceCount = referenceCount - old.objectCount + node.objectCount;
+        for (int i = 0; i < __builtin_popcount(node.childMask); ++i) nodeParents[node.childrenOffset + i] = static_cast<int>(index);
+        markDirty(staleNodes, index, index + 1);
+    }
+    setGPUNode(index, node);
+    markDirty(dirtyNodes, index, index + 1);
+}
+
+// Turn a node nothing points to anymore into an empty one, so no stale child offsets are left in the buffers
+void Octree::releaseNode(size_t index) {
+    unusedNodes++;
+    unusedIndices += objectCapacity[index];
+    objectCapacity[index] = 0;
+    GPUOctreeNode node = emptyNode(glm::vec3(0.0f), glm::vec3(0.0f));
+    node.min = glm::vec3(1.0f); // an inverted box no ray hits
+    writeNode(index, node);
+    if (!nodeParents.empty()) nodeParents[index] = -1;
+}
+
+// Room for count more nodes at the end, returns the index of the first
+int Octree::appendNodes(int count) {
+    size_t first = flattenedTree.size();
+    toOffset(first + count, "Node");
+    resizeGPUData(first + count);
+    objectCapacity.resize(first + count, 0);
+    if (!nodeParents.empty()) {
+        nodeParents.resize(first + count, -1);
+        nodeCosts.resize(first + count, 0.0);
+    }
+    if (!compactTree.empty()) {
+        compactTree.resize(first + count, GPUCompactNode());
+        compactBoxMin.resize(first + count, glm::vec3(0.0f));
+        compactBoxMax.resize(first + count, glm::vec3(0.0f));
+    }
+    return static_cast<int>(first);
+}
+
+/**
+ * @brief Give node a child in octant, which must be empty. The children block moves to the end to make room.
+ * @return The index of the new child.
+ */
+int Octree::addChild(int node, int octant, const GPUOctreeNode& child) {
+    GPUOctreeNode parent = flattenedTree[node];
+    int count = __builtin_popcount(parent.childMask);
+    int offset = appendNodes(count + 1);
+
+    unsigned int childMask = parent.childMask | (1u << octant);
+    int result = -1;
+    for (int i = 0, old = 0; i < 8; ++i) {
+        if (!(childMask & (1u << i))) continue;
+        int target = childIndex(offset, childMask, i);
+        if (i == octant) {
+            writeNode(target, child);
+            result = target;
+        } else {
+            int source = parent.childrenOffset + old++;
+            writeNode(target, flattenedTree[source]);
+            objectCapacity[target] = objectCapacity[source];
+            objectCapacity[source] = 0; // the list moved with the node
+            releaseNode(source);
+        }
+    }
+
+    parent.childrenOffset = offset;
+    parent.childMask = childMask;
+    writeNode(node, parent);
+    return result;
+}
+
+// Append sphere to the list of node, moving the list to the end of objectIndices if it is full
+void Octree::addObject(int node, int sphere) {
+    GPUOctreeNode target = flattenedTree[node];
+    if (target.objectCount == objectCapacity[node]) {
+        int capacity = std::max(4, 2 * objectCapacity[node]);
+        size_t offset = objectIndices.size();
+        objectIndices.resize(offset + capacity, -1);
+        if (target.objectCount > 0) {
+            std::copy(objectIndices.begin() + target.objectsOffset, objectIndices.begin() + target.objectsOffset + target.objectCount,
+                      objectIndices.begin() + offset);
+        }
+        unusedIndices += objectCapacity[node];
+        objectCapacity[node] = capacity;
+        target.objectsOffset = toOffset(offset, "Object index");
+        writeIndices(offset, offset + target.objectCount);
+    }
+
+    size_t slot = target.objectsOffset + target.objectCount;
+    objectIndices[slot] = sphere;
+    writeIndices(slot, slot + 1);
+    target.objectCount++;
+    writeNode(node, target);
+}
+
+// With tightBounds, grow the box of node to the part of the sphere inside its full box (see fullBox), as tightenBounds clips it
+void Octree::growBox(int node, const Sphere& sphere, const glm::vec3& cellMin, const glm::vec3& cellMax) {
+    if (!tightBounds) return;
+    glm::vec3 boxMin, boxMax;
+    fullBox(cellMin, cellMax, boxMin, boxMax);
+    GPUOctreeNode target = flattenedTree[node];
+    target.min = glm::min(target.min, glm::max(sphere.center - glm::vec3(sphere.radius), boxMin));
+    target.max = glm::max(target.max, glm::min(sphere.center + glm::vec3(sphere.radius), boxMax));
+    writeNode(node, target);
+}
+
+// With tightBounds, shrink the box of node back to its spheres (clipped to its full box) and children once a sphere left it
+void Octree::refitBox(const vector<Sphere>& spheres, int node, const glm::vec3& cellMin, const glm::vec3& cellMax) {
+    if (!tightBounds) return;
+    glm::vec3 boxMin, boxMax;
+    fullBox(cellMin, cellMax, boxMin, boxMax);
+    GPUOctreeNode target = flattenedTree[node];
+    glm::vec3 newMin = boxMax, newMax = boxMin; // inverted when nothing is left, as in emptyNode
+
+    for (int i = 0; i < target.objectCount; ++i) {
+        const Sphere& sphere = spheres[objectIndices[target.objectsOffset + i]];
+        newMin = glm::min(newMin, glm::max(sphere.center - glm::vec3(sphere.radius), boxMin));
+        newMax = glm::max(newMax, glm::min(sphere.center + glm::vec3(sphere.radius), boxMax));
+    }
+    for (int i = 0; i < __builtin_popcount(target.childMask); ++i) {
+        const GPUOctreeNode& child = flattenedTree[target.childrenOffset + i];
+        if (glm::any(glm::greaterThan(child.min, child.max))) continue; // an emptied leaf
+        newMin = glm::min(newMin, child.min);
+        newMax = glm::max(newMax, child.max);
+    }
+
+    if (newMin == target.min && newMax == target.max) return;
+    target.min = newMin;
+    target.max = newMax;
+    writeNode(node, target);
+}
+
+// Take sphere out of the list of node, the last one fills its slot
+bool Octree::removeObject(int node, int sphere) {
+    GPUOctreeNode target = flattenedTree[node];
+    int* begin = objectIndices.data() + target.objectsOffset;
+    int* end = begin + target.objectCount;
+    int* found = std::find(begin, end, sphere);
+    if (target.objectCount == 0 || found == end) return false;
+
+    *found = *(end - 1);
+    writeIndices(found - objectIndices.data(), found - objectIndices.data() + 1);
+    target.objectCount--;
+    writeNode(node, target);
+    return true;
+}
+
+void Octree::insertReference(const vector<Sphere>& spheres, int sphere, int node, const glm::vec3& cellMin, const glm::vec3& cellMax, int depth) {
+    const Sphere& data = spheres[sphere];
+    const GPUOctreeNode current = flattenedTree[node];
+
+    if (isLoose()) {
+        // down to the child holding the center while the sphere fits in its loose box, as distributeLooseSpheres does
+        glm::vec3 childSize = (cellMax - cellMin) * 0.5f;
+        float fitRadius = std::min(childSize.x, std::min(childSize.y, childSize.z)) * (LOOSE_OCTREE_FACTOR - 1.0f) * 0.5f;
+        if (current.childMask != 0 && depth < maxDepth && data.radius <= fitRadius) {
+            int octant = (data.center.z >= current.split.z) << 2 | (data.center.x >= current.split.x) << 1 | (data.center.y >= current.split.y);
+            glm::vec3 childMin, childMax;
+            octantBounds(octant, cellMin, cellMax, current.split, childMin, childMax);
+            int child = current.childMask & (1u << octant) ? childIndex(current.childrenOffset, current.childMask, octant)
+                                                            : addChild(node, octant, emptyNode(childMin, childMax));
+            insertReference(spheres, sphere, child, childMin, childMax, depth + 1);
+            growToChild(node, child);
+            return;
+        }
+        addObject(node, sphere);
+        growBox(node, data, cellMin, cellMax);
+        if (flattenedTree[node].objectCount > leafLimit() && depth < maxDepth) splitNode(spheres, node, cellMin, cellMax, depth);
+        return;
+    }
+
+    if (current.childMask == 0) {
+        addObject(node, sphere);
+        growBox(node, data, cellMin, cellMax);
+        if (flattenedTree[node].objectCount > leafLimit() && depth < maxDepth) splitNode(spheres, node, cellMin, cellMax, depth);
+        return;
+    }
+
+    for (int octant = 0; octant < 8; ++octant) {
+        glm::vec3 childMin, childMax;
+        octantBounds(octant, cellMin, cellMax, current.split, childMin, childMax);
+        if (!sphereIntersectsBox(data, childMin, childMax)) continue;
+
+        const GPUOctreeNode parent = flattenedTree[node];
+        int child = parent.childMask & (1u << octant) ? childIndex(parent.childrenOffset, parent.childMask, octant)
+                                                       : addChild(node, octant, emptyNode(childMin, childMax));
+        insertReference(spheres, sphere, child, childMin, childMax, depth + 1);
+        growToChild(node, child);
+    }
+}
+
+// With tightBounds, grow the box of node to hold the box of its child
+void Octree::growToChild(int node, int child) {
+    if (!tightBounds) return;
+    GPUOctreeNode grown = flattenedTree[node];
+    glm::vec3 newMin = glm::min(grown.min, flattenedTree[child].min);
+    glm::vec3 newMax = glm::max(grown.max, flattenedTree[child].max);
+    if (newMin != grown.min || newMax != grown.max) {
+        grown.min = newMin;
+        grown.max = newMax;
+        writeNode(node, grown);
+    }
+}
+
+/**
+ * Removes every reference to sphere below node, then merges the children back into node
+ * once they are all leaves holding at most half the leaf limit between them, and refits the boxes it left.
+ * @return true if a reference was found.
+ */
+bool Octree::removeReference(const vector<Sphere>& spheres, int sphere, int node, const glm::vec3& cellMin, const glm::vec3& cellMax) {
+    const Sphere& data = spheres[sphere];
+    bool found = removeObject(node, sphere);
+    // the Morton build also references the cells a sphere is only near, twice that covers the rounding of the boxes
+    const float slack = buildMode == MortonBuild ? 2.0f * mortonCellSlack(rootCellMin, rootCellMax) : 0.0f;
+
+    for (int octant = 0; octant < 8; ++octant) {
+        const GPUOctreeNode current = flattenedTree[node];
+        if (!(current.childMask & (1u << octant))) continue;
+
+        glm::vec3 childMin, childMax;
+        octantBounds(octant, cellMin, cellMax, current.split, childMin, childMax);
+        if (isLoose()) {
+            if (found) break; // a loose octree stores a sphere once
+            int centerOctant = (data.center.z >= current.split.z) << 2 | (data.center.x >= current.split.x) << 1 | (data.center.y >= current.split.y);
+            if (octant != centerOctant) continue;
+        } else if (!sphereIntersectsBox(data, childMin - slack, childMax + slack)) {
+            continue;
+        }
+
+        int child = childIndex(current.childrenOffset, current.childMask, octant);
+        if (!removeReference(spheres, sphere, child, childMin, childMax)) continue;
+        found = true;
+    }
+
+    if (found) {
+        mergeChildren(node);
+        refitBox(spheres, node, cellMin, cellMax);
+    }
+    return found;
+}
+
+/**
+ * Split node, whose cell is [cellMin, cellMax], the way the build would have: every sphere goes to the children its cell
+ * intersects (in a loose octree, the fitting ones go to the child holding their center). Children over the limit are split too.
+ */
+void Octree::splitNode(const vector<Sphere>& spheres, int node, const glm::vec3& cellMin, const glm::vec3& cellMax, int depth) {
+    GPUOctreeNode current = flattenedTree[node];
+    if (current.childMask != 0) return;
+
+    glm::vec3 childMin[8], childMax[8];
+    for (int octant = 0; octant < 8; ++octant) {
+        octantBounds(octant, cellMin, cellMax, current.split, childMin[octant], childMax[octant]);
+    }
+    glm::vec3 childSize = (cellMax - cellMin) * 0.5f;
+    float fitRadius = std::min(childSize.x, std::min(childSize.y, childSize.z)) * (LOOSE_OCTREE_FACTOR - 1.0f) * 0.5f;
+
+    vector<int> objects(objectIndices.begin() + current.objectsOffset, objectIndices.begin() + current.objectsOffset + current.objectCount);
+    vector<int> childObjects[8];
+    vector<int> kept;
+    for (int sphere : objects) {
+        const Sphere& data = spheres[sphere];
+        if (isLoose()) {
+            if (data.radius > fitRadius) {
+                kept.push_back(sphere);
+                continue;
+            }
+            childObjects[(data.center.z >= current.split.z) << 2 | (data.center.x >= current.split.x) << 1 | (data.center.y >= current.split.y)].push_back(sphere);
+            continue;
+        }
+        for (int octant = 0; octant < 8; ++octant) {
+            if (sphereIntersectsBox(data, childMin[octant], childMax[octant])) childObjects[octant].push_back(sphere);
+        }
+    }
+
+    unsigned int childMask = 0;
+    for (int octant = 0; octant < 8; ++octant) {
+        if (!childObjects[octant].empty()) childMask |= 1u << octant;
+    }
+    if (childMask == 0) return; // nothing fits any child
+
+    int offset = appendNodes(__builtin_popcount(childMask));
+    for (int octant = 0; octant < 8; ++octant) {
+        if (!(childMask & (1u << octant))) continue;
+        int child = childIndex(offset, childMask, octant);
+        writeNode(child, emptyNode(childMin[octant], childMax[octant]));
+        for (int sphere : childObjects[octant]) {
+            addObject(child, sphere);
+            growBox(child, spheres[sphere], childMin[octant], childMax[octant]);
+        }
+    }
+
+    // the spheres staying here (loose only) are rewritten in place, the list only shrinks
+    current = flattenedTree[node];
+    std::copy(kept.begin(), kept.end(), objectIndices.begin() + current.objectsOffset);
+    if (!kept.empty()) writeIndices(current.objectsOffset, current.objectsOffset + kept.size());
+    current.objectCount = static_cast<int>(kept.size());
+    current.childrenOffset = offset;
+    current.childMask = childMask;
+    writeNode(node, current);
+
+    for (int octant = 0; octant < 8; ++octant) {
+        if (!(childMask & (1u << octant))) continue;
+        int child = childIndex(offset, childMask, octant);
+        if (flattenedTree[child].objectCount > leafLimit() && depth + 1 < maxDepth) {
+            splitNode(spheres, child, childMin[octant], childMax[octant], depth + 1);
+        }
+    }
+}
+
+// Fold the children of node back into it if they are all leaves with at most half the leaf limit of distinct spheres
+void Octree::mergeChildren(int node) {
+    const GPUOctreeNode current = flattenedTree[node];
+    if (current.childMask == 0) return;
+
+    vector<int> objects(objectIndices.begin() + current.objectsOffset, objectIndices.begin() + current.objectsOffset + current.objectCount);
+    for (int octant = 0; octant < 8; ++octant) {
+        if (!(current.childMask & (1u << octant))) continue;
+        const GPUOctreeNode& child = flattenedTree[childIndex(current.childrenOffset, current.childMask, octant)];
+        if (child.childMask != 0) return;
+        objects.insert(objects.end(), objectIndices.begin() + child.objectsOffset, objectIndices.begin() + child.objectsOffset + child.objectCount);
+    }
+    std::sort(objects.begin(), objects.end());
+    objects.erase(std::unique(objects.begin(), objects.end()), objects.end());
+    if (static_cast<int>(objects.size()) > leafLimit() / 2) return;
+
+    for (int octant = 0; octant < 8; ++octant) {
+        if (current.childMask & (1u << octant)) releaseNode(childIndex(current.childrenOffset, current.childMask, octant));
+    }
+
+    GPUOctreeNode merged = current;
+    merged.childrenOffset = -1;
+    merged.childMask = 0;
+    merged.objectCount = 0;
+    writeNode(node, merged);
+    // the node box already holds its children's
+    for (int sphere : objects) {
+        addObject(node, sphere);
+    }
+}
+
+int Octree::insert(vector<Sphere>& spheres, const Sphere& sphere) {
+    prepareUpdates();
+    if (!fitsRootCell(sphere)) return -1;
+
+    int index = static_cast<int>(spheres.size());
+    spheres.push_back(sphere);
+    if (objectIndexBits(spheres.size()) != indexBits) {
+        // past 65536 spheres, every index is widened to 32 bit
+        indexBits = objectIndexBits(spheres.size());
+        packObjectIndices(0, objectIndices.size());
+        markDirty(dirtyIndices, 0, objectIndices.size());
+    }
+    markDirty(dirtySpheres, index, index + 1);
+    insertReference(spheres, index, 0, rootCellMin, rootCellMax, 0);
+    return index;
+}
+
+bool Octree::remove(const vector<Sphere>& spheres, int index) {
+    prepareUpdates();
+    if (index < 0 || index >= static_cast<int>(spheres.size())) {
+        throw std::out_of_range("Sphere index " + std::to_string(index) + " is out of range");
+    }
+    return removeReference(spheres, index, 0, rootCellMin, rootCellMax);
+}
+
+bool Octree::update(vector<Sphere>& spheres, int index, const glm::vec3& newCenter) {
+    prepareUpdates();
+    return moveSphere(spheres, index, newCenter);
+}
+
+bool Octree::moveSphere(vector<Sphere>& spheres, int index, const glm::vec3& newCenter) {
+    if (index < 0 || index >= static_cast<int>(spheres.size())) {
+        throw std::out_of_range("Sphere index " + std::to_string(index) + " is out of range");
+    }
+    Sphere moved = spheres[index];
+    moved.center = newCenter;
+    if (!fitsRootCell(moved)) return false;
+
+    removeReference(spheres, index, 0, rootCellMin, rootCellMax);
+    spheres[index].center = newCenter;
+    markDirty(dirtySpheres, index, index + 1);
+    insertReference(spheres, index, 0, rootCellMin, rootCellMax, 0);
+    return true;
+}
+
+bool Octree::refitOrRebuild(vector<Sphere>& spheres, const vector<int>& moved, const vector<glm::vec3>& centers, double maxGrowth, float rootMargin) {
+    const auto start{std::chrono::steady_clock::now()};
+    if (moved.size() != centers.size()) {
+        throw std::invalid_argument("Every moved sphere needs a new center");
+    }
+    bool compact = !compactTree.empty();
+    bool ropes = !ropeTree.empty();
+    prepareUpdates(true);
+    // once after a relayout or a cache load, from then on only the nodes the updates write are redone
+    if (nodeParents.size() != flattenedTree.size()) computeCostStats(false);
+    if (compact && compactBoxMin.size() != compactTree.size()) setCompactData();
+
+    bool rebuild = false;
+    for (size_t i = 0; i < moved.size() && !rebuild; ++i) {
+        rebuild = !moveSphere(spheres, moved[i], centers[i]);
+    }
+
+    if (!rebuild && !moved.empty()) {
+        refreshStaleNodes(compact);
+        duplicationFactor = double(referenceCount) / spheres.size();
+        rebuild = predictedCost > builtCost * (1.0 + maxGrowth) || duplicationFactor > builtDuplication * (1.0 + maxGrowth);
+    }
+
+    if (rebuild) {
+        // the spheres not updated yet are placed by the build
+        for (size_t i = 0; i < moved.size(); ++i) {
+            spheres[moved[i]].center = centers[i];
+        }
+        this->rootMargin = rootMargin;
+        build(spheres);
+        rebuildCount++;
+        markDirty(dirtyNodes, 0, flattenedTree.size());
+        markDirty(dirtyIndices, 0, objectIndices.size());
+        markDirty(dirtySpheres, 0, spheres.size());
+        if (compact) setCompactData();
+        if (ropes) setRopeData();
+    } else if (ropes && !reshapedNodes.empty()) {
+        updateRopes();
+    }
+
+    const std::chrono::duration<double> elapsed_seconds{std::chrono::steady_clock::now() - start};
+    updateTime = elapsed_seconds.count();
+    return rebuild;
+}
+
+/**
+ * Redoes nodeCosts, predictedCost and, if compact, compactTree for the nodes written since they were last brought up to
+ * date and every node above them, top-down for the compact boxes and bottom-up for the costs. Below a compact node whose
+ * decoded box moved, the children are redone too, their boxes are quantized against it.
+ */
+void Octree::refreshStaleNodes(bool compact) {
+    vector<char> stale(flattenedTree.size(), 0);
+    for (const DirtyRange& range : staleNodes) {
+        for (size_t i = range.begin; i < range.end; ++i) {
+            for (int node = static_cast<int>(i); node != -1 && !stale[node]; node = nodeParents[node]) stale[node] = 1;
+        }
+    }
+    staleNodes.clear();
+    if (!stale[0]) return; // only released nodes were written
+
+    if (compact) {
+        compactBoxMin[0] = flattenedTree[0].min;
+        compactBoxMax[0] = flattenedTree[0].max;
+    }
+    refreshNode(0, stale, compact);
+    predictedCost = BOX_TEST_COST + nodeCosts[0];
+}
+
+void Octree::refreshNode(int index, const vector<char>& stale, bool compact) {
+    const unsigned int movedBoxes = compact ? setCompactNode(index) : 0u;
+    const GPUOctreeNode& node = flattenedTree[index];
+    for (int octant = 0; octant < 8; ++octant) {
+        if (!(node.childMask & (1u << octant))) continue;
+        int child = childIndex(node.childrenOffset, node.childMask, octant);
+        if (stale[child] || (movedBoxes & (1u << octant))) refreshNode(child, stale, compact);
+    }
+    nodeCosts[index] = nodeCost(index);
+}
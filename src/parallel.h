@@ -0,0 +1,34 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <vector>
+
+// Below this many items a loop or subtree is not worth handing to another thread
+const size_t PARALLEL_BUILD_GRAIN = 4096;
+
+/**
+ * Splits [0, count) in contiguous chunks, one per thread (at most numThreads, at least PARALLEL_BUILD_GRAIN items each),
+ * and runs fn(chunk, begin, end) on all of them. Chunks are numbered in order so results can be merged deterministically,
+ * and the same count and numThreads always give the same chunks.
+ * @return The number of chunks used.
+ */
+inline int parallelFor(size_t count, int numThreads, const std::function<void(int, size_t, size_t)>& fn) {
+    int numChunks = static_cast<int>(std::max<size_t>(1, std::min<size_t>(numThreads, count / PARALLEL_BUILD_GRAIN)));
+
+    std::vector<std::thread> workers;
+    for (int chunk = 1; chunk < numChunks; ++chunk) {
+        workers.emplace_back(fn, chunk, count * chunk / numChunks, count * (chunk + 1) / numChunks);
+    }
+    fn(0, 0, count / numChunks);
+
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    return numChunks;
+}
+
+#endif // PARALLEL_H
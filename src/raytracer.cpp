@@ -1,8 +1,9 @@
 #include "raytracer.h"
 #include "config.h"
+#include "scene.h"
+#include "statsrow.h"
 #include <iostream>
 #include <chrono>
-#include <random>
 #include <fstream>
 #include <thread>
 
@@ -17,10 +18,12 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 void processInput(GLFWwindow *window);
 
 Raytracer::Raytracer() 
-    : width(SCR_WIDTH), height(SCR_HEIGHT), window(nullptr),
+    : window(nullptr), width(SCR_WIDTH), height(SCR_HEIGHT),
+    raytracingQuad(nullptr), shader(nullptr),
     spheresSSBO(0), sphereDataSSBO(0), sphereData2SSBO(0),
-    octreeNodesSSBO(0), octreeNodes2SSBO(0), octreeCountsSSBO(0), objectIndicesSSBO(0),
-    raytracingQuad(nullptr), shader(nullptr), frameCount(0), statsFilename(OUTPUTFILE) {
+    octreeNodesSSBO(0), octreeNodes2SSBO(0), octreeCountsSSBO(0), objectIndicesSSBO(0), octreeCompactSSBO(0), octreeSplitsSSBO(0), octreeRopesSSBO(0),
+    sphereBufferCapacity(0), nodeBufferCapacity(0), indexBufferCapacity(0),
+    statsFilename(OUTPUTFILE), frameCount(0) {
 }
 
 Raytracer::~Raytracer() {
@@ -60,86 +63,125 @@ void Raytracer::setupShader(){
 }
 
 void Raytracer::setupScene(){
-    spheres = generateSpheres();
-
     int maxDepth = DEBUG ? DEBUGDEPTH : MAXDEPTH;
     int maxSpheresPerNode = DEBUG ? DEBUGSPHERESPERNODE : MAXSPHERESPERNODE;
 
-    octree = Octree(maxDepth, maxSpheresPerNode);
+    octree = Octree(maxDepth, maxSpheresPerNode, BUILDTHREADS, static_cast<OctreeBuildMode>(BUILDMODE), TIGHTBOUNDS, AUTOTUNE, static_cast<NodeLayout>(NODELAYOUT));
+
+    uint64_t cacheKey = 0;
+    if (USESCENECACHE) {
+        const auto start{std::chrono::steady_clock::now()};
+        cacheKey = sceneCacheKey(maxDepth, maxSpheresPerNode, static_cast<OctreeBuildMode>(BUILDMODE), TIGHTBOUNDS, AUTOTUNE, static_cast<NodeLayout>(NODELAYOUT), COMPACTNODES);
+        if (sceneCache.open(sceneCacheFilename(cacheKey), cacheKey, octree.isLoose())) {
+            const std::chrono::duration<double> elapsed_seconds{std::chrono::steady_clock::now() - start};
+            cout << "Scene cache hit: " << sceneCacheFilename(cacheKey) << " mapped in " << elapsed_seconds.count() << "s ("
+                 << sceneCache.header().sphereCount << " spheres, " << sceneCache.header().nodeCount << " nodes)" << std::endl;
+            if (ANIMATESPHERES > 0) {
+                // the buffers still come from the mapping, the copies are what the animation updates
+                spheres = sceneCache.loadSpheres();
+                sceneCache.loadOctree(octree);
+            } else if (USEROPES) {
+                sceneCache.loadOctree(octree); // ropes are not cached, they are built from the nodes
+            }
+            if (USEROPES) octree.setRopeData();
+            return;
+        }
+    }
+
+    spheres = generateSpheres();
     octree.build(spheres, DEBUG);
+    if (COMPACTNODES) octree.setCompactData();
+    if (USEROPES) octree.setRopeData();
 
     if (DEBUG) octree.printFlattenedTree();
+
+    if (USESCENECACHE) SceneCache::save(sceneCacheFilename(cacheKey), cacheKey, spheres, octree);
 }
 
 void Raytracer::setupBuffers() {
-    std::vector<glm::vec4> sphereCentersAndRadii;      // center.xyz, radius
-    std::vector<glm::vec4> sphereMaterialsAndAlbedo;   // materialType, albedo.xyz
-    std::vector<glm::vec4> sphereFuzzAndRI;           // fuzz, refractionIndex, 0, 0
-
-    std::vector<glm::vec4> octreeMinAndChildren;      // min.xyz, childrenOffset
-    std::vector<glm::vec4> octreeMaxAndObjects;       // max.xyz, objectsOffset
-    std::vector<int> octreeObjectCounts;              // objectCount
-
-    sphereCentersAndRadii.reserve(spheres.size());
-    sphereMaterialsAndAlbedo.reserve(spheres.size());
-    sphereFuzzAndRI.reserve(spheres.size());
-
-    for (const Sphere& sphere : spheres) {
-        sphereCentersAndRadii.push_back(glm::vec4(sphere.center, sphere.radius));
-        sphereMaterialsAndAlbedo.push_back(glm::vec4(float(sphere.materialType), sphere.albedo.x, sphere.albedo.y, sphere.albedo.z));
-        sphereFuzzAndRI.push_back(glm::vec4(sphere.fuzz, sphere.refractionIndex, 0.0f, 0.0f));
-    }
-
-    octreeMinAndChildren.reserve(octree.flattenedTree.size());
-    octreeMaxAndObjects.reserve(octree.flattenedTree.size());
-    octreeObjectCounts.reserve(octree.flattenedTree.size());
-
-    for (const GPUOctreeNode& node : octree.flattenedTree) {
-        octreeMinAndChildren.push_back(glm::vec4(node.min, node.childrenOffset));
-        octreeMaxAndObjects.push_back(glm::vec4(node.max, node.objectsOffset));
-        octreeObjectCounts.push_back(node.objectCount);
+    // Uploaded straight from the mapped file on a cache hit, otherwise from the spheres and the octree just built
+    GPUSphereArrays sphereArrays;
+    GPUSceneView scene;
+    if (sceneCache.isOpen()) {
+        scene = sceneCache.view();
+    } else {
+        sphereArrays = packSpheres(spheres);
+        scene = makeSceneView(sphereArrays, octree);
     }
 
-
     glGenBuffers(1, &spheresSSBO);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, spheresSSBO);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, sphereCentersAndRadii.size() * sizeof(glm::vec4), sphereCentersAndRadii.data(), GL_STATIC_DRAW);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, scene.sphereCount * sizeof(glm::vec4), scene.sphereCentersAndRadii, GL_STATIC_DRAW);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, spheresSSBO);
 
     glGenBuffers(1, &sphereDataSSBO);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphereDataSSBO);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, sphereMaterialsAndAlbedo.size() * sizeof(glm::vec4), sphereMaterialsAndAlbedo.data(), GL_STATIC_DRAW);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, scene.sphereCount * sizeof(glm::vec4), scene.sphereMaterialsAndAlbedo, GL_STATIC_DRAW);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, sphereDataSSBO);
 
     glGenBuffers(1, &sphereData2SSBO);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphereData2SSBO);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, sphereFuzzAndRI.size() * sizeof(glm::vec4), sphereFuzzAndRI.data(), GL_STATIC_DRAW);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, scene.sphereCount * sizeof(glm::vec4), scene.sphereFuzzAndRI, GL_STATIC_DRAW);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, sphereData2SSBO);
 
     glGenBuffers(1, &octreeNodesSSBO);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, octreeNodesSSBO);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, octreeMinAndChildren.size() * sizeof(glm::vec4), octreeMinAndChildren.data(), GL_STATIC_DRAW);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, scene.nodeCount * sizeof(GPUNodeCorner), scene.minAndChildren, GL_STATIC_DRAW);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, octreeNodesSSBO);
 
     glGenBuffers(1, &octreeNodes2SSBO);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, octreeNodes2SSBO);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, octreeMaxAndObjects.size() * sizeof(glm::vec4), octreeMaxAndObjects.data(), GL_STATIC_DRAW);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, scene.nodeCount * sizeof(GPUNodeCorner), scene.maxAndObjects, GL_STATIC_DRAW);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, octreeNodes2SSBO);
 
     glGenBuffers(1, &octreeCountsSSBO);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, octreeCountsSSBO);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, octreeObjectCounts.size() * sizeof(int), octreeObjectCounts.data(), GL_STATIC_DRAW);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, scene.nodeCount * sizeof(unsigned int), scene.objectCounts, GL_STATIC_DRAW);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, octreeCountsSSBO);
 
     glGenBuffers(1, &objectIndicesSSBO);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, objectIndicesSSBO);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, octree.objectIndices.size() * sizeof(int), octree.objectIndices.data(), GL_STATIC_DRAW);
+    const size_t indexWords = packedIndexWords(scene.indexCount, scene.indexBits);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, indexWords * sizeof(uint32_t), scene.objectIndices, GL_STATIC_DRAW);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, objectIndicesSSBO);
 
+    glGenBuffers(1, &octreeSplitsSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, octreeSplitsSSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, scene.nodeCount * sizeof(glm::vec4), scene.splits, GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, octreeSplitsSSBO);
+
+    if (COMPACTNODES) {
+        glGenBuffers(1, &octreeCompactSSBO);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, octreeCompactSSBO);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, scene.compactCount * sizeof(GPUCompactNode), scene.compactTree, GL_STATIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, octreeCompactSSBO);
+    }
+
+    if (USEROPES) {
+        glGenBuffers(1, &octreeRopesSSBO);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, octreeRopesSSBO);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, octree.ropeTree.size() * sizeof(GPURopeNode), octree.ropeTree.data(), GL_STATIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, octreeRopesSSBO);
+    }
+
+    sphereBufferCapacity = scene.sphereCount;
+    nodeBufferCapacity = scene.nodeCount;
+    indexBufferCapacity = indexWords;
+
     shader->use();
     shader->setInt("useOctree", USEOCTREE);
-    shader->setInt("octreeNodeCount", octree.flattenedTree.size());
-    shader->setInt("sphereCount", spheres.size());
+    shader->setInt("octreeNodeCount", scene.nodeCount);
+    shader->setInt("useCompactNodes", COMPACTNODES);
+    shader->setInt("useRopes", USEROPES);
+    shader->setInt("mailboxSize", MAILBOXSIZE);
+    shader->setInt("looseOctree", octree.isLoose()); // same build mode as the cached tree, open checks it
+    shader->setVec3("octreeRootMin", scene.minAndChildren[0].corner);
+    shader->setVec3("octreeRootMax", scene.maxAndObjects[0].corner);
+    shader->setVec3("octreeCellMin", scene.rootCellMin);
+    shader->setVec3("octreeCellMax", scene.rootCellMax);
+    shader->setInt("tightNodeBoxes", octree.hasTightBounds()); // same build settings as the cached tree, they are part of the key
+    shader->setInt("sphereCount", scene.sphereCount);
+    shader->setInt("objectIndexBits", scene.indexBits);
     shader->setInt("numSamples", NUMSAMPLES);
     shader->setInt("maxDepth", MAXRAYSDEPTH);
 
@@ -151,224 +193,144 @@ void Raytracer::setupBuffers() {
     shader->setMat4("model", glm::mat4(1.0f));
 }
 
-void Raytracer::cleanupBuffers() {
-    glDeleteBuffers(1, &spheresSSBO);
-    glDeleteBuffers(1, &sphereDataSSBO);
-    glDeleteBuffers(1, &sphereData2SSBO);
-    glDeleteBuffers(1, &octreeNodesSSBO);
-    glDeleteBuffers(1, &octreeNodes2SSBO);
-    glDeleteBuffers(1, &octreeCountsSSBO);
-    glDeleteBuffers(1, &objectIndicesSSBO);
-}
-
-vector<Sphere> Raytracer::generatePreBuiltSpheres(){
-    std::vector<Sphere> spheres;
-    //spheres.push_back(Sphere(vec3( 0.000000, -1001.000000, 0.000000), 1000.000000, 0, vec3( 0.500000, 0.500000, 0.500000), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -7.995381, 0.200000, -7.478668), 0.200000, 0, vec3( 0.380012, 0.506085, 0.762437), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -7.696819, 0.200000, -5.468978), 0.200000, 0, vec3( 0.596282, 0.140784, 0.017972), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -7.824804, 0.200000, -3.120637), 0.200000, 0, vec3( 0.288507, 0.465652, 0.665070), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -7.132909, 0.200000, -1.701323), 0.200000, 0, vec3( 0.101047, 0.293493, 0.813446), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -7.569523, 0.200000, 0.494554), 0.200000, 0, vec3( 0.365924, 0.221622, 0.058332), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -7.730332, 0.200000, 2.358976), 0.200000, 0, vec3( 0.051231, 0.430547, 0.454086), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -7.892865, 0.200000, 4.753728), 0.200000, 1, vec3( 0.826684, 0.820511, 0.908836), 0.389611, 1.000000));
-    spheres.push_back(Sphere(vec3( -7.656691, 0.200000, 6.888913), 0.200000, 0, vec3( 0.346542, 0.225385, 0.180132), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -7.217835, 0.200000, 8.203466), 0.200000, 1, vec3( 0.600463, 0.582386, 0.608277), 0.427369, 1.000000));
-    spheres.push_back(Sphere(vec3( -5.115232, 0.200000, -7.980404), 0.200000, 0, vec3( 0.256969, 0.138639, 0.080293), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -5.323222, 0.200000, -5.113037), 0.200000, 0, vec3( 0.193093, 0.510542, 0.613362), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -5.410681, 0.200000, -3.527741), 0.200000, 0, vec3( 0.352200, 0.191551, 0.115972), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -5.460670, 0.200000, -1.166543), 0.200000, 0, vec3( 0.029486, 0.249874, 0.077989), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -5.457659, 0.200000, 0.363870), 0.200000, 0, vec3( 0.395713, 0.762043, 0.108515), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -5.798715, 0.200000, 2.161684), 0.200000, 2, vec3( 0.000000, 0.000000, 0.000000), 1.000000, 1.500000));
-    spheres.push_back(Sphere(vec3( -5.116586, 0.200000, 4.470188), 0.200000, 0, vec3( 0.059444, 0.404603, 0.171767), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -5.273591, 0.200000, 6.795187), 0.200000, 0, vec3( 0.499454, 0.131330, 0.158348), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -5.120286, 0.200000, 8.731398), 0.200000, 0, vec3( 0.267365, 0.136024, 0.300483), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -3.601565, 0.200000, -7.895600), 0.200000, 0, vec3( 0.027752, 0.155209, 0.330428), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -3.735860, 0.200000, -5.163056), 0.200000, 1, vec3( 0.576768, 0.884712, 0.993335), 0.359385, 1.000000));
-    spheres.push_back(Sphere(vec3( -3.481116, 0.200000, -3.794556), 0.200000, 0, vec3( 0.405104, 0.066436, 0.009339), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -3.866858, 0.200000, -1.465965), 0.200000, 0, vec3( 0.027570, 0.021652, 0.252798), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -3.168870, 0.200000, 0.553099), 0.200000, 0, vec3( 0.421992, 0.107577, 0.177504), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -3.428552, 0.200000, 2.627547), 0.200000, 1, vec3( 0.974029, 0.653443, 0.571877), 0.312780, 1.000000));
-    spheres.push_back(Sphere(vec3( -3.771736, 0.200000, 4.324785), 0.200000, 0, vec3( 0.685957, 0.000043, 0.181270), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -3.768522, 0.200000, 6.384588), 0.200000, 0, vec3( 0.025972, 0.082246, 0.138765), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -3.286992, 0.200000, 8.441148), 0.200000, 0, vec3( 0.186577, 0.560376, 0.367045), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -1.552127, 0.200000, -7.728200), 0.200000, 0, vec3( 0.202998, 0.002459, 0.015350), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -1.360796, 0.200000, -5.346098), 0.200000, 0, vec3( 0.690820, 0.028470, 0.179907), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -1.287209, 0.200000, -3.735321), 0.200000, 0, vec3( 0.345974, 0.672353, 0.450180), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -1.344859, 0.200000, -1.726654), 0.200000, 0, vec3( 0.209209, 0.431116, 0.164732), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -1.974774, 0.200000, 0.183260), 0.200000, 0, vec3( 0.006736, 0.675637, 0.622067), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -1.542872, 0.200000, 2.067868), 0.200000, 0, vec3( 0.192247, 0.016661, 0.010109), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -1.743856, 0.200000, 4.752810), 0.200000, 0, vec3( 0.295270, 0.108339, 0.276513), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -1.955621, 0.200000, 6.493702), 0.200000, 0, vec3( 0.270527, 0.270494, 0.202029), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( -1.350449, 0.200000, 8.068503), 0.200000, 1, vec3( 0.646942, 0.501660, 0.573693), 0.346551, 1.000000));
-    spheres.push_back(Sphere(vec3( 0.706123, 0.200000, -7.116040), 0.200000, 0, vec3( 0.027695, 0.029917, 0.235781), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 0.897766, 0.200000, -5.938681), 0.200000, 0, vec3( 0.114934, 0.046258, 0.039647), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 0.744113, 0.200000, -3.402960), 0.200000, 0, vec3( 0.513631, 0.335578, 0.204787), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 0.867750, 0.200000, -1.311908), 0.200000, 0, vec3( 0.400246, 0.000956, 0.040513), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 0.382480, 0.200000, 0.838206), 0.200000, 0, vec3( 0.594141, 0.215068, 0.025718), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 0.649692, 0.200000, 2.525103), 0.200000, 1, vec3( 0.602157, 0.797249, 0.614694), 0.341860, 1.000000));
-    spheres.push_back(Sphere(vec3( 0.378574, 0.200000, 4.055579), 0.200000, 0, vec3( 0.005086, 0.003349, 0.064403), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 0.425844, 0.200000, 6.098526), 0.200000, 0, vec3( 0.266812, 0.016602, 0.000853), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 0.261365, 0.200000, 8.661150), 0.200000, 0, vec3( 0.150201, 0.007353, 0.152506), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 2.814218, 0.200000, -7.751227), 0.200000, 1, vec3( 0.570094, 0.610319, 0.584192), 0.018611, 1.000000));
-    spheres.push_back(Sphere(vec3( 2.050073, 0.200000, -5.731364), 0.200000, 0, vec3( 0.109886, 0.029498, 0.303265), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 2.020130, 0.200000, -3.472627), 0.200000, 0, vec3( 0.216908, 0.216448, 0.221775), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 2.884277, 0.200000, -1.232662), 0.200000, 0, vec3( 0.483428, 0.027275, 0.113898), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 2.644454, 0.200000, 0.596324), 0.200000, 0, vec3( 0.005872, 0.860718, 0.561933), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 2.194283, 0.200000, 2.880603), 0.200000, 0, vec3( 0.452710, 0.824152, 0.045179), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 2.281000, 0.200000, 4.094307), 0.200000, 0, vec3( 0.002091, 0.145849, 0.032535), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 2.080841, 0.200000, 6.716384), 0.200000, 0, vec3( 0.468539, 0.032772, 0.018071), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 2.287131, 0.200000, 8.583242), 0.200000, 2, vec3( 0.000000, 0.000000, 0.000000), 1.000000, 1.500000));
-    spheres.push_back(Sphere(vec3( 4.329136, 0.200000, -7.497218), 0.200000, 0, vec3( 0.030865, 0.071452, 0.016051), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 4.502115, 0.200000, -5.941060), 0.200000, 2, vec3( 0.000000, 0.000000, 0.000000), 1.000000, 1.500000));
-    spheres.push_back(Sphere(vec3( 4.750631, 0.200000, -3.836759), 0.200000, 0, vec3( 0.702578, 0.084798, 0.141374), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 4.082084, 0.200000, -1.180746), 0.200000, 0, vec3( 0.043052, 0.793077, 0.018707), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 4.429173, 0.200000, 2.069721), 0.200000, 0, vec3( 0.179009, 0.147750, 0.617371), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 4.277152, 0.200000, 4.297482), 0.200000, 0, vec3( 0.422693, 0.011222, 0.211945), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 4.012743, 0.200000, 6.225072), 0.200000, 0, vec3( 0.986275, 0.073358, 0.133628), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 4.047066, 0.200000, 8.419360), 0.200000, 1, vec3( 0.878749, 0.677170, 0.684995), 0.243932, 1.000000));
-    spheres.push_back(Sphere(vec3( 6.441846, 0.200000, -7.700798), 0.200000, 0, vec3( 0.309255, 0.342524, 0.489512), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 6.047810, 0.200000, -5.519369), 0.200000, 0, vec3( 0.532361, 0.008200, 0.077522), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 6.779211, 0.200000, -3.740542), 0.200000, 0, vec3( 0.161234, 0.539314, 0.016667), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 6.430776, 0.200000, -1.332107), 0.200000, 0, vec3( 0.641951, 0.661402, 0.326114), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 6.476387, 0.200000, 0.329973), 0.200000, 0, vec3( 0.033000, 0.648388, 0.166911), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 6.568686, 0.200000, 2.116949), 0.200000, 0, vec3( 0.590952, 0.072292, 0.125672), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 6.371189, 0.200000, 4.609841), 0.200000, 1, vec3( 0.870345, 0.753830, 0.933118), 0.233489, 1.000000));
-    spheres.push_back(Sphere(vec3( 6.011877, 0.200000, 6.569579), 0.200000, 0, vec3( 0.044868, 0.651697, 0.086779), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 6.096087, 0.200000, 8.892333), 0.200000, 0, vec3( 0.588587, 0.078723, 0.044928), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 8.185763, 0.200000, -7.191109), 0.200000, 1, vec3( 0.989702, 0.886784, 0.540759), 0.104229, 1.000000));
-    spheres.push_back(Sphere(vec3( 8.411960, 0.200000, -5.285309), 0.200000, 0, vec3( 0.139604, 0.022029, 0.461688), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 8.047109, 0.200000, -3.427552), 0.200000, 1, vec3( 0.815002, 0.631228, 0.806757), 0.150782, 1.000000));
-    spheres.push_back(Sphere(vec3( 8.119639, 0.200000, -1.652587), 0.200000, 0, vec3( 0.177852, 0.429797, 0.042251), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 8.818120, 0.200000, 0.401292), 0.200000, 0, vec3( 0.065416, 0.087694, 0.040518), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 8.754155, 0.200000, 2.152549), 0.200000, 0, vec3( 0.230659, 0.035665, 0.435895), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 8.595298, 0.200000, 4.802001), 0.200000, 0, vec3( 0.188493, 0.184933, 0.040215), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 8.036216, 0.200000, 6.739752), 0.200000, 0, vec3( 0.023192, 0.364636, 0.464844), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 8.256561, 0.200000, 8.129115), 0.200000, 0, vec3( 0.002612, 0.598319, 0.435378), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 0.000000, 1.000000, 0.000000), 1.000000, 2, vec3( 0.000000, 0.000000, 0.000000), 1.000000, 1.500000));
-    spheres.push_back(Sphere(vec3( -4.000000, 1.000000, 0.000000), 1.000000, 0, vec3( 0.400000, 0.200000, 0.100000), 1.000000, 1.000000));
-    spheres.push_back(Sphere(vec3( 4.000000, 1.000000, 0.000000), 1.000000, 1, vec3( 0.700000, 0.600000, 0.500000), 0.000000, 1.000000));
-
-    return spheres;
+// Ranges closer than this many elements are uploaded as one
+static const size_t UPLOAD_MERGE_GAP = 64;
+
+/**
+ * @brief Upload the dirty ranges of one buffer holding count elements of elementSize bytes. If it has outgrown capacity
+ * the buffer is reallocated with room to grow and uploaded whole instead.
+ */
+static void uploadDirtyRanges(GLuint buffer, const void* data, size_t elementSize, size_t count, size_t& capacity, const std::vector<DirtyRange>& ranges) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    if (count > capacity) {
+        capacity = count + count / 2;
+        glBufferData(GL_SHADER_STORAGE_BUFFER, capacity * elementSize, nullptr, GL_DYNAMIC_DRAW);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * elementSize, data);
+        return;
+    }
+    for (const DirtyRange& range : Octree::mergeRanges(ranges, UPLOAD_MERGE_GAP)) {
+        size_t end = std::min(range.end, count);
+        if (range.begin >= end) continue;
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, range.begin * elementSize, (end - range.begin) * elementSize,
+                        static_cast<const char*>(data) + range.begin * elementSize);
+    }
 }
 
-vector<Sphere> Raytracer::generateRandomSpheres() {
-    std::vector<Sphere> spheres;
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    
-    // Material type and property distributions
-    std::uniform_int_distribution<int> materialTypeDis(0, 2);
-    std::uniform_real_distribution<float> colorDis(0.0f, 1.0f);
-    std::uniform_real_distribution<float> fuzzDis(0.0f, 0.5f);
-    std::uniform_real_distribution<float> refIndexDis(1.3f, 1.7f);
-    std::uniform_real_distribution<float> smallJitter(-0.2f, 0.2f);
-    std::uniform_real_distribution<float> heightDis(0.0f, 4.0f);
-    
-    // Grid parameters
-    const float radius = 0.2f; // Default sphere radius
-    const float minSpacing = radius * 2.5f; // Minimum space between spheres to avoid intersection
-    
-    // Calculate grid dimensions based on number of spheres
-    int gridSize = static_cast<int>(std::ceil(std::sqrt(NUMSPHERES)));
-    
-    float worldSize = gridSize * minSpacing * 1.2f;
-    worldSize = std::min(worldSize, 100.0f);
-    
-    float halfWorld = worldSize / 2.0f;
-
-
-    float cellSize = worldSize / gridSize;
-    
-    // Ensure cells are big enough for spheres with spacing
-    if (cellSize < minSpacing) {
-        cellSize = minSpacing;
+/**
+ * Moves the animated spheres to where they are at time and lets the octree follow, updateBuffers then uploads the changes.
+ */
+void Raytracer::animateScene(float time) {
+    if (restCenters.empty()) {
+        for (const Sphere& sphere : spheres) {
+            restCenters.push_back(sphere.center);
+        }
     }
+    animateSpheres(spheres, restCenters, time, animatedSpheres, animatedCenters);
 
-    const int totalSpheres = NUMSPHERES;
-    const int metalCount = totalSpheres / 5;     // 20% metallic
-    const int glassCount = totalSpheres / 5;     // 20% glass
-    int metalRemaining = metalCount;
-    int glassRemaining = glassCount;
-    int diffuseRemaining = totalSpheres - metalCount - glassCount;
-    
-    // Generate spheres in a grid pattern with small random offsets
-    int count = 0;
-    for (int i = 0; i < gridSize && count < NUMSPHERES; i++) {
-        for (int j = 0; j < gridSize && count < NUMSPHERES; j++) {
-            float baseX = -halfWorld + (i + 0.5f) * cellSize;
-            float baseY = radius + (heightDis(gen) * (i % 3 + j % 3 + 1) / 5.0f);
-            float baseZ = -halfWorld + (j + 0.5f) * cellSize;
-            
-            // Add small random jitter within the cell to make it look less uniform
-            // but still maintain non-intersection
-            float jitterAmount = std::min(cellSize * 0.3f, minSpacing * 0.4f);
-            float offsetX = smallJitter(gen) * jitterAmount;
-            float offsetZ = smallJitter(gen) * jitterAmount;
-            
-            // Final position
-            vec3 center(baseX + offsetX, baseY, baseZ + offsetZ);
-            
-            // Generate material properties
-            // Choose material type based on remaining counts
-            int materialType = 0; // default to diffuse
-            
-            // Strategic distribution - ensure we have enough of each type
-            if (metalRemaining > 0 && (diffuseRemaining <= 0 || (count % 5 == 1))) {
-                materialType = 1; // metal
-                metalRemaining--;
-            } else if (glassRemaining > 0 && (diffuseRemaining <= 0 || (count % 5 == 3))) {
-                materialType = 2; // glass
-                glassRemaining--;
-            } else {
-                materialType = 0; // diffuse
-                diffuseRemaining--;
-            }
-            vec3 albedo(colorDis(gen), colorDis(gen), colorDis(gen));
-            float fuzz = (materialType == 1) ? fuzzDis(gen) : 0.0f;
-            float refractionIndex = (materialType == 2) ? refIndexDis(gen) : 1.0f;
+    const float rootMargin = 1.0f; // a sphere moves at most 0.5 away from its rest center, both ways
+    if (octree.refitOrRebuild(spheres, animatedSpheres, animatedCenters, REBUILDGROWTH / 100.0, rootMargin)) {
+        cout << "Octree rebuilt after " << updateTimes.size() << " animated frames (" << octree.rebuildCount << " rebuilds so far)" << std::endl;
+    }
+    updateTimes.push_back(octree.updateTime);
+}
 
-            // Add the sphere
-            spheres.push_back(Sphere(center, radius, materialType, albedo, fuzz, refractionIndex));
-            count++;
+/**
+ * Re-uploads only what Octree::insert, remove and update changed since the last call, instead of the whole scene.
+ * Node buffers bound to an SSBO index stay bound to it, glBufferData on a reallocation keeps the buffer name.
+ */
+void Raytracer::updateBuffers() {
+    if (octree.dirtyNodes.empty() && octree.dirtyIndices.empty() && octree.dirtySpheres.empty()) return;
+
+    // buffers sharing a capacity grow together, each call gets its own copy of it
+    if (!octree.dirtySpheres.empty() && spheres.size() > sphereBufferCapacity) {
+        GPUSphereArrays sphereArrays = packSpheres(spheres);
+        const GLuint buffers[3] = {spheresSSBO, sphereDataSSBO, sphereData2SSBO};
+        const glm::vec4* data[3] = {sphereArrays.centersAndRadii.data(), sphereArrays.materialsAndAlbedo.data(), sphereArrays.fuzzAndRI.data()};
+        size_t capacity = sphereBufferCapacity;
+        for (int i = 0; i < 3; ++i) {
+            capacity = sphereBufferCapacity;
+            uploadDirtyRanges(buffers[i], data[i], sizeof(glm::vec4), spheres.size(), capacity, octree.dirtySpheres);
+        }
+        sphereBufferCapacity = capacity;
+    } else {
+        for (const DirtyRange& range : Octree::mergeRanges(octree.dirtySpheres, UPLOAD_MERGE_GAP)) {
+            GPUSphereArrays sphereArrays = packSpheres(std::vector<Sphere>(spheres.begin() + range.begin, spheres.begin() + range.end));
+            size_t offset = range.begin * sizeof(glm::vec4), bytes = (range.end - range.begin) * sizeof(glm::vec4);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, spheresSSBO);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, bytes, sphereArrays.centersAndRadii.data());
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphereDataSSBO);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, bytes, sphereArrays.materialsAndAlbedo.data());
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphereData2SSBO);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, bytes, sphereArrays.fuzzAndRI.data());
         }
     }
-    
-    return spheres;
-}
 
-vector<Sphere> Raytracer::generateSpheres() {
-    std::vector<Sphere> spheres;
+    const size_t nodeCount = octree.flattenedTree.size();
+    const GLuint nodeBuffers[4] = {octreeNodesSSBO, octreeNodes2SSBO, octreeCountsSSBO, octreeSplitsSSBO};
+    const void* nodeData[4] = {octree.gpuMinAndChildren.data(), octree.gpuMaxAndObjects.data(), octree.gpuObjectCounts.data(), octree.gpuSplits.data()};
+    const size_t nodeSizes[4] = {sizeof(GPUNodeCorner), sizeof(GPUNodeCorner), sizeof(unsigned int), sizeof(glm::vec4)};
+    size_t capacity = nodeBufferCapacity;
+    for (int i = 0; i < 4; ++i) {
+        capacity = nodeBufferCapacity;
+        uploadDirtyRanges(nodeBuffers[i], nodeData[i], nodeSizes[i], nodeCount, capacity, octree.dirtyNodes);
+    }
+    nodeBufferCapacity = capacity;
 
-    if (DEBUG) {
-        spheres.push_back(Sphere(vec3( -10.000000, -10.000000, -10.000000), 3.000000, 0, vec3( 0.596282, 0.140784, 0.017972), 1.000000, 1.000000)); // (-13, -13, -13) to (-7, -7, -7)
-        spheres.push_back(Sphere(vec3( 10.000000, 10.000000, 10.000000), 3.000000, 0,vec3( 0.952200, 0.391551, 0.915972), 1.000000, 1.000000)); // (7, 7, 7) to (13, 13, 13)
-        spheres.push_back(Sphere(vec3( -10.000000, 10.000000, -10.000000), 3.000000, 0, vec3( 0.002612, 0.598319, 0.435378), 1.000000, 1.000000)); // (-13, 7, -13) to (-7, 13, -7)
-        return spheres;
+    // dirtyIndices counts indices, the buffer holds words of one or two of them
+    std::vector<DirtyRange> indexWords = octree.dirtyIndices;
+    for (DirtyRange& range : indexWords) {
+        range.begin = packedIndexWords(range.begin + 1, octree.indexBits) - 1;
+        range.end = packedIndexWords(range.end, octree.indexBits);
+    }
+    uploadDirtyRanges(objectIndicesSSBO, octree.gpuObjectIndices.data(), sizeof(uint32_t), octree.gpuObjectIndices.size(), indexBufferCapacity, indexWords);
+
+    if (COMPACTNODES) {
+        // compact boxes are relative to their parent's, a change anywhere can move them all, so the whole buffer goes up.
+        // refitOrRebuild requantizes them top-down, any other change dropped them
+        if (octree.compactTree.size() != octree.flattenedTree.size()) octree.setCompactData();
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, octreeCompactSSBO);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, octree.compactTree.size() * sizeof(GPUCompactNode), octree.compactTree.data(), GL_DYNAMIC_DRAW);
     }
 
-    if (USEPREBUILT) {
-        spheres = generatePreBuiltSpheres();
-    } else {
-        spheres = generateRandomSpheres();
+    if (USEROPES) {
+        // a moved node changes the ropes of its neighbours too, so the whole buffer goes up like the compact one.
+        // refitOrRebuild redoes them, any other change dropped them
+        if (octree.ropeTree.size() != octree.flattenedTree.size()) octree.setRopeData();
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, octreeRopesSSBO);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, octree.ropeTree.size() * sizeof(GPURopeNode), octree.ropeTree.data(), GL_DYNAMIC_DRAW);
     }
 
-    return spheres;
-    
+    shader->use();
+    shader->setInt("octreeNodeCount", nodeCount);
+    shader->setInt("sphereCount", spheres.size());
+    shader->setInt("objectIndexBits", octree.indexBits);
+    shader->setVec3("octreeRootMin", octree.flattenedTree[0].min);
+    shader->setVec3("octreeRootMax", octree.flattenedTree[0].max);
+    shader->setVec3("octreeCellMin", octree.getRootCellMin()); // a rebuild pads it with the root margin
+    shader->setVec3("octreeCellMax", octree.getRootCellMax());
+
+    octree.clearDirtyRanges();
+}
+
+void Raytracer::cleanupBuffers() {
+    glDeleteBuffers(1, &spheresSSBO);
+    glDeleteBuffers(1, &sphereDataSSBO);
+    glDeleteBuffers(1, &sphereData2SSBO);
+    glDeleteBuffers(1, &octreeNodesSSBO);
+    glDeleteBuffers(1, &octreeNodes2SSBO);
+    glDeleteBuffers(1, &octreeCountsSSBO);
+    glDeleteBuffers(1, &objectIndicesSSBO);
+    glDeleteBuffers(1, &octreeCompactSSBO);
+    glDeleteBuffers(1, &octreeSplitsSSBO);
+    glDeleteBuffers(1, &octreeRopesSSBO);
 }
 
-void const Raytracer::saveStats(){
+void Raytracer::saveStats(){
     if (renderTimes.empty()) {
         cout << "No render times recorded." << endl;
         return;
     }
 
-    std::ofstream outFile;
-    outFile.open(statsFilename, std::ios::out | std::ios::app);
-    if (!outFile || !outFile.is_open()) {
-        std::cerr << "Error opening file for writing: " << statsFilename << std::endl;
-        return;
-    }
-
     // Make a copy for outlier detection
     std::vector<double> filteredTimes = renderTimes;
     
@@ -438,14 +400,45 @@ void const Raytracer::saveStats(){
     double minFPS = 1.0 / max;
     double maxFPS = 1.0 / min;
 
-    outFile << USEOCTREE << ";" << NUMSPHERES << ";" << MAXDEPTH << ";" << MAXSPHERESPERNODE << ";" << NUMSAMPLES << ";" << MAXRAYSDEPTH << ";" 
-            << SCR_WIDTH << ";" << SCR_HEIGHT << ";" 
-            << min << ";" << max << ";" << avg << ";" 
-            << minFPS << ";" << maxFPS << ";" << fpsAvg << ";"
-            << octree.buildTime
-            << std::endl;
+    // Per frame octree updates of an animated scene, reported apart from the build
+    double avgUpdateTime = 0.0, maxUpdateTime = 0.0;
+    for (double time : updateTimes) {
+        avgUpdateTime += time;
+        maxUpdateTime = std::max(maxUpdateTime, time);
+    }
+    if (!updateTimes.empty()) {
+        avgUpdateTime /= updateTimes.size();
+        cout << "Octree update time: avg " << avgUpdateTime << "s, max " << maxUpdateTime << "s, " << octree.rebuildCount << " rebuilds" << std::endl;
+    }
 
-    outFile.close();
+    // The columns of stats.csv, in order
+    StatsRow stats;
+    stats.add("Uses Octree", USEOCTREE);
+    stats.add("Spheres", NUMSPHERES);
+    stats.add("Max Octree Depth", MAXDEPTH);
+    stats.add("Max Spheres Per Node", MAXSPHERESPERNODE);
+    stats.add("Num Samples", NUMSAMPLES);
+    stats.add("Max Rays Depth", MAXRAYSDEPTH);
+    stats.add("Screen Width", SCR_WIDTH);
+    stats.add("Screen Height", SCR_HEIGHT);
+    stats.add("Min", min);
+    stats.add("Max", max);
+    stats.add("Avg", avg);
+    stats.add("Min FPS", minFPS);
+    stats.add("Max FPS", maxFPS);
+    stats.add("Avg FPS", fpsAvg);
+    stats.add("Octree Build Time", octree.buildTime);
+    stats.add("Auto Tune", AUTOTUNE);
+    stats.add("Tree Depth", octree.treeDepth);
+    stats.add("Average Leaf Size", octree.averageLeafSize);
+    stats.add("Predicted Cost", octree.predictedCost);
+    stats.add("Animate Spheres", ANIMATESPHERES);
+    stats.add("Avg Update Time", avgUpdateTime);
+    stats.add("Max Update Time", maxUpdateTime);
+    stats.add("Rebuilds", octree.rebuildCount);
+    stats.add("Node Layout", NODELAYOUT);
+
+    stats.append(statsFilename);
 }
 
 void Raytracer::run() {
@@ -484,6 +477,8 @@ void Raytracer::run() {
         lastFrame = currentFrame;
 
         processInput(window);
+        if (ANIMATESPHERES > 0) animateScene(currentFrame);
+        updateBuffers();
 
         glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -520,6 +515,7 @@ void Raytracer::run() {
 
     if (COLLECTSTATS) {
         saveStats();
+        if (!sceneCache.isOpen()) octree.saveStats(OCTREESTATSFILE); // nothing was built on a cache hit
     }
 
     cleanupBuffers();
@@ -7,6 +7,7 @@
 #include "opengl/Mesh.h"
 #include "opengl/camera.h"
 #include "octree.h"
+#include "scenecache.h"
 #include "sphere.h"
 #include <vector>
 
@@ -29,6 +30,12 @@ class Raytracer {
         // Scene
         std::vector<Sphere> spheres;
         Octree octree;
+        SceneCache sceneCache; // Open when the scene came from the cache, the buffers are then uploaded from it and spheres/octree stay empty
+                               // unless the scene is animated
+        // Animation (ANIMATESPHERES)
+        std::vector<glm::vec3> restCenters;
+        std::vector<int> animatedSpheres;
+        std::vector<glm::vec3> animatedCenters;
         
         // GPU buffer objects
         GLuint spheresSSBO;
@@ -38,25 +45,27 @@ class Raytracer {
         GLuint octreeNodes2SSBO;
         GLuint octreeCountsSSBO;
         GLuint objectIndicesSSBO;
+        GLuint octreeCompactSSBO; // only with COMPACTNODES
+        GLuint octreeSplitsSSBO;
+        GLuint octreeRopesSSBO; // only with USEROPES
+        // Elements the buffers above have room for, they are only reallocated when an update outgrows them
+        size_t sphereBufferCapacity, nodeBufferCapacity, indexBufferCapacity;
 
         // methods
         void setupQuad();
         void setupShader();
         void setupScene();
         void setupBuffers();
+        void updateBuffers();
+        void animateScene(float time);
         void cleanupBuffers();
-        /**
-         * @brief Generate a vector of spheres with predefined properties.
-        */
-        vector<Sphere> generateSpheres();
-        vector<Sphere> generatePreBuiltSpheres();
-        vector<Sphere> generateRandomSpheres();
 
         std::string statsFilename;
         int frameCount;
         std::vector<double> renderTimes;
+        std::vector<double> updateTimes; // Octree::updateTime of every animated frame, kept apart from the build time
 
-        void const saveStats();
+        void saveStats();
 };
 
 #endif // RAYTRACER_H
\ No newline at end of file
@@ -0,0 +1,22 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <vector>
+#include "sphere.h"
+using namespace std;
+
+/**
+ * @brief Generate a vector of spheres with predefined properties.
+ * Picks the debug, prebuilt or random scene according to config.h.
+*/
+vector<Sphere> generateSpheres();
+vector<Sphere> generatePreBuiltSpheres();
+vector<Sphere> generateRandomSpheres();
+
+/**
+ * @brief Animation of ANIMATESPHERES spheres, spread over the scene, each bobbing around its rest center by up to its radius (0.5 at most).
+ * Fills moved with their indices and centers with where they are at time (in seconds), for Octree::refitOrRebuild.
+*/
+void animateSpheres(const vector<Sphere>& spheres, const vector<vec3>& restCenters, float time, vector<int>& moved, vector<vec3>& centers);
+
+#endif // SCENE_H
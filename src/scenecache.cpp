@@ -0,0 +1,330 @@
+#include "scenecache.h"
+#include "config.h"
+#include "scene.h"
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+GPUSphereArrays packSpheres(const std::vector<Sphere>& spheres) {
+    GPUSphereArrays arrays;
+    arrays.centersAndRadii.reserve(spheres.size());
+    arrays.materialsAndAlbedo.reserve(spheres.size());
+    arrays.fuzzAndRI.reserve(spheres.size());
+
+    for (const Sphere& sphere : spheres) {
+        arrays.centersAndRadii.push_back(glm::vec4(sphere.center, sphere.radius));
+        arrays.materialsAndAlbedo.push_back(glm::vec4(float(sphere.materialType), sphere.albedo.x, sphere.albedo.y, sphere.albedo.z));
+        arrays.fuzzAndRI.push_back(glm::vec4(sphere.fuzz, sphere.refractionIndex, 0.0f, 0.0f));
+    }
+    return arrays;
+}
+
+GPUSceneView makeSceneView(const GPUSphereArrays& spheres, const Octree& octree) {
+    GPUSceneView view;
+    view.sphereCentersAndRadii = spheres.centersAndRadii.data();
+    view.sphereMaterialsAndAlbedo = spheres.materialsAndAlbedo.data();
+    view.sphereFuzzAndRI = spheres.fuzzAndRI.data();
+    view.sphereCount = spheres.centersAndRadii.size();
+
+    view.minAndChildren = octree.gpuMinAndChildren.data();
+    view.maxAndObjects = octree.gpuMaxAndObjects.data();
+    view.objectCounts = octree.gpuObjectCounts.data();
+    view.splits = octree.gpuSplits.data();
+    view.nodeCount = octree.flattenedTree.size();
+
+    view.objectIndices = octree.gpuObjectIndices.data();
+    view.indexCount = octree.objectIndices.size();
+    view.indexBits = octree.indexBits;
+
+    view.compactTree = octree.compactTree.data();
+    view.compactCount = octree.compactTree.size();
+
+    view.rootCellMin = octree.getRootCellMin();
+    view.rootCellMax = octree.getRootCellMax();
+    return view;
+}
+
+// FNV-1a, enough to tell settings apart, nothing here needs to resist collisions on purpose
+static void hashBytes(uint64_t& hash, const void* bytes, size_t count) {
+    const unsigned char* data = static_cast<const unsigned char*>(bytes);
+    for (size_t i = 0; i < count; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ull;
+    }
+}
+
+template <typename T>
+static void hashValue(uint64_t& hash, const T& value) {
+    hashBytes(hash, &value, sizeof(T));
+}
+
+uint64_t sceneCacheKey(int maxDepth, int maxSpheresPerNode, OctreeBuildMode buildMode, bool tightBounds, bool autoTune, NodeLayout layout, bool compactNodes) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    hashValue(hash, SCENE_CACHE_VERSION);
+
+    // Scene
+    hashValue(hash, DEBUG);
+    hashValue(hash, USEPREBUILT);
+    hashValue(hash, NUMSPHERES);
+    if (DEBUG || USEPREBUILT) {
+        // the fixed scenes are cheap to make, hashing them catches edits to scene.cpp
+        for (const Sphere& sphere : generateSpheres()) {
+            hashValue(hash, sphere.center);
+            hashValue(hash, sphere.radius);
+            hashValue(hash, sphere.materialType);
+            hashValue(hash, sphere.albedo);
+            hashValue(hash, sphere.fuzz);
+            hashValue(hash, sphere.refractionIndex);
+        }
+    }
+
+    // Octree
+    hashValue(hash, maxDepth);
+    hashValue(hash, maxSpheresPerNode);
+    hashValue(hash, static_cast<int>(buildMode));
+    hashValue(hash, tightBounds);
+    hashValue(hash, autoTune);
+    hashValue(hash, static_cast<int>(layout));
+    hashValue(hash, compactNodes);
+    return hash;
+}
+
+std::string sceneCacheFilename(uint64_t key) {
+    std::ostringstream name;
+    name << SCENECACHEFILE << "_" << std::hex << std::setw(16) << std::setfill('0') << key << ".bin";
+    return name.str();
+}
+
+// The arrays after the header, in file order
+enum SceneCacheSection {
+    CentersSection, MaterialsSection, FuzzSection,
+    MinSection, MaxSection, CountsSection, SplitsSection,
+    IndicesSection, CompactSection,
+    SectionCount
+};
+
+static size_t alignSection(size_t offset) {
+    return (offset + 15) & ~size_t(15);
+}
+
+/**
+ * @brief Where each array of a file with these counts starts, its size in bytes, and the size of the whole file.
+ * @return false if the counts cannot be those of a file of maxSize bytes.
+ */
+static bool sectionOffsets(const SceneCacheHeader& header, size_t maxSize, size_t offsets[SectionCount], size_t bytes[SectionCount], size_t& fileSize) {
+    const uint64_t counts[SectionCount] = {
+        header.sphereCount, header.sphereCount, header.sphereCount,
+        header.nodeCount, header.nodeCount, header.nodeCount, header.nodeCount,
+        packedIndexWords(static_cast<size_t>(header.indexCount), objectIndexBits(static_cast<size_t>(header.sphereCount))), header.compactCount
+    };
+    const size_t elementSizes[SectionCount] = {
+        sizeof(glm::vec4), sizeof(glm::vec4), sizeof(glm::vec4),
+        sizeof(GPUNodeCorner), sizeof(GPUNodeCorner), sizeof(unsigned int), sizeof(glm::vec4),
+        sizeof(uint32_t), sizeof(GPUCompactNode)
+    };
+
+    size_t offset = sizeof(SceneCacheHeader);
+    for (int section = 0; section < SectionCount; ++section) {
+        if (counts[section] > maxSize / elementSizes[section]) return false;
+        offset = alignSection(offset);
+        offsets[section] = offset;
+        bytes[section] = static_cast<size_t>(counts[section]) * elementSizes[section];
+        offset += bytes[section];
+        if (offset > maxSize) return false;
+    }
+    fileSize = offset;
+    return true;
+}
+
+SceneCache::~SceneCache() {
+    close();
+}
+
+bool SceneCache::open(const std::string& filename, uint64_t key, bool looseOctree) {
+    close();
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < LONGLONG(sizeof(SceneCacheHeader))) {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (!view) {
+        if (mapping) CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    fileHandle = file;
+    mappingHandle = mapping;
+    data = static_cast<const unsigned char*>(view);
+    size = static_cast<size_t>(fileSize.QuadPart);
+#else
+    int file = ::open(filename.c_str(), O_RDONLY);
+    if (file < 0) return false;
+    struct stat info;
+    if (fstat(file, &info) != 0 || info.st_size < off_t(sizeof(SceneCacheHeader))) {
+        ::close(file);
+        return false;
+    }
+    void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+    ::close(file); // the mapping keeps the file alive
+    if (view == MAP_FAILED) return false;
+    data = static_cast<const unsigned char*>(view);
+    size = static_cast<size_t>(info.st_size);
+#endif
+
+    const SceneCacheHeader& fileHeader = header();
+    size_t offsets[SectionCount], bytes[SectionCount], expectedSize;
+    if (fileHeader.magic != SCENE_CACHE_MAGIC || fileHeader.version != SCENE_CACHE_VERSION || fileHeader.key != key ||
+        fileHeader.looseOctree != int32_t(looseOctree) || fileHeader.nodeCount == 0 || !sectionOffsets(fileHeader, size, offsets, bytes, expectedSize) || expectedSize != size) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void SceneCache::close() {
+    if (!data) return;
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+    CloseHandle(mappingHandle);
+    CloseHandle(fileHandle);
+    mappingHandle = nullptr;
+    fileHandle = nullptr;
+#else
+    munmap(const_cast<unsigned char*>(data), size);
+#endif
+    data = nullptr;
+    size = 0;
+}
+
+GPUSceneView SceneCache::view() const {
+    const SceneCacheHeader& fileHeader = header();
+    size_t offsets[SectionCount], bytes[SectionCount], fileSize;
+    sectionOffsets(fileHeader, size, offsets, bytes, fileSize); // checked by open
+
+    GPUSceneView view;
+    view.sphereCentersAndRadii = reinterpret_cast<const glm::vec4*>(data + offsets[CentersSection]);
+    view.sphereMaterialsAndAlbedo = reinterpret_cast<const glm::vec4*>(data + offsets[MaterialsSection]);
+    view.sphereFuzzAndRI = reinterpret_cast<const glm::vec4*>(data + offsets[FuzzSection]);
+    view.sphereCount = static_cast<size_t>(fileHeader.sphereCount);
+
+    view.minAndChildren = reinterpret_cast<const GPUNodeCorner*>(data + offsets[MinSection]);
+    view.maxAndObjects = reinterpret_cast<const GPUNodeCorner*>(data + offsets[MaxSection]);
+    view.objectCounts = reinterpret_cast<const unsigned int*>(data + offsets[CountsSection]);
+    view.splits = reinterpret_cast<const glm::vec4*>(data + offsets[SplitsSection]);
+    view.nodeCount = static_cast<size_t>(fileHeader.nodeCount);
+
+    view.objectIndices = reinterpret_cast<const uint32_t*>(data + offsets[IndicesSection]);
+    view.indexCount = static_cast<size_t>(fileHeader.indexCount);
+    view.indexBits = objectIndexBits(view.sphereCount);
+
+    view.compactTree = reinterpret_cast<const GPUCompactNode*>(data + offsets[CompactSection]);
+    view.compactCount = static_cast<size_t>(fileHeader.compactCount);
+
+    view.rootCellMin = glm::vec3(fileHeader.rootCellMin[0], fileHeader.rootCellMin[1], fileHeader.rootCellMin[2]);
+    view.rootCellMax = glm::vec3(fileHeader.rootCellMax[0], fileHeader.rootCellMax[1], fileHeader.rootCellMax[2]);
+    return view;
+}
+
+std::vector<Sphere> SceneCache::loadSpheres() const {
+    GPUSceneView scene = view();
+    std::vector<Sphere> spheres;
+    spheres.reserve(scene.sphereCount);
+    for (size_t i = 0; i < scene.sphereCount; ++i) {
+        const glm::vec4& centerAndRadius = scene.sphereCentersAndRadii[i];
+        const glm::vec4& materialAndAlbedo = scene.sphereMaterialsAndAlbedo[i];
+        const glm::vec4& fuzzAndRI = scene.sphereFuzzAndRI[i];
+        spheres.push_back(Sphere(glm::vec3(centerAndRadius), centerAndRadius.w, static_cast<int>(materialAndAlbedo.x),
+                                 glm::vec3(materialAndAlbedo.y, materialAndAlbedo.z, materialAndAlbedo.w), fuzzAndRI.x, fuzzAndRI.y));
+    }
+    return spheres;
+}
+
+void SceneCache::loadOctree(Octree& octree) const {
+    if (octree.isLoose() != (header().looseOctree != 0)) {
+        throw std::invalid_argument("The cached octree and the one it is loaded into must both be loose or both not");
+    }
+    GPUSceneView scene = view();
+    octree.loadGPUData(scene.minAndChildren, scene.maxAndObjects, scene.objectCounts, scene.splits, scene.nodeCount,
+                       scene.objectIndices, scene.indexCount, scene.compactTree, scene.compactCount, scene.sphereCount,
+                       scene.rootCellMin, scene.rootCellMax);
+    octree.visitOrdered = header().visitOrdered != 0;
+}
+
+bool SceneCache::save(const std::string& filename, uint64_t key, const std::vector<Sphere>& spheres, const Octree& octree) {
+    GPUSphereArrays sphereArrays = packSpheres(spheres);
+    GPUSceneView scene = makeSceneView(sphereArrays, octree);
+
+    SceneCacheHeader fileHeader = {};
+    fileHeader.magic = SCENE_CACHE_MAGIC;
+    fileHeader.version = SCENE_CACHE_VERSION;
+    fileHeader.key = key;
+    fileHeader.sphereCount = scene.sphereCount;
+    fileHeader.nodeCount = scene.nodeCount;
+    fileHeader.indexCount = scene.indexCount;
+    fileHeader.compactCount = scene.compactCount;
+    fileHeader.looseOctree = octree.isLoose();
+    fileHeader.visitOrdered = octree.visitOrdered;
+    fileHeader.buildTime = octree.buildTime;
+    for (int axis = 0; axis < 3; ++axis) {
+        fileHeader.rootCellMin[axis] = scene.rootCellMin[axis];
+        fileHeader.rootCellMax[axis] = scene.rootCellMax[axis];
+    }
+
+    size_t offsets[SectionCount], bytes[SectionCount], fileSize;
+    sectionOffsets(fileHeader, SIZE_MAX, offsets, bytes, fileSize);
+    const void* sections[SectionCount] = {
+        scene.sphereCentersAndRadii, scene.sphereMaterialsAndAlbedo, scene.sphereFuzzAndRI,
+        scene.minAndChildren, scene.maxAndObjects, scene.objectCounts, scene.splits,
+        scene.objectIndices, scene.compactTree
+    };
+
+    const std::string tempFilename = filename + ".tmp";
+    {
+        std::ofstream outFile(tempFilename, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!outFile || !outFile.is_open()) {
+            std::cerr << "Error opening file for writing: " << tempFilename << std::endl;
+            return false;
+        }
+
+        static const char padding[16] = {0};
+        outFile.write(reinterpret_cast<const char*>(&fileHeader), sizeof(fileHeader));
+        size_t written = sizeof(fileHeader);
+        for (int section = 0; section < SectionCount; ++section) {
+            outFile.write(padding, offsets[section] - written);
+            if (bytes[section] > 0) outFile.write(static_cast<const char*>(sections[section]), bytes[section]);
+            written = offsets[section] + bytes[section];
+        }
+        if (!outFile) {
+            std::cerr << "Error writing " << tempFilename << std::endl;
+            return false;
+        }
+    }
+
+    std::remove(filename.c_str()); // rename does not replace an existing file everywhere
+    if (std::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Error renaming " << tempFilename << " to " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,123 @@
+#ifndef SCENECACHE_H
+#define SCENECACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "octree.h"
+#include "sphere.h"
+
+// Bump whenever the file layout or any of the GPU structs it stores changes, old files are then rebuilt
+const uint32_t SCENE_CACHE_VERSION = 3;
+const uint32_t SCENE_CACHE_MAGIC = 0x43534445; // "EDSC"
+
+/**
+ * Start of a cache file. It is followed by the arrays listed in GPUSceneView, in that order, each starting on a 16 byte boundary,
+ * so the file can be used in place once mapped. Written and read on the same machine, so no endianness conversion.
+ */
+struct SceneCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key; // sceneCacheKey of the scene and build settings
+    uint64_t sphereCount;
+    uint64_t nodeCount;
+    uint64_t indexCount; // Object indices, packed to objectIndexBits(sphereCount) in the file
+    uint64_t compactCount; // 0 unless built with compact nodes
+    int32_t looseOctree; // Octree::isLoose of the tree
+    int32_t visitOrdered; // Octree::visitOrdered, the profile-guided order is kept with the scene
+    double buildTime; // Of the build that wrote the file
+    float rootCellMin[3]; // Octree::getRootCellMin, the traversal walks the cells and tightBounds shrinks the root box inside it
+    float rootCellMax[3];
+};
+static_assert(sizeof(SceneCacheHeader) == 88, "SceneCacheHeader is part of the file format");
+
+// Sphere buffers in the layout of the shader: center.xyz, radius / materialType, albedo.xyz / fuzz, refractionIndex, 0, 0
+struct GPUSphereArrays {
+    std::vector<glm::vec4> centersAndRadii;
+    std::vector<glm::vec4> materialsAndAlbedo;
+    std::vector<glm::vec4> fuzzAndRI;
+};
+
+GPUSphereArrays packSpheres(const std::vector<Sphere>& spheres);
+
+// Every upload buffer of a scene, either inside a mapped SceneCache or in vectors owned by someone else
+struct GPUSceneView {
+    const glm::vec4* sphereCentersAndRadii = nullptr;
+    const glm::vec4* sphereMaterialsAndAlbedo = nullptr;
+    const glm::vec4* sphereFuzzAndRI = nullptr;
+    size_t sphereCount = 0;
+
+    const GPUNodeCorner* minAndChildren = nullptr;
+    const GPUNodeCorner* maxAndObjects = nullptr;
+    const unsigned int* objectCounts = nullptr;
+    const glm::vec4* splits = nullptr;
+    size_t nodeCount = 0;
+
+    const uint32_t* objectIndices = nullptr; // Packed to indexBits, see Octree::gpuObjectIndices
+    size_t indexCount = 0; // Indices, not words
+    int indexBits = 32;
+
+    const GPUCompactNode* compactTree = nullptr;
+    size_t compactCount = 0;
+
+    glm::vec3 rootCellMin = glm::vec3(0.0f); // See Octree::getRootCellMin
+    glm::vec3 rootCellMax = glm::vec3(0.0f);
+};
+
+GPUSceneView makeSceneView(const GPUSphereArrays& spheres, const Octree& octree);
+
+/**
+ * @brief Hash of everything the scene and its octree depend on: the scene settings of config.h (and the spheres themselves
+ * for the fixed scenes), the build settings and the file version. The random scene is drawn once per key and then reused.
+ */
+uint64_t sceneCacheKey(int maxDepth, int maxSpheresPerNode, OctreeBuildMode buildMode, bool tightBounds, bool autoTune, NodeLayout layout, bool compactNodes);
+
+// File of the scene with that key, SCENECACHEFILE_<key in hex>.bin
+std::string sceneCacheFilename(uint64_t key);
+
+/**
+ * Read-only memory mapping of a cache file. The buffers are used straight from the mapping,
+ * so a hit skips generating the scene, building the octree and laying out the upload buffers.
+ */
+class SceneCache {
+    public:
+        SceneCache() = default;
+        ~SceneCache();
+
+        SceneCache(const SceneCache&) = delete;
+        SceneCache& operator=(const SceneCache&) = delete;
+
+        /**
+         * @brief Map filename if it is a complete cache file of this version and key, of a loose octree or not as looseOctree says.
+         * The key covers the build mode, a file that disagrees with it is damaged or was written by another build.
+         * @return false on a miss (no file, other key, version or looseness, wrong size), nothing stays mapped then.
+         */
+        bool open(const std::string& filename, uint64_t key, bool looseOctree);
+        void close();
+        bool isOpen() const { return data != nullptr; }
+
+        const SceneCacheHeader& header() const { return *reinterpret_cast<const SceneCacheHeader*>(data); }
+        // Pointers into the mapping, valid until close
+        GPUSceneView view() const;
+
+        // Copies for the CPU side, which works on Sphere and Octree rather than the upload buffers
+        std::vector<Sphere> loadSpheres() const;
+        // octree must have the build mode of the file, its cells hold the objects or not
+        void loadOctree(Octree& octree) const;
+
+        /**
+         * @brief Write the scene and its built octree to filename, through a temporary file so a reader never sees half of it.
+         */
+        static bool save(const std::string& filename, uint64_t key, const std::vector<Sphere>& spheres, const Octree& octree);
+    private:
+        const unsigned char* data = nullptr;
+        size_t size = 0;
+#ifdef _WIN32
+        void* fileHandle = nullptr;
+        void* mappingHandle = nullptr;
+#endif
+};
+
+#endif // SCENECACHE_H
@@ -0,0 +1,223 @@
+#include "spherebatch.h"
+#include <cmath>
+#include <limits>
+
+// The SIMD kernels are compiled for their instruction set function by function and only called once the CPU is known to
+// run it, so the rest of the program keeps running on any x86 CPU
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SPHEREBATCH_X86 1
+#include <immintrin.h>
+#endif
+
+static const float INF = std::numeric_limits<float>::infinity();
+
+static void pushSlot(SphereBatch& batch, float x, float y, float z, float r2, int id) {
+    batch.cx.push_back(x);
+    batch.cy.push_back(y);
+    batch.cz.push_back(z);
+    batch.r2.push_back(r2);
+    batch.ids.push_back(id);
+}
+
+// Padding slots: |oc|^2 - r2 is +inf, so the discriminant is never positive and no ray hits them
+static void padRun(SphereBatch& batch) {
+    while (batch.ids.size() % SPHERE_BATCH_PADDING != 0) pushSlot(batch, 0.0f, 0.0f, 0.0f, -INF, -1);
+}
+
+void SphereBatch::clear() {
+    cx.clear();
+    cy.clear();
+    cz.clear();
+    r2.clear();
+    ids.clear();
+}
+
+size_t SphereBatch::append(const std::vector<Sphere>& spheres, const int* indices, int count) {
+    size_t first = ids.size();
+    for (int i = 0; i < count; ++i) {
+        const Sphere& sphere = spheres[indices[i]];
+        pushSlot(*this, sphere.center.x, sphere.center.y, sphere.center.z, sphere.radius * sphere.radius, indices[i]);
+    }
+    padRun(*this);
+    return first;
+}
+
+size_t SphereBatch::appendAll(const std::vector<Sphere>& spheres) {
+    size_t first = ids.size();
+    for (size_t i = 0; i < spheres.size(); ++i) {
+        const Sphere& sphere = spheres[i];
+        pushSlot(*this, sphere.center.x, sphere.center.y, sphere.center.z, sphere.radius * sphere.radius, int(i));
+    }
+    padRun(*this);
+    return first;
+}
+
+SimdLevel detectSimdLevel() {
+#ifdef SPHEREBATCH_X86
+    // also checks that the OS saves the wider registers
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return AVX512Simd;
+    if (__builtin_cpu_supports("avx2")) return AVX2Simd;
+#endif
+    return ScalarSimd;
+}
+
+const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case AVX512Simd: return "AVX-512";
+        case AVX2Simd: return "AVX2";
+        default: return "scalar";
+    }
+}
+
+/**
+ * Every kernel follows CPURaytracer::sphereHit operation by operation: a = dot(d, d), half_b = dot(oc, d),
+ * c = dot(oc, oc) - r^2, and the near root unless it is outside the window, then the far one.
+ */
+static int nearestScalar(const SphereBatch& batch, size_t first, int count, const glm::vec3& origin, const glm::vec3& direction,
+                         float t_min, float& t_max) {
+    const float a = direction.x * direction.x + direction.y * direction.y + direction.z * direction.z;
+    int best = -1;
+    for (size_t i = first; i < first + count; ++i) {
+        float ocx = origin.x - batch.cx[i], ocy = origin.y - batch.cy[i], ocz = origin.z - batch.cz[i];
+        float half_b = ocx * direction.x + ocy * direction.y + ocz * direction.z;
+        float c = ocx * ocx + ocy * ocy + ocz * ocz - batch.r2[i];
+        float discriminant = half_b * half_b - a * c;
+        if (!(discriminant > 0.0f)) continue;
+
+        float sqrtd = std::sqrt(discriminant);
+        float t = (-half_b - sqrtd) / a;
+        if (!(t < t_max && t > t_min)) t = (-half_b + sqrtd) / a;
+        if (t < t_max && t > t_min) {
+            t_max = t;
+            best = int(i);
+        }
+    }
+    return best;
+}
+
+// Nearest of the per lane bests, the lowest slot among equally near ones like the scalar loop
+static int nearestLane(const float* ts, const int* slots, int lanes, float& t_max) {
+    int best = -1;
+    float bestT = t_max;
+    for (int lane = 0; lane < lanes; ++lane) {
+        if (slots[lane] < 0) continue;
+        if (best == -1 || ts[lane] < bestT || (ts[lane] == bestT && slots[lane] < best)) {
+            best = slots[lane];
+            bestT = ts[lane];
+        }
+    }
+    if (best != -1) t_max = bestT;
+    return best;
+}
+
+#ifdef SPHEREBATCH_X86
+// 8 slots from values, those of the lanes outside the window (inside = 0) read as 0 and never past the window
+__attribute__((target("avx2")))
+static inline __m256 loadWindow(const float* values, size_t remaining, __m256i inside) {
+    return remaining >= 8 ? _mm256_loadu_ps(values) : _mm256_maskload_ps(values, inside);
+}
+
+// Each lane keeps the nearest hit of its own slots, a later slot only replaces it when strictly nearer. The window may start
+// and end anywhere, lanes past its end are masked off
+__attribute__((target("avx2")))
+static int nearestAVX2(const SphereBatch& batch, size_t first, int count, const glm::vec3& origin, const glm::vec3& direction,
+                       float t_min, float& t_max) {
+    const float a = direction.x * direction.x + direction.y * direction.y + direction.z * direction.z;
+    const __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y), oz = _mm256_set1_ps(origin.z);
+    const __m256 dx = _mm256_set1_ps(direction.x), dy = _mm256_set1_ps(direction.y), dz = _mm256_set1_ps(direction.z);
+    const __m256 va = _mm256_set1_ps(a), tMin = _mm256_set1_ps(t_min), tMax = _mm256_set1_ps(t_max);
+    const __m256 zero = _mm256_setzero_ps(), signBit = _mm256_set1_ps(-0.0f);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    __m256 bestT = _mm256_set1_ps(INF);
+    __m256i bestSlot = _mm256_set1_epi32(-1);
+    const size_t end = first + count;
+    const __m256i windowEnd = _mm256_set1_epi32(int(end));
+    for (size_t i = first; i < end; i += 8) {
+        __m256i slots = _mm256_add_epi32(_mm256_set1_epi32(int(i)), lanes);
+        __m256i inside = _mm256_cmpgt_epi32(windowEnd, slots);
+        __m256 ocx = _mm256_sub_ps(ox, loadWindow(&batch.cx[i], end - i, inside));
+        __m256 ocy = _mm256_sub_ps(oy, loadWindow(&batch.cy[i], end - i, inside));
+        __m256 ocz = _mm256_sub_ps(oz, loadWindow(&batch.cz[i], end - i, inside));
+        __m256 halfB = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)),
+                                 loadWindow(&batch.r2[i], end - i, inside));
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(halfB, halfB), _mm256_mul_ps(va, c));
+        __m256 sqrtd = _mm256_sqrt_ps(discriminant);
+        __m256 minusB = _mm256_xor_ps(halfB, signBit);
+
+        __m256 tNear = _mm256_div_ps(_mm256_sub_ps(minusB, sqrtd), va);
+        __m256 tFar = _mm256_div_ps(_mm256_add_ps(minusB, sqrtd), va);
+        __m256 nearInside = _mm256_and_ps(_mm256_cmp_ps(tNear, tMax, _CMP_LT_OQ), _mm256_cmp_ps(tNear, tMin, _CMP_GT_OQ));
+        __m256 t = _mm256_blendv_ps(tFar, tNear, nearInside);
+        __m256 hit = _mm256_and_ps(_mm256_and_ps(_mm256_castsi256_ps(inside), _mm256_cmp_ps(discriminant, zero, _CMP_GT_OQ)),
+                                   _mm256_and_ps(_mm256_cmp_ps(t, tMax, _CMP_LT_OQ), _mm256_cmp_ps(t, tMin, _CMP_GT_OQ)));
+        __m256 nearer = _mm256_and_ps(hit, _mm256_cmp_ps(t, bestT, _CMP_LT_OQ));
+
+        bestT = _mm256_blendv_ps(bestT, t, nearer);
+        bestSlot = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(bestSlot), _mm256_castsi256_ps(slots), nearer));
+    }
+
+    alignas(32) float ts[8];
+    alignas(32) int bestSlots[8];
+    _mm256_store_ps(ts, bestT);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(bestSlots), bestSlot);
+    return nearestLane(ts, bestSlots, 8, t_max);
+}
+
+// Same as nearestAVX2 on 16 lanes
+__attribute__((target("avx512f")))
+static int nearestAVX512(const SphereBatch& batch, size_t first, int count, const glm::vec3& origin, const glm::vec3& direction,
+                         float t_min, float& t_max) {
+    const float a = direction.x * direction.x + direction.y * direction.y + direction.z * direction.z;
+    const __m512 ox = _mm512_set1_ps(origin.x), oy = _mm512_set1_ps(origin.y), oz = _mm512_set1_ps(origin.z);
+    const __m512 dx = _mm512_set1_ps(direction.x), dy = _mm512_set1_ps(direction.y), dz = _mm512_set1_ps(direction.z);
+    const __m512 va = _mm512_set1_ps(a), tMin = _mm512_set1_ps(t_min), tMax = _mm512_set1_ps(t_max);
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+    __m512 bestT = _mm512_set1_ps(INF);
+    __m512i bestSlot = _mm512_set1_epi32(-1);
+    const size_t end = first + count;
+    for (size_t i = first; i < end; i += 16) {
+        const __mmask16 loaded = end - i >= 16 ? __mmask16(0xffff) : __mmask16((1u << (end - i)) - 1);
+        __m512 ocx = _mm512_sub_ps(ox, _mm512_maskz_loadu_ps(loaded, &batch.cx[i]));
+        __m512 ocy = _mm512_sub_ps(oy, _mm512_maskz_loadu_ps(loaded, &batch.cy[i]));
+        __m512 ocz = _mm512_sub_ps(oz, _mm512_maskz_loadu_ps(loaded, &batch.cz[i]));
+        __m512 halfB = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, dx), _mm512_mul_ps(ocy, dy)), _mm512_mul_ps(ocz, dz));
+        __m512 c = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_mul_ps(ocy, ocy)), _mm512_mul_ps(ocz, ocz)),
+                                 _mm512_maskz_loadu_ps(loaded, &batch.r2[i]));
+        __m512 discriminant = _mm512_sub_ps(_mm512_mul_ps(halfB, halfB), _mm512_mul_ps(va, c));
+        __m512 sqrtd = _mm512_maskz_sqrt_ps(loaded, discriminant);
+        __m512 minusB = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(halfB), _mm512_set1_epi32(int(0x80000000u))));
+
+        __m512 tNear = _mm512_div_ps(_mm512_sub_ps(minusB, sqrtd), va);
+        __m512 tFar = _mm512_div_ps(_mm512_add_ps(minusB, sqrtd), va);
+        __mmask16 nearInside = _mm512_cmp_ps_mask(tNear, tMax, _CMP_LT_OQ) & _mm512_cmp_ps_mask(tNear, tMin, _CMP_GT_OQ);
+        __m512 t = _mm512_mask_blend_ps(nearInside, tFar, tNear);
+        __mmask16 hit = loaded & _mm512_cmp_ps_mask(discriminant, zero, _CMP_GT_OQ) & _mm512_cmp_ps_mask(t, tMax, _CMP_LT_OQ) &
+                        _mm512_cmp_ps_mask(t, tMin, _CMP_GT_OQ);
+        __mmask16 nearer = hit & _mm512_cmp_ps_mask(t, bestT, _CMP_LT_OQ);
+
+        __m512i slots = _mm512_add_epi32(_mm512_set1_epi32(int(i)), lanes);
+        bestT = _mm512_mask_blend_ps(nearer, bestT, t);
+        bestSlot = _mm512_mask_blend_epi32(nearer, bestSlot, slots);
+    }
+
+    alignas(64) float ts[16];
+    alignas(64) int bestSlots[16];
+    _mm512_store_ps(ts, bestT);
+    _mm512_store_si512(bestSlots, bestSlot);
+    return nearestLane(ts, bestSlots, 16, t_max);
+}
+#endif
+
+int nearestSphereHit(SimdLevel level, const SphereBatch& batch, size_t first, int count, const glm::vec3& origin, const glm::vec3& direction,
+                     float t_min, float& t_max) {
+#ifdef SPHEREBATCH_X86
+    if (level == AVX512Simd) return nearestAVX512(batch, first, count, origin, direction, t_min, t_max);
+    if (level == AVX2Simd) return nearestAVX2(batch, first, count, origin, direction, t_min, t_max);
+#endif
+    return nearestScalar(batch, first, count, origin, direction, t_min, t_max);
+}
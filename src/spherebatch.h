@@ -0,0 +1,46 @@
+#ifndef SPHEREBATCH_H
+#define SPHEREBATCH_H
+
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <vector>
+#include "sphere.h"
+
+// Instruction sets of the batched sphere tests, from slowest to fastest
+enum SimdLevel {
+    ScalarSimd = 0, // one sphere at a time
+    AVX2Simd   = 1, // 8 spheres at a time
+    AVX512Simd = 2  // 16 spheres at a time
+};
+
+// Runs appended to a SphereBatch are padded to a multiple of this, the AVX2 width
+const int SPHERE_BATCH_PADDING = 8;
+
+/**
+ * Spheres as a structure of arrays for the batched tests: centers and squared radii in arrays of their own, as runs of
+ * slots (a leaf's spheres, or the whole scene) padded to SPHERE_BATCH_PADDING with spheres no ray hits.
+ */
+struct SphereBatch {
+    std::vector<float> cx, cy, cz, r2;
+    std::vector<int> ids; // Index of the sphere in each slot, -1 for padding
+
+    void clear();
+    // Appends spheres[indices[i]] for i < count as a padded run, returns the slot it starts at
+    size_t append(const std::vector<Sphere>& spheres, const int* indices, int count);
+    // Appends every sphere as one padded run, returns the slot it starts at
+    size_t appendAll(const std::vector<Sphere>& spheres);
+};
+
+// Widest level this CPU and compiler can run, ScalarSimd where there are no x86 SIMD kernels
+SimdLevel detectSimdLevel();
+const char* simdLevelName(SimdLevel level);
+
+/**
+ * Nearest of the count spheres from slot first that the ray hits in (t_min, t_max), with the same arithmetic and the same
+ * choice between equally near spheres as testing them one by one with CPURaytracer::sphereHit.
+ * @return The slot of the sphere, -1 if none is hit. t_max then holds its t.
+ */
+int nearestSphereHit(SimdLevel level, const SphereBatch& batch, size_t first, int count, const glm::vec3& origin, const glm::vec3& direction,
+                     float t_min, float& t_max);
+
+#endif // SPHEREBATCH_H
@@ -0,0 +1,44 @@
+#include "statsrow.h"
+#include <fstream>
+#include <iostream>
+
+std::string StatsRow::header() const {
+    std::string text;
+    for (size_t i = 0; i < columns.size(); ++i) {
+        text += (i > 0 ? ";" : "") + columns[i].first;
+    }
+    return text;
+}
+
+std::string StatsRow::row() const {
+    std::string text;
+    for (size_t i = 0; i < columns.size(); ++i) {
+        text += (i > 0 ? ";" : "") + columns[i].second;
+    }
+    return text;
+}
+
+bool StatsRow::append(const std::string& filename) const {
+    bool writeHeader = false;
+    {
+        std::ifstream inFile(filename);
+        std::string firstLine;
+        if (!inFile || !std::getline(inFile, firstLine)) {
+            writeHeader = true;
+        } else if (firstLine != header()) {
+            // never appended under the columns of another version
+            std::cerr << "Error: " << filename << " has other columns, move it away to start a new one. The row was not saved:\n"
+                      << header() << "\n" << row() << std::endl;
+            return false;
+        }
+    }
+
+    std::ofstream outFile(filename, std::ios::out | std::ios::app);
+    if (!outFile || !outFile.is_open()) {
+        std::cerr << "Error opening file for writing: " << filename << std::endl;
+        return false;
+    }
+    if (writeHeader) outFile << header() << std::endl;
+    outFile << row() << std::endl;
+    return true;
+}
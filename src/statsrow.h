@@ -0,0 +1,31 @@
+#ifndef STATSROW_H
+#define STATSROW_H
+
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * One row of a ';' separated stats file, added column by column: the header and the row are joined from the same list,
+ * so they cannot drift apart.
+ */
+class StatsRow {
+    public:
+        template <typename T>
+        void add(const std::string& name, const T& value) {
+            std::ostringstream text;
+            text << value;
+            columns.emplace_back(name, text.str());
+        }
+
+        std::string header() const;
+        std::string row() const;
+        // Appends the row to filename, under the header when the file is new or empty. A file that starts with another
+        // header is left as it is and false returned, the row is then only printed
+        bool append(const std::string& filename) const;
+    private:
+        std::vector<std::pair<std::string, std::string>> columns;
+};
+
+#endif // STATSROW_H
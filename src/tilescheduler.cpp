@@ -0,0 +1,90 @@
+#include "tilescheduler.h"
+#include <chrono>
+#include <thread>
+
+void WorkStealingDeque::push(const TileJob& job) {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back(job);
+}
+
+bool WorkStealingDeque::pop(TileJob& job) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (jobs.empty()) return false;
+    job = jobs.front();
+    jobs.pop_front();
+    return true;
+}
+
+bool WorkStealingDeque::steal(TileJob& job) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (jobs.empty()) return false;
+    job = jobs.back();
+    jobs.pop_back();
+    return true;
+}
+
+TileScheduler::TileScheduler(unsigned int numThreads)
+    : numThreads(numThreads), deques(numThreads), remainingJobs(0), numPasses(0) {}
+
+void TileScheduler::run(int numTiles, int numPasses, const std::function<void(unsigned int thread, const TileJob& job)>& work) {
+    this->numPasses = numPasses;
+    tileTimes.assign(numTiles, 0.0);
+    jobsRun.assign(numThreads, 0);
+    jobsStolen.assign(numThreads, 0);
+
+    if (numTiles <= 0 || numPasses <= 0) return;
+
+    remainingJobs = numTiles * numPasses;
+    for (int tile = 0; tile < numTiles; ++tile) {
+        deques[tile % numThreads].push({tile, 0});
+    }
+
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < numThreads; ++t) {
+        workers.emplace_back(&TileScheduler::worker, this, t, std::cref(work));
+    }
+    // the calling thread works too
+    worker(0, work);
+
+    for (std::thread& w : workers) {
+        w.join();
+    }
+}
+
+void TileScheduler::worker(unsigned int thread, const std::function<void(unsigned int thread, const TileJob& job)>& work) {
+    TileJob job;
+    while (remainingJobs.load() > 0) {
+        if (!findJob(thread, job)) {
+            // Everything left is running on other threads, their next passes may still show up
+            std::this_thread::yield();
+            continue;
+        }
+
+        const auto start{std::chrono::steady_clock::now()};
+        work(thread, job);
+        const auto finish{std::chrono::steady_clock::now()};
+        const std::chrono::duration<double> elapsed_seconds{finish - start};
+
+        // passes of the same tile never run at the same time, so no other thread touches this entry
+        tileTimes[job.tile] += elapsed_seconds.count();
+        jobsRun[thread]++;
+
+        if (job.pass + 1 < numPasses) {
+            deques[thread].push({job.tile, job.pass + 1});
+        }
+        remainingJobs--;
+    }
+}
+
+bool TileScheduler::findJob(unsigned int thread, TileJob& job) {
+    if (deques[thread].pop(job)) return true;
+
+    for (unsigned int i = 1; i < numThreads; ++i) {
+        unsigned int victim = (thread + i) % numThreads;
+        if (deques[victim].steal(job)) {
+            jobsStolen[thread]++;
+            return true;
+        }
+    }
+    return false;
+}
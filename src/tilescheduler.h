@@ -0,0 +1,54 @@
+#ifndef TILESCHEDULER_H
+#define TILESCHEDULER_H
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// One unit of work: a sample pass over one screen tile
+struct TileJob {
+    int tile;
+    int pass;
+};
+
+// Double-ended job queue of a worker: the owner takes from the front, thieves take from the back
+class WorkStealingDeque {
+    public:
+        void push(const TileJob& job);
+        bool pop(TileJob& job);
+        bool steal(TileJob& job);
+    private:
+        std::mutex mutex;
+        std::deque<TileJob> jobs;
+};
+
+/**
+ * Runs every pass of every tile across a pool of threads.
+ * Tiles are dealt round-robin to per-thread deques; once a pass of a tile finishes, the next pass
+ * of that tile goes back to the deque of the thread that ran it, so all tiles get a first pass before
+ * being refined. Idle threads steal from the others until every pass is done.
+ */
+class TileScheduler {
+    public:
+        TileScheduler(unsigned int numThreads);
+
+        // Seconds spent on each tile over all its passes in the last run
+        std::vector<double> tileTimes;
+        // Number of jobs each thread ran and stole in the last run
+        std::vector<int> jobsRun;
+        std::vector<int> jobsStolen;
+
+        void run(int numTiles, int numPasses, const std::function<void(unsigned int thread, const TileJob& job)>& work);
+    private:
+        unsigned int numThreads;
+        std::vector<WorkStealingDeque> deques;
+        std::atomic<int> remainingJobs;
+        int numPasses;
+
+        void worker(unsigned int thread, const std::function<void(unsigned int thread, const TileJob& job)>& work);
+        bool findJob(unsigned int thread, TileJob& job);
+};
+
+#endif // TILESCHEDULER_H
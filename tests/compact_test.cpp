@@ -0,0 +1,85 @@
+#include <string>
+#include <vector>
+#include "octree.h"
+#include "test_util.h"
+
+/**
+ * Compact nodes against the full ones: decoded top-down from the root box, as the traversals do, every child box must
+ * hold the full box of the child exactly, and be at most a quantization step larger on each side. Checked right after a build,
+ * and after inserts that split leaves and add children to internal nodes, which moves their sibling blocks to the end
+ * of the tree, past the nodes below them.
+ */
+
+static void checkCompactBoxes(const std::string& name, Octree& octree) {
+    octree.setCompactData();
+    const std::vector<GPUOctreeNode>& nodes = octree.flattenedTree;
+    CHECK(octree.compactTree.size() == nodes.size(), name << ": " << octree.compactTree.size() << " compact nodes for " << nodes.size());
+
+    std::vector<glm::vec3> decodedMin(nodes.size()), decodedMax(nodes.size());
+    decodedMin[0] = nodes[0].min;
+    decodedMax[0] = nodes[0].max;
+    std::vector<int> stack = {0};
+    int checked = 0, wrong = 0;
+    while (!stack.empty()) {
+        int parent = stack.back();
+        stack.pop_back();
+        const GPUCompactNode& compact = octree.compactTree[parent];
+        // rounded outwards: the decoded box holds the full one exactly, and float rounding may add a step to it
+        glm::vec3 step = (decodedMax[parent] - decodedMin[parent]) * 0.0625f;
+        glm::vec3 slack = step * 1e-3f + glm::vec3(1e-4f);
+
+        for (int octant = 0; octant < 8; ++octant) {
+            if (!(nodes[parent].childMask & (1u << octant))) continue;
+            int child = childIndex(nodes[parent].childrenOffset, nodes[parent].childMask, octant);
+            decodeCompactChildBox(compact, octant, decodedMin[parent], decodedMax[parent], decodedMin[child], decodedMax[child]);
+            stack.push_back(child);
+
+            const GPUOctreeNode& full = nodes[child];
+            if (glm::any(glm::greaterThan(full.min, full.max))) continue; // an emptied leaf, nothing to hold
+            bool holds = glm::all(glm::lessThanEqual(decodedMin[child], full.min)) && glm::all(glm::greaterThanEqual(decodedMax[child], full.max));
+            bool tight = glm::all(glm::greaterThanEqual(decodedMin[child], full.min - step - slack)) && glm::all(glm::lessThanEqual(decodedMax[child], full.max + step + slack));
+            checked++;
+            if (!holds || !tight) wrong++;
+        }
+    }
+    CHECK(wrong == 0, name << ": " << wrong << " of " << checked << " decoded child boxes do not match the full ones");
+}
+
+int main() {
+    // a dense cluster in one corner and two spheres setting the root box, so most octants of the upper levels are empty
+    std::mt19937 rng(5);
+    std::vector<Sphere> spheres;
+    for (int i = 0; i < 300; ++i) {
+        glm::vec3 center(uniform(rng, -19.0f, -13.0f), uniform(rng, -19.0f, -13.0f), uniform(rng, -19.0f, -13.0f));
+        spheres.push_back(Sphere(center, uniform(rng, 0.1f, 0.5f)));
+    }
+    spheres.push_back(Sphere(glm::vec3(-20.0f), 0.5f));
+    spheres.push_back(Sphere(glm::vec3(20.0f), 0.5f));
+
+    for (int tightBounds = 0; tightBounds < 2; ++tightBounds) {
+        for (int mode : {TopDownBuild, MortonBuild, SAHBuild}) {
+            const std::string name = std::string(mode == TopDownBuild ? "top-down" : mode == MortonBuild ? "morton" : "sah") + (tightBounds ? " tight" : "");
+            std::vector<Sphere> scene = spheres;
+            Octree octree(8, 4, 1, static_cast<OctreeBuildMode>(mode), tightBounds);
+            octree.build(scene);
+            checkCompactBoxes(name + " as built", octree);
+
+            // new children in the empty octants of the root and of the cluster's ancestors, then enough spheres in one
+            // place to split its leaf several times
+            size_t nodesBefore = octree.flattenedTree.size();
+            for (const glm::vec3& center : {glm::vec3(15.0f, -15.0f, -15.0f), glm::vec3(-15.0f, 15.0f, -15.0f), glm::vec3(-5.0f, -15.0f, -15.0f)}) {
+                CHECK(octree.insert(scene, Sphere(center, 0.5f)) >= 0, name << ": sphere at " << center.x << " " << center.y << " " << center.z << " did not fit");
+            }
+            for (int i = 0; i < 20; ++i) {
+                glm::vec3 center(uniform(rng, 14.0f, 14.5f), uniform(rng, -15.0f, -14.5f), uniform(rng, -15.0f, -14.5f));
+                CHECK(octree.insert(scene, Sphere(center, 0.05f)) >= 0, name << ": insert " << i << " did not fit");
+            }
+            CHECK(octree.unusedNodes > 0, name << ": no sibling block was moved, the inserts do not test the order of the nodes");
+            CHECK(octree.flattenedTree.size() > nodesBefore, name << ": no node was added");
+            checkCompactBoxes(name + " after inserts", octree);
+        }
+    }
+
+    if (failedChecks == 0) std::cout << "All compact boxes match the full ones" << std::endl;
+    return failedChecks;
+}
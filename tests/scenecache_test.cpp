@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "octree.h"
+#include "scenecache.h"
+#include "test_util.h"
+
+/**
+ * A scene written by SceneCache::save and read back: the same spheres, nodes, object indices, compact nodes and root cell,
+ * the same hits, through ropes too. Then the files open must turn away: another key, the other looseness, a truncated
+ * file, and loading into an octree of the other kind.
+ */
+
+static bool sameSphere(const Sphere& a, const Sphere& b) {
+    return a.center == b.center && a.radius == b.radius && a.materialType == b.materialType && a.albedo == b.albedo &&
+           a.fuzz == b.fuzz && a.refractionIndex == b.refractionIndex;
+}
+
+static bool sameNode(const GPUOctreeNode& a, const GPUOctreeNode& b) {
+    return a.min == b.min && a.max == b.max && a.childrenOffset == b.childrenOffset && a.objectsOffset == b.objectsOffset &&
+           a.objectCount == b.objectCount && a.childMask == b.childMask && a.split == b.split;
+}
+
+static bool sameCompactNode(const GPUCompactNode& a, const GPUCompactNode& b) {
+    return a.offset == b.offset && a.info == b.info && std::equal(std::begin(a.childBoxes), std::end(a.childBoxes), std::begin(b.childBoxes));
+}
+
+// Closest hits through the octree, with the compact nodes and the ropes where the tree has them
+static std::vector<RayHit> traceScene(const std::vector<Sphere>& spheres, const Octree& octree, const std::vector<Ray>& rays, bool ropes) {
+    CPURaytracer raytracer(1, 1, 1);
+    raytracer.setScene(spheres, octree);
+    raytracer.useOctree = 1;
+    raytracer.useCompactNodes = !octree.compactTree.empty();
+    raytracer.useRopes = ropes;
+    raytracer.mailboxSize = 0;
+    return traceRays(raytracer, rays);
+}
+
+static void checkRoundTrip(OctreeBuildMode mode, bool tightBounds, const std::vector<Sphere>& spheres, const std::vector<Ray>& rays) {
+    const char* modeNames[] = {"top-down", "morton", "loose", "sah"};
+    const std::string name = std::string(modeNames[mode]) + (tightBounds ? " tight" : "");
+    const std::string filename = "scenecache_test_" + std::to_string(mode) + "_" + std::to_string(tightBounds) + ".bin";
+    const uint64_t key = 0x5EED0000ull + mode * 2 + tightBounds;
+
+    Octree octree(6, 4, 1, mode, tightBounds);
+    octree.build(spheres);
+    if (!octree.isLoose()) octree.setCompactData();
+    octree.visitOrdered = true;
+    CHECK(SceneCache::save(filename, key, spheres, octree), name << ": " << filename << " was not written");
+
+    SceneCache cache;
+    if (!cache.open(filename, key, octree.isLoose())) {
+        CHECK(false, name << ": " << filename << " did not open");
+        std::remove(filename.c_str());
+        return;
+    }
+    const std::vector<Sphere> loadedSpheres = cache.loadSpheres();
+    Octree loaded(6, 4, 1, mode, tightBounds);
+    cache.loadOctree(loaded);
+    cache.close();
+
+    CHECK(loadedSpheres.size() == spheres.size(), name << ": " << loadedSpheres.size() << " spheres loaded of " << spheres.size());
+    for (size_t i = 0; i < std::min(loadedSpheres.size(), spheres.size()); ++i) {
+        CHECK(sameSphere(loadedSpheres[i], spheres[i]), name << ": sphere " << i << " differs");
+    }
+    CHECK(loaded.flattenedTree.size() == octree.flattenedTree.size(), name << ": " << loaded.flattenedTree.size() << " nodes loaded of " << octree.flattenedTree.size());
+    for (size_t i = 0; i < std::min(loaded.flattenedTree.size(), octree.flattenedTree.size()); ++i) {
+        CHECK(sameNode(loaded.flattenedTree[i], octree.flattenedTree[i]), name << ": node " << i << " differs");
+    }
+    CHECK(loaded.objectIndices == octree.objectIndices, name << ": the object indices differ");
+    CHECK(loaded.compactTree.size() == octree.compactTree.size(), name << ": " << loaded.compactTree.size() << " compact nodes loaded of " << octree.compactTree.size());
+    for (size_t i = 0; i < std::min(loaded.compactTree.size(), octree.compactTree.size()); ++i) {
+        CHECK(sameCompactNode(loaded.compactTree[i], octree.compactTree[i]), name << ": compact node " << i << " differs");
+    }
+    CHECK(loaded.getRootCellMin() == octree.getRootCellMin() && loaded.getRootCellMax() == octree.getRootCellMax(), name << ": the root cell differs");
+    CHECK(loaded.isLoose() == octree.isLoose() && loaded.visitOrdered, name << ": the header flags were not restored");
+
+    const std::vector<RayHit> reference = traceScene(spheres, octree, rays, false);
+    int mismatches = countMismatches(traceScene(loadedSpheres, loaded, rays, false), reference);
+    CHECK(mismatches == 0, name << ": " << mismatches << " of " << rays.size() << " rays differ after loading");
+    if (!loaded.isLoose()) {
+        loaded.setRopeData();
+        mismatches = countMismatches(traceScene(loadedSpheres, loaded, rays, true), reference);
+        CHECK(mismatches == 0, name << ": " << mismatches << " of " << rays.size() << " rays differ along the ropes of the loaded tree");
+    }
+
+    // misses, nothing stays mapped after them
+    CHECK(!cache.open(filename, key + 1, octree.isLoose()) && !cache.isOpen(), name << ": opened with another key");
+    CHECK(!cache.open(filename, key, !octree.isLoose()) && !cache.isOpen(), name << ": opened as " << (octree.isLoose() ? "not loose" : "loose"));
+    Octree other(6, 4, 1, octree.isLoose() ? TopDownBuild : LooseBuild);
+    bool thrown = false;
+    if (cache.open(filename, key, octree.isLoose())) {
+        try {
+            cache.loadOctree(other);
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        cache.close();
+    }
+    CHECK(thrown, name << ": loaded into an octree of the other kind");
+
+    std::ifstream inFile(filename, std::ios::binary);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+    inFile.close();
+    {
+        std::ofstream outFile(filename, std::ios::binary | std::ios::trunc);
+        outFile.write(bytes.data(), bytes.size() - 1);
+    }
+    CHECK(!cache.open(filename, key, octree.isLoose()) && !cache.isOpen(), name << ": opened a truncated file");
+    std::remove(filename.c_str());
+}
+
+int main() {
+    std::vector<Sphere> spheres = randomSpheres(12, 500);
+    std::mt19937 rng(13);
+    for (Sphere& sphere : spheres) {
+        sphere.materialType = static_cast<int>(rng() % 3);
+        sphere.albedo = glm::vec3(uniform(rng, 0.0f, 1.0f), uniform(rng, 0.0f, 1.0f), uniform(rng, 0.0f, 1.0f));
+        sphere.fuzz = uniform(rng, 0.0f, 0.5f);
+        sphere.refractionIndex = uniform(rng, 1.0f, 2.0f);
+    }
+    const std::vector<Ray> rays = randomRays(14, 2000);
+
+    for (int mode : {TopDownBuild, MortonBuild, LooseBuild, SAHBuild}) {
+        for (int tightBounds = 0; tightBounds < 2; ++tightBounds) {
+            checkRoundTrip(static_cast<OctreeBuildMode>(mode), tightBounds, spheres, rays);
+        }
+    }
+
+    if (failedChecks == 0) std::cout << "Every scene reads back from the cache as it was written" << std::endl;
+    return failedChecks;
+}
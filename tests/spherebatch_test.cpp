@@ -0,0 +1,133 @@
+#include <string>
+#include <vector>
+#include "octree.h"
+#include "spherebatch.h"
+#include "test_util.h"
+
+/**
+ * The batched sphere tests of every SimdLevel the CPU runs against the scalar one: the same slot and the very same t for
+ * random windows of a batch, aligned on the runs or starting and ending anywhere, with padding slots inside them, equally
+ * near spheres and rays from the centre of the padding. Then brute force in batches against brute force one by one.
+ */
+
+static const int RAYS = 400;
+
+// Runs of 1 to 40 spheres, some of them in a run twice or with a twin of the same centre and radius
+static SphereBatch randomBatch(uint32_t seed, std::vector<Sphere>& spheres, std::vector<size_t>& runStarts, std::vector<int>& runCounts) {
+    std::mt19937 rng(seed);
+    spheres = randomSpheres(seed, 300);
+    for (int i = 0; i < 40; ++i) spheres.push_back(spheres[rng() % spheres.size()]);
+
+    SphereBatch batch;
+    std::vector<int> indices;
+    for (int run = 0; run < 60; ++run) {
+        indices.clear();
+        int count = 1 + static_cast<int>(rng() % 40);
+        for (int i = 0; i < count; ++i) {
+            indices.push_back(i > 0 && rng() % 8 == 0 ? indices[rng() % i] : static_cast<int>(rng() % spheres.size()));
+        }
+        runStarts.push_back(batch.append(spheres, indices.data(), count));
+        runCounts.push_back(count);
+    }
+    return batch;
+}
+
+// Rays of randomRays, towards the spheres of the batch and from the origin, where the padding slots are centred
+static std::vector<Ray> batchRays(uint32_t seed, const std::vector<Sphere>& spheres) {
+    std::vector<Ray> rays = randomRays(seed, RAYS);
+    std::mt19937 rng(seed);
+    for (int i = 0; i < RAYS; ++i) {
+        Ray ray;
+        ray.origin = i % 4 == 0 ? glm::vec3(0.0f) : glm::vec3(uniform(rng, -30.0f, 30.0f), uniform(rng, -10.0f, 10.0f), uniform(rng, -30.0f, 30.0f));
+        glm::vec3 target = spheres[rng() % spheres.size()].center;
+        if (target == ray.origin) target.x += 1.0f;
+        ray.direction = glm::normalize(target - ray.origin);
+        rays.push_back(ray);
+    }
+    return rays;
+}
+
+static void checkWindow(const std::string& name, SimdLevel level, const SphereBatch& batch, size_t first, int count, const Ray& ray,
+                        float t_min, float t_max, int& hits) {
+    float scalarT = t_max, levelT = t_max;
+    int scalarSlot = nearestSphereHit(ScalarSimd, batch, first, count, ray.origin, ray.direction, t_min, scalarT);
+    int levelSlot = nearestSphereHit(level, batch, first, count, ray.origin, ray.direction, t_min, levelT);
+    CHECK(levelSlot == scalarSlot && levelT == scalarT, name << ", window " << first << "+" << count << ": slot " << levelSlot << " at t "
+                                                         << levelT << ", scalar slot " << scalarSlot << " at t " << scalarT);
+    CHECK(scalarSlot == -1 || (scalarSlot >= int(first) && scalarSlot < int(first) + count && batch.ids[scalarSlot] >= 0),
+          name << ", window " << first << "+" << count << ": slot " << scalarSlot << " is not a sphere of the window");
+    if (scalarSlot >= 0) hits++;
+}
+
+static void checkKernels(SimdLevel level) {
+    const std::string name = simdLevelName(level);
+    std::vector<Sphere> spheres;
+    std::vector<size_t> runStarts;
+    std::vector<int> runCounts;
+    const SphereBatch batch = randomBatch(7, spheres, runStarts, runCounts);
+    const std::vector<Ray> rays = batchRays(8, spheres);
+    std::mt19937 rng(9);
+
+    int hits = 0;
+    for (const Ray& ray : rays) {
+        // whole runs, as the traversals test them, with the window of the ray open or already cut by a hit
+        for (size_t run = 0; run < runStarts.size(); ++run) {
+            checkWindow(name + " run", level, batch, runStarts[run], runCounts[run], ray, 0.001f, FLT_MAX, hits);
+            checkWindow(name + " cut run", level, batch, runStarts[run], runCounts[run], ray, uniform(rng, 0.0f, 10.0f), uniform(rng, 10.0f, 40.0f), hits);
+        }
+        // windows from any slot, padding and several runs included
+        for (int window = 0; window < 20; ++window) {
+            size_t first = rng() % batch.ids.size();
+            int count = static_cast<int>(rng() % std::min<size_t>(batch.ids.size() - first + 1, 70));
+            checkWindow(name + " window", level, batch, first, count, ray, 0.001f, FLT_MAX, hits);
+        }
+    }
+    CHECK(hits > 0, name << ": no ray hit anything, nothing was compared");
+
+    // equally near spheres: the first slot, whichever lane it is in
+    std::vector<Sphere> same(1, Sphere(glm::vec3(0.0f, 0.0f, 10.0f), 1.0f));
+    std::vector<int> indices(37, 0);
+    SphereBatch twins;
+    twins.append(same, indices.data(), 3);
+    twins.append(same, indices.data(), 37);
+    Ray ray;
+    ray.origin = glm::vec3(0.0f);
+    ray.direction = glm::vec3(0.0f, 0.0f, 1.0f);
+    for (size_t first = 0; first < 20; ++first) {
+        float t = FLT_MAX;
+        int slot = nearestSphereHit(level, twins, first, static_cast<int>(twins.ids.size() - first), ray.origin, ray.direction, 0.001f, t);
+        int expected = first < 3 ? static_cast<int>(first) : static_cast<int>(std::max<size_t>(first, 8));
+        CHECK(slot == expected && t == 9.0f, name << ", equally near spheres from slot " << first << ": slot " << slot << " at t " << t
+                                                  << " instead of " << expected);
+    }
+}
+
+// Brute force with the batches of each level against testing every sphere with sphereHit
+static void checkBruteForce(SimdLevel level) {
+    const std::vector<Sphere> spheres = randomSpheres(10, 500);
+    const std::vector<Ray> rays = randomRays(11, 2000);
+    Octree octree(6, 4, 1);
+    octree.build(spheres); // not traversed, but gathered with the batches
+    CPURaytracer raytracer(1, 1, 1);
+    raytracer.setScene(spheres, octree);
+    raytracer.useOctree = 0;
+    raytracer.mailboxSize = 0;
+    raytracer.useSphereBatches = false;
+    const std::vector<RayHit> reference = traceRays(raytracer, rays);
+
+    raytracer.useSphereBatches = true;
+    raytracer.simdLevel = level;
+    int mismatches = countMismatches(traceRays(raytracer, rays), reference);
+    CHECK(mismatches == 0, simdLevelName(level) << " brute force: " << mismatches << " of " << rays.size() << " rays differ from one by one");
+}
+
+int main() {
+    for (int level = ScalarSimd; level <= detectSimdLevel(); ++level) {
+        checkKernels(static_cast<SimdLevel>(level));
+        checkBruteForce(static_cast<SimdLevel>(level));
+    }
+    if (detectSimdLevel() != AVX512Simd) std::cout << "Only the kernels up to " << simdLevelName(detectSimdLevel()) << " run on this CPU" << std::endl;
+
+    if (failedChecks == 0) std::cout << "All sphere batch kernels match the scalar one" << std::endl;
+    return failedChecks;
+}
@@ -0,0 +1,97 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <glm/glm.hpp>
+#include <cfloat>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "cpuraytracer.h"
+#include "sphere.h"
+
+/**
+ * Helpers of the tests: each one is a plain executable that runs its checks and returns how many failed, so ctest needs
+ * nothing else. Scenes and rays come from fixed seeds through std::mt19937 alone, whose output is the same everywhere
+ * (the standard distributions are not).
+ */
+
+inline int failedChecks = 0;
+
+#define CHECK(condition, message)                                                                                  \
+    do {                                                                                                           \
+        if (!(condition)) {                                                                                        \
+            failedChecks++;                                                                                        \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " << #condition << " failed: " << message << std::endl; \
+        }                                                                                                          \
+    } while (0)
+
+// Uniform in [lo, hi)
+inline float uniform(std::mt19937& rng, float lo, float hi) {
+    return lo + (hi - lo) * float(rng() >> 8) * (1.0f / 16777216.0f);
+}
+
+// count spheres in a flat box, large enough next to each other that most of them overlap several cells
+inline std::vector<Sphere> randomSpheres(uint32_t seed, int count) {
+    std::mt19937 rng(seed);
+    std::vector<Sphere> spheres;
+    spheres.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        glm::vec3 center(uniform(rng, -20.0f, 20.0f), uniform(rng, -5.0f, 5.0f), uniform(rng, -20.0f, 20.0f));
+        spheres.push_back(Sphere(center, uniform(rng, 0.2f, 1.5f)));
+    }
+    return spheres;
+}
+
+// count rays from around and inside that box, every 8th along an axis so some direction components are zero
+inline std::vector<Ray> randomRays(uint32_t seed, int count) {
+    std::mt19937 rng(seed);
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        Ray ray;
+        ray.origin = glm::vec3(uniform(rng, -30.0f, 30.0f), uniform(rng, -10.0f, 10.0f), uniform(rng, -30.0f, 30.0f));
+        glm::vec3 direction(uniform(rng, -1.0f, 1.0f), uniform(rng, -1.0f, 1.0f), uniform(rng, -1.0f, 1.0f));
+        if (i % 8 == 0) {
+            direction = glm::vec3(0.0f);
+            direction[i / 8 % 3] = i % 16 == 0 ? 1.0f : -1.0f;
+        }
+        ray.direction = glm::normalize(direction);
+        rays.push_back(ray);
+    }
+    return rays;
+}
+
+// What a ray hit first, enough to tell two traversals apart
+struct RayHit {
+    bool hit;
+    float t;
+    glm::vec3 normal;
+
+    bool operator==(const RayHit& other) const {
+        return hit == other.hit && (!hit || (t == other.t && normal == other.normal));
+    }
+};
+
+// Closest hit of every ray with the current settings of raytracer
+inline std::vector<RayHit> traceRays(CPURaytracer& raytracer, const std::vector<Ray>& rays) {
+    raytracer.prepareFrame();
+    std::vector<RayHit> hits;
+    hits.reserve(rays.size());
+    for (const Ray& ray : rays) {
+        IntersectInfo rec;
+        bool hit = raytracer.intersect(ray, 0.001f, FLT_MAX, rec);
+        hits.push_back(RayHit{hit, hit ? rec.t : 0.0f, hit ? rec.normal : glm::vec3(0.0f)});
+    }
+    return hits;
+}
+
+inline int countMismatches(const std::vector<RayHit>& hits, const std::vector<RayHit>& reference) {
+    int mismatches = 0;
+    for (size_t i = 0; i < hits.size(); ++i) {
+        if (!(hits[i] == reference[i])) mismatches++;
+    }
+    return mismatches;
+}
+
+#endif // TEST_UTIL_H
@@ -0,0 +1,383 @@
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "octree.h"
+#include "parallel.h"
+#include "test_util.h"
+
+/**
+ * Every traversal of the CPU renderer against brute force on a fixed scene: each build mode with and without tight
+ * bounds, in every layout, and after incremental updates. The closest hit must be the very same, t and normal, since
+ * the spheres are tested with the same arithmetic either way, and so must the frames rendered with packets of camera rays.
+ */
+
+static const int SPHERES = 600;
+static const int RAYS = 2000;
+static const int LARGE_SCENE = 3 * static_cast<int>(PARALLEL_BUILD_GRAIN);
+
+static bool sameNodes(const GPUOctreeNode& a, const GPUOctreeNode& b) {
+    return a.min == b.min && a.max == b.max && a.split == b.split && a.childrenOffset == b.childrenOffset &&
+           a.objectsOffset == b.objectsOffset && a.objectCount == b.objectCount && a.childMask == b.childMask;
+}
+
+static bool sameTree(const Octree& a, const Octree& b) {
+    if (a.flattenedTree.size() != b.flattenedTree.size() || a.objectIndices != b.objectIndices) return false;
+    for (size_t i = 0; i < a.flattenedTree.size(); ++i) {
+        if (!sameNodes(a.flattenedTree[i], b.flattenedTree[i])) return false;
+    }
+    return true;
+}
+
+// The stack traversal, and the compact and rope ones where the tree has them, with sphere batches and the mailbox on and off
+static void checkTraversals(const std::string& name, const std::vector<Sphere>& spheres, Octree& octree, const std::vector<Ray>& rays) {
+    CPURaytracer raytracer(1, 1, 1);
+    raytracer.setScene(spheres, octree);
+    raytracer.useRopes = false;
+    raytracer.useCompactNodes = 0;
+    raytracer.useSphereBatches = false;
+    raytracer.mailboxSize = 0;
+    raytracer.useOctree = 0;
+    const std::vector<RayHit> reference = traceRays(raytracer, rays);
+    raytracer.useOctree = 1;
+
+    if (!octree.isLoose()) {
+        octree.setCompactData();
+        octree.setRopeData();
+    }
+    const char* traversalNames[] = {"stack", "compact", "ropes"};
+    for (int traversal = 0; traversal < 3; ++traversal) {
+        if (traversal > 0 && octree.isLoose()) break;
+        raytracer.useCompactNodes = traversal == 1;
+        raytracer.useRopes = traversal == 2;
+        for (int batches = 0; batches < 2; ++batches) {
+            for (int mailboxSize : {0, Mailbox::MAX_SIZE}) {
+                raytracer.useSphereBatches = batches == 1;
+                raytracer.mailboxSize = mailboxSize;
+                int mismatches = countMismatches(traceRays(raytracer, rays), reference);
+                CHECK(mismatches == 0, name << ", " << traversalNames[traversal] << " traversal, batches " << batches << ", mailbox "
+                                            << mailboxSize << ": " << mismatches << " of " << rays.size() << " rays differ from brute force");
+            }
+        }
+    }
+}
+
+// Frames with the camera rays traced in packets of each size against one by one, from inside the scene with a wide view so
+// the rays of the blocks around the middle of the image go different ways
+static void checkPackets(const std::string& name, const std::vector<Sphere>& spheres, const Octree& octree) {
+    CPURaytracer raytracer(48, 32, 1);
+    raytracer.setScene(spheres, octree);
+    raytracer.useRopes = false;
+    raytracer.useCompactNodes = 0;
+    const glm::vec3 eye(0.0f, 1.0f, -15.0f);
+    const glm::mat4 view = glm::lookAt(eye, glm::vec3(2.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    raytracer.packetSize = 0;
+    raytracer.renderFrame(view, eye, 90.0f);
+    const std::vector<glm::vec3> reference = raytracer.framebuffer;
+
+    for (int packetSize : {4, 8, 16}) {
+        raytracer.packetSize = packetSize;
+        raytracer.renderFrame(view, eye, 90.0f);
+        int mismatches = 0;
+        for (size_t pixel = 0; pixel < reference.size(); ++pixel) {
+            if (raytracer.framebuffer[pixel] != reference[pixel]) mismatches++;
+        }
+        CHECK(mismatches == 0, name << ", packets of " << packetSize << ": " << mismatches << " of " << reference.size() << " pixels differ from single rays");
+    }
+}
+
+// Every reachable node after its parent, the root first
+static bool parentsFirst(const Octree& octree) {
+    std::vector<int> stack = {0};
+    while (!stack.empty()) {
+        const GPUOctreeNode& node = octree.flattenedTree[stack.back()];
+        int parent = stack.back();
+        stack.pop_back();
+        for (int i = 0; i < __builtin_popcount(node.childMask); ++i) {
+            if (node.childrenOffset + i <= parent) return false;
+            stack.push_back(node.childrenOffset + i);
+        }
+    }
+    return true;
+}
+
+// Most visited nodes first, with the visits of a small frame as cpu_main counts them. The ropes visit the leaves they
+// jump to without their ancestors, so a leaf can be busier than its parent
+static void checkProfiledLayout(const std::string& name, const std::vector<Sphere>& spheres, Octree& octree, const std::vector<Ray>& rays) {
+    for (int ropes = 0; ropes < (octree.isLoose() ? 1 : 2); ++ropes) {
+        const std::string profiled = name + ", profiled layout" + (ropes ? " from ropes" : "");
+        if (ropes) octree.setRopeData();
+        CPURaytracer raytracer(32, 24, 1);
+        raytracer.setScene(spheres, octree);
+        raytracer.useRopes = ropes == 1;
+        raytracer.useCompactNodes = 0;
+        raytracer.countNodeVisits = true;
+        const glm::vec3 eye(0.0f, 8.0f, -35.0f);
+        raytracer.renderFrame(glm::lookAt(eye, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f)), eye, 45.0f);
+        octree.reorderByVisits(raytracer.nodeVisits);
+        CHECK(parentsFirst(octree), profiled << ": a node comes before its parent");
+        checkTraversals(profiled, spheres, octree, rays);
+    }
+
+    // the worst case of it: every node busier than its parent
+    std::vector<uint64_t> visits(octree.flattenedTree.size(), 0);
+    std::vector<int> stack = {0};
+    while (!stack.empty()) {
+        const GPUOctreeNode& node = octree.flattenedTree[stack.back()];
+        uint64_t count = visits[stack.back()] + 1;
+        stack.pop_back();
+        for (int i = 0; i < __builtin_popcount(node.childMask); ++i) {
+            visits[node.childrenOffset + i] = count;
+            stack.push_back(node.childrenOffset + i);
+        }
+    }
+    octree.reorderByVisits(visits);
+    CHECK(parentsFirst(octree), name << ", profiled layout deepest first: a node comes before its parent");
+    checkTraversals(name + ", profiled layout deepest first", spheres, octree, rays);
+}
+
+// The same tree whatever the number of threads, on a scene large enough for every parallel part of the builds: subtrees
+// of more than PARALLEL_BUILD_GRAIN spheres on other threads, nodes of twice as many distributed in chunks, and the chunks
+// of the Morton codes and sort
+static void checkParallelBuild(const std::string& name, OctreeBuildMode mode, bool tightBounds, bool autoTune, const std::vector<Sphere>& spheres) {
+    Octree octree(6, 8, 1, mode, tightBounds, autoTune);
+    octree.build(spheres);
+    Octree parallel(6, 8, 4, mode, tightBounds, autoTune);
+    parallel.build(spheres);
+    CHECK(sameTree(octree, parallel), name << ": the build on 4 threads differs from the one on 1");
+}
+
+static void checkBuild(OctreeBuildMode mode, bool tightBounds, bool autoTune, const std::vector<Sphere>& spheres, const std::vector<Sphere>& largeScene,
+                       const std::vector<Ray>& rays) {
+    const char* modeNames[] = {"top-down", "morton", "loose", "sah"};
+    const std::string name = std::string(modeNames[mode]) + (tightBounds ? " tight" : "") + (autoTune ? " auto-tuned" : "");
+
+    Octree octree(6, 4, 1, mode, tightBounds, autoTune);
+    octree.build(spheres);
+    checkTraversals(name, spheres, octree, rays);
+    checkPackets(name, spheres, octree);
+    checkParallelBuild(name, mode, tightBounds, autoTune, largeScene);
+
+    const char* layoutNames[] = {"bfs", "dfs", "veb"};
+    for (int layout : {DFSLayout, VEBLayout, BFSLayout}) {
+        octree.setLayout(static_cast<NodeLayout>(layout));
+        CHECK(parentsFirst(octree), name << ", " << layoutNames[layout] << " layout: a node comes before its parent");
+        checkTraversals(name + ", " + layoutNames[layout] + " layout", spheres, octree, rays);
+    }
+
+    checkProfiledLayout(name, spheres, octree, rays);
+}
+
+// Whether a leaf reachable from the root still lists sphere
+static bool referenced(const Octree& octree, int sphere) {
+    std::vector<int> stack = {0};
+    while (!stack.empty()) {
+        const GPUOctreeNode& node = octree.flattenedTree[stack.back()];
+        stack.pop_back();
+        for (int i = 0; i < node.objectCount; ++i) {
+            if (octree.objectIndices[node.objectsOffset + i] == sphere) return true;
+        }
+        for (int i = 0; i < __builtin_popcount(node.childMask); ++i) stack.push_back(node.childrenOffset + i);
+    }
+    return false;
+}
+
+// refitOrRebuild only redoes the costs, compact nodes and ropes of the nodes it wrote, they must be those of the whole tree
+static void checkRefreshed(const std::string& name, const std::vector<Sphere>& spheres, Octree& octree) {
+    const std::vector<GPUCompactNode> compactTree = octree.compactTree;
+    const std::vector<GPURopeNode> ropeTree = octree.ropeTree;
+    const double predictedCost = octree.predictedCost;
+    if (!octree.isLoose()) {
+        octree.setCompactData();
+        octree.setRopeData();
+    }
+    CHECK(compactTree.size() == octree.compactTree.size() && ropeTree.size() == octree.ropeTree.size(),
+          name << ": " << compactTree.size() << " compact nodes and " << ropeTree.size() << " ropes kept for " << octree.flattenedTree.size() << " nodes");
+    int differing = 0;
+    std::vector<int> stack = {0};
+    while (!stack.empty() && compactTree.size() == octree.compactTree.size() && ropeTree.size() == octree.ropeTree.size()) {
+        const int index = stack.back();
+        const GPUOctreeNode& node = octree.flattenedTree[index];
+        stack.pop_back();
+        if (!compactTree.empty() && std::memcmp(&compactTree[index], &octree.compactTree[index], sizeof(GPUCompactNode)) != 0) differing++;
+        if (!ropeTree.empty() && std::memcmp(&ropeTree[index], &octree.ropeTree[index], sizeof(GPURopeNode)) != 0) differing++;
+        for (int i = 0; i < __builtin_popcount(node.childMask); ++i) stack.push_back(node.childrenOffset + i);
+    }
+    CHECK(differing == 0, name << ": " << differing << " compact nodes and ropes differ from those of the whole tree");
+
+    // a relayout forgets the node costs, the next refitOrRebuild works them out over the whole tree again
+    std::vector<Sphere> unmoved = spheres;
+    octree.setLayout(octree.getLayout());
+    octree.refitOrRebuild(unmoved, {}, {}, 10.0);
+    CHECK(octree.predictedCost == predictedCost, name << ": predicted cost " << predictedCost << ", over the whole tree " << octree.predictedCost);
+}
+
+// Inserts enough spheres in one place to split its leaves, removes and moves others, then lets refitOrRebuild move the rest
+static void checkUpdates(OctreeBuildMode mode, bool tightBounds, const std::vector<Sphere>& builtSpheres, const std::vector<Ray>& rays) {
+    const char* modeNames[] = {"top-down", "morton", "loose", "sah"};
+    const std::string name = std::string(modeNames[mode]) + (tightBounds ? " tight" : "") + " after updates";
+    std::vector<Sphere> spheres = builtSpheres;
+    Octree octree(6, 4, 1, mode, tightBounds);
+    octree.build(spheres);
+
+    std::mt19937 rng(4);
+    for (int i = 0; i < 40; ++i) {
+        glm::vec3 center(uniform(rng, 5.0f, 7.0f), uniform(rng, -1.0f, 1.0f), uniform(rng, 5.0f, 7.0f));
+        CHECK(octree.insert(spheres, Sphere(center, uniform(rng, 0.1f, 0.4f))) >= 0, name << ": insert " << i << " did not fit");
+    }
+    for (int i = 0; i < 30; ++i) {
+        int index = static_cast<int>(rng() % spheres.size());
+        if (spheres[index].radius == 0.0f) continue;
+        CHECK(octree.remove(spheres, index), name << ": sphere " << index << " was not found");
+        CHECK(!referenced(octree, index), name << ": sphere " << index << " is still in a leaf after its removal");
+        spheres[index].radius = 0.0f; // the slot stays, brute force must not hit it either
+    }
+    for (int i = 0; i < 30; ++i) {
+        int index = static_cast<int>(rng() % spheres.size());
+        if (spheres[index].radius == 0.0f) continue;
+        glm::vec3 center = spheres[index].center + glm::vec3(uniform(rng, -2.0f, 2.0f), uniform(rng, -1.0f, 1.0f), uniform(rng, -2.0f, 2.0f));
+        octree.update(spheres, index, center);
+    }
+    checkTraversals(name, spheres, octree, rays);
+
+    // small moves are refitted, then one out of the root cell forces a rebuild
+    std::vector<int> moved;
+    std::vector<glm::vec3> centers;
+    for (int index = 0; index < static_cast<int>(spheres.size()); index += 7) {
+        if (spheres[index].radius == 0.0f) continue;
+        moved.push_back(index);
+        centers.push_back(spheres[index].center + glm::vec3(uniform(rng, -0.5f, 0.5f), 0.0f, uniform(rng, -0.5f, 0.5f)));
+    }
+    octree.refitOrRebuild(spheres, moved, centers, 10.0);
+    // the sphere reaching furthest out moves in: a tight root box shrinks, every compact box below it moves
+    int outermost = 0;
+    for (int index = 0; index < static_cast<int>(spheres.size()); ++index) {
+        if (spheres[index].center.x + spheres[index].radius > spheres[outermost].center.x + spheres[outermost].radius) outermost = index;
+    }
+    octree.refitOrRebuild(spheres, {outermost}, {spheres[outermost].center - glm::vec3(2.0f, 0.0f, 0.0f)}, 10.0);
+    checkRefreshed(name + ", refitted", spheres, octree);
+    checkTraversals(name + ", refitted", spheres, octree, rays);
+
+    CHECK(octree.refitOrRebuild(spheres, {moved[0]}, {glm::vec3(100.0f, 0.0f, 0.0f)}, 10.0, 1.0f), name << ": leaving the root cell must rebuild");
+    checkTraversals(name + ", rebuilt", spheres, octree, rays);
+}
+
+// Inserts into one small cluster until the tree is deeper than its build left it, getStats must count the new levels too
+static void checkStatsAfterInserts() {
+    std::vector<Sphere> spheres = randomSpheres(5, 50);
+    Octree octree(10, 8, 1);
+    octree.build(spheres);
+    const int builtDepth = octree.treeDepth;
+
+    std::mt19937 rng(6);
+    for (int i = 0; i < 200; ++i) {
+        glm::vec3 center(uniform(rng, 5.0f, 5.5f), uniform(rng, 0.0f, 0.5f), uniform(rng, 5.0f, 5.5f));
+        CHECK(octree.insert(spheres, Sphere(center, uniform(rng, 0.01f, 0.03f))) >= 0, "stats after inserts: insert " << i << " did not fit");
+    }
+
+    int nodes = 0, leaves = 0, deepest = 0;
+    std::vector<std::pair<int, int>> stack = {{0, 0}};
+    while (!stack.empty()) {
+        const auto [index, depth] = stack.back();
+        const GPUOctreeNode& node = octree.flattenedTree[index];
+        stack.pop_back();
+        nodes++;
+        leaves += node.childMask == 0;
+        deepest = std::max(deepest, depth);
+        for (int i = 0; i < __builtin_popcount(node.childMask); ++i) stack.push_back({node.childrenOffset + i, depth + 1});
+    }
+    CHECK(deepest > builtDepth, "stats after inserts: the inserts left the tree " << deepest << " deep, as built, the case is not tested");
+
+    const OctreeStats stats = octree.getStats();
+    CHECK(int(stats.nodesPerDepth.size()) == deepest + 1 && int(stats.leavesPerDepth.size()) == deepest + 1,
+          "stats after inserts: " << stats.nodesPerDepth.size() << " depths counted for a tree " << deepest << " deep");
+    const int countedNodes = std::accumulate(stats.nodesPerDepth.begin(), stats.nodesPerDepth.end(), 0);
+    const int countedLeaves = std::accumulate(stats.leavesPerDepth.begin(), stats.leavesPerDepth.end(), 0);
+    CHECK(countedNodes == nodes && countedLeaves == leaves && stats.leafCount == leaves,
+          "stats after inserts: " << countedNodes << " nodes and " << countedLeaves << " leaves per depth, " << stats.leafCount << " leaves, the tree has "
+                                  << nodes << " nodes and " << leaves << " leaves");
+}
+
+// Two tiny spheres at the root split, apart only below MAX_TREE_DEPTH - 1 levels: the deepest tree an Octree may have, which
+// every traversal stack must hold. One level deeper is refused
+static void checkDeepestTree(const std::vector<Ray>& randomRays) {
+    std::vector<Sphere> spheres;
+    for (const glm::vec3& corner : {glm::vec3(-20.0f), glm::vec3(20.0f)}) spheres.push_back(Sphere(corner, 0.5f));
+    spheres.push_back(Sphere(glm::vec3(1e-6f), 1e-7f));
+    spheres.push_back(Sphere(glm::vec3(4e-6f), 1e-7f));
+    // from around the two of them, rays from afar cannot tell cells that small apart
+    std::vector<Ray> rays = randomRays;
+    for (Ray& ray : rays) ray.origin = glm::vec3(2.5e-6f) + ray.origin * 1e-6f;
+
+    for (int mode : {TopDownBuild, LooseBuild}) {
+        const std::string name = std::string("deepest tree, ") + (mode == TopDownBuild ? "top-down" : "loose");
+        Octree octree(MAX_TREE_DEPTH, 1, 1, static_cast<OctreeBuildMode>(mode));
+        octree.build(spheres);
+        CHECK(octree.treeDepth == MAX_TREE_DEPTH, name << ": the tree is " << octree.treeDepth << " deep, the case is not tested");
+        checkTraversals(name, spheres, octree, rays);
+    }
+
+    bool thrown = false;
+    try {
+        Octree deeper(MAX_TREE_DEPTH + 1, 1, 1);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    CHECK(thrown, "deepest tree: an octree of " << MAX_TREE_DEPTH + 1 << " levels was accepted");
+}
+
+// The Morton grid gives a sphere a reference in every cell it is within a small slack of, a sphere ending just short of the
+// root split is then in both halves, and must leave both
+static void checkMortonRemoval(const std::vector<Sphere>& builtSpheres) {
+    std::vector<Sphere> spheres = builtSpheres;
+    Octree octree(6, 4, 1, MortonBuild);
+    octree.build(spheres);
+    const glm::vec3 split = octree.flattenedTree[0].split;
+    const glm::vec3 extent = octree.getRootCellMax() - octree.getRootCellMin();
+    const float slack = 1e-6f * std::max(extent.x, std::max(extent.y, extent.z));
+    spheres.push_back(Sphere(glm::vec3(split.x - 1.0f - slack, split.y + 2.0f, split.z + 2.0f), 1.0f));
+    const int index = static_cast<int>(spheres.size()) - 1;
+    octree.build(spheres);
+
+    int halves = 0;
+    for (int octant : {2, 0}) { // the child on each side of the x split, above the others
+        const GPUOctreeNode& root = octree.flattenedTree[0];
+        if (!(root.childMask & (1u << (octant | 4 | 1)))) continue;
+        std::vector<int> stack = {childIndex(root.childrenOffset, root.childMask, octant | 4 | 1)};
+        bool found = false;
+        while (!stack.empty() && !found) {
+            const GPUOctreeNode& node = octree.flattenedTree[stack.back()];
+            stack.pop_back();
+            for (int i = 0; i < node.objectCount; ++i) found = found || octree.objectIndices[node.objectsOffset + i] == index;
+            for (int i = 0; i < __builtin_popcount(node.childMask); ++i) stack.push_back(node.childrenOffset + i);
+        }
+        halves += found;
+    }
+    CHECK(halves == 2, "morton removal: the sphere at the split is in " << halves << " halves of the root, the case is not tested");
+    CHECK(octree.remove(spheres, index), "morton removal: the sphere at the split was not found");
+    CHECK(!referenced(octree, index), "morton removal: the sphere at the split is still in a leaf after its removal");
+}
+
+int main() {
+    const std::vector<Sphere> spheres = randomSpheres(1, SPHERES);
+    const std::vector<Ray> rays = randomRays(2, RAYS);
+    std::vector<Sphere> largeScene = randomSpheres(3, LARGE_SCENE);
+    for (Sphere& sphere : largeScene) sphere.radius *= 0.2f; // as many spheres, not as many references
+
+    for (int mode = TopDownBuild; mode <= SAHBuild; ++mode) {
+        for (int tightBounds = 0; tightBounds < 2; ++tightBounds) {
+            checkBuild(static_cast<OctreeBuildMode>(mode), tightBounds, false, spheres, largeScene, rays);
+            checkUpdates(static_cast<OctreeBuildMode>(mode), tightBounds, spheres, rays);
+        }
+    }
+    checkBuild(TopDownBuild, false, true, spheres, largeScene, rays);
+    checkMortonRemoval(spheres);
+    checkStatsAfterInserts();
+    checkDeepestTree(rays);
+
+    if (failedChecks == 0) std::cout << "All traversals match brute force" << std::endl;
+    return failedChecks;
+}